@@ -1,20 +1,31 @@
-# CMake script to embed a Lua file as a C string
-# Usage: cmake -DLUA_FILE=<input> -DOUTPUT_FILE=<output> -P embed_lua.cmake
+# CMake script to embed a Lua chunk as a C byte array
+# Usage: cmake -DLUA_FILE=<input> -DOUTPUT_FILE=<output> [-DBINARY=ON] -P embed_lua.cmake
+#
+# With BINARY=ON, LUA_FILE is bytecode produced by tools/compile_lua and is
+# embedded as is. Otherwise it is Lua source (used when cross-compiling,
+# where the host cannot run compile_lua): the shebang line is removed, as
+# the engine loads the chunk from memory.
 
 if(NOT DEFINED LUA_FILE OR NOT DEFINED OUTPUT_FILE)
-    message(FATAL_ERROR "Usage: cmake -DLUA_FILE=<input> -DOUTPUT_FILE=<output> -P embed_lua.cmake")
+    message(FATAL_ERROR "Usage: cmake -DLUA_FILE=<input> -DOUTPUT_FILE=<output> [-DBINARY=ON] -P embed_lua.cmake")
 endif()
 
-# Read the Lua file
-file(READ "${LUA_FILE}" LUA_CONTENT)
+if(BINARY)
+    file(READ "${LUA_FILE}" LUA_HEX HEX)
+else()
+    file(READ "${LUA_FILE}" LUA_CONTENT)
+    # Remove shebang line if present (#!/usr/bin/env lua or similar)
+    string(REGEX REPLACE "^#![^\n]*\n" "\n" LUA_CONTENT "${LUA_CONTENT}")
+    string(HEX "${LUA_CONTENT}" LUA_HEX)
+endif()
 
-# Remove shebang line if present (#!/usr/bin/env lua or similar)
-string(REGEX REPLACE "^#![^\n]*\n" "" LUA_CONTENT "${LUA_CONTENT}")
+string(LENGTH "${LUA_HEX}" LUA_HEX_LENGTH)
+math(EXPR LUA_SIZE "${LUA_HEX_LENGTH} / 2")
 
-# Escape special characters for C string literal
-string(REPLACE "\\" "\\\\" LUA_CONTENT "${LUA_CONTENT}")
-string(REPLACE "\"" "\\\"" LUA_CONTENT "${LUA_CONTENT}")
-string(REPLACE "\n" "\\n\"\n\"" LUA_CONTENT "${LUA_CONTENT}")
+# 0xNN, 16 bytes per line
+string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," LUA_BYTES "${LUA_HEX}")
+string(REPEAT "0x[0-9a-f][0-9a-f]," 16 LUA_LINE)
+string(REGEX REPLACE "(${LUA_LINE})" "\\1\n  " LUA_BYTES "${LUA_BYTES}")
 
 # Generate the C file
 file(WRITE "${OUTPUT_FILE}"
@@ -23,8 +34,11 @@ file(WRITE "${OUTPUT_FILE}"
 
 #include \"default_lua_script.h\"
 
-const char *DEFAULT_LUA_SCRIPT =
-\"${LUA_CONTENT}\";
+const unsigned char DEFAULT_LUA_CHUNK[] = {
+  ${LUA_BYTES}
+};
+
+const size_t DEFAULT_LUA_CHUNK_SIZE = ${LUA_SIZE};
 ")
 
 message(STATUS "Generated ${OUTPUT_FILE} from ${LUA_FILE}")
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "engine_pool.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Lua {
+
+/// @brief One generation request sent to the daemon.
+struct DaemonRequest {
+  /// Working directory of the client: the script runs from there.
+  std::string cwd;
+  /// Absolute path of the script to run, or empty when `preset` is set.
+  std::string script;
+  std::string preset;
+};
+
+/// @brief Resident process running scripts for thin clients (send_request())
+/// over a Unix domain socket, so that a request pays neither the process
+/// start nor the engine setup.
+///
+/// A few engines are kept ready, created and configured ahead of time by a
+/// background thread. Each request takes one, runs its script and hands it
+/// back to that thread to be destroyed: state never leaks between requests.
+/// Requests are served one at a time, since each one runs from the client's
+/// working directory. Nothing reaches the daemon's terminal: output and
+/// errors go back to the client, and shell commands that would prompt fail
+/// unless the engines were configured with set_assume_yes().
+///
+/// Protocol, one request per connection:
+///
+///     cdirnuts 1\n  cwd <path>\n  (script <path> | preset <name>)\n  end\n
+///     -> <status> <output bytes> <error bytes>\n <output> <error>
+class Daemon {
+public:
+  /// @brief Path of a preset by name, nullopt if there is no such preset.
+  using ResolvePreset =
+      std::function<std::optional<std::string>(const std::string &)>;
+
+  /// @param socket_path
+  /// @param warm_engines Engines kept ready (at least 1).
+  /// @param configure Applied to each engine when it is created.
+  /// @param resolve_preset
+  Daemon(std::string socket_path, unsigned warm_engines,
+         EnginePool::Configure configure, ResolvePreset resolve_preset);
+  Daemon(const Daemon &) = delete;
+  Daemon &operator=(const Daemon &) = delete;
+  ~Daemon();
+
+  /// @brief `$DIRNUTS_DIR_PATH/cdirnuts.sock`, else
+  /// `$XDG_RUNTIME_DIR/cdirnuts.sock`, else `cdirnuts.sock` in a private
+  /// per-user directory of /tmp.
+  static std::string default_socket_path();
+
+  /// @brief Bind the socket and serve requests until stop(). Only clients
+  /// running as the same user are served.
+  /// @throws std::runtime_error if the socket cannot be bound, for instance
+  /// because another daemon already listens on it, or if another user could
+  /// replace it.
+  void serve();
+
+  /// @brief Make serve() return after the current request. Async-signal-safe.
+  void stop();
+
+private:
+  std::string socket_path_;
+  unsigned warm_engines_;
+  EnginePool::Configure configure_;
+  ResolvePreset resolve_preset_;
+  int wake_fds_[2] = {-1, -1};
+
+  // Engines ready to serve, and used ones waiting to be destroyed, both
+  // handled by the refill thread
+  std::mutex engines_mutex_;
+  std::condition_variable engines_changed_;
+  std::deque<std::unique_ptr<LuaEngine>> ready_;
+  std::vector<std::unique_ptr<LuaEngine>> retired_;
+  bool stopping_ = false;
+  std::thread refill_thread_;
+
+  void refill();
+  std::unique_ptr<LuaEngine> take_engine();
+  void handle(int client);
+  JobResult run(const DaemonRequest &request);
+};
+
+/// @brief Thin client: send `request` to the daemon at `socket_path` and copy
+/// its output and error to `out` and `err`.
+/// @return The exit status of the request (0 on success).
+/// @throws std::runtime_error if the daemon cannot be reached or does not run
+/// as this user.
+int send_request(const std::string &socket_path, const DaemonRequest &request,
+                 std::ostream &out, std::ostream &err);
+
+} // namespace Lua
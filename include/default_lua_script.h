@@ -3,11 +3,16 @@
 // Auto-generated header for embedded Lua script
 // This header is referenced by the generated default_lua_script.c
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-extern const char *DEFAULT_LUA_SCRIPT;
+// default_init.lua, precompiled to Lua bytecode at build time (plain source
+// when cross-compiling). Load it with LuaEngine::execute_chunk().
+extern const unsigned char DEFAULT_LUA_CHUNK[];
+extern const size_t DEFAULT_LUA_CHUNK_SIZE;
 
 #ifdef __cplusplus
 }
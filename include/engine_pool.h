@@ -0,0 +1,77 @@
+#pragma once
+
+#include "lua.h"
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace Lua {
+
+/// @brief One script run by an EnginePool.
+struct Job {
+  /// Shown in reports: a preset name or the script path.
+  std::string name;
+  std::string path;
+};
+
+/// @brief Outcome of one Job.
+struct JobResult {
+  std::string name;
+  /// The script ran to the end and every tree it wrote was written entirely.
+  bool ok = false;
+  /// Message of the error that stopped the script, if any.
+  std::string error;
+  /// What the script printed (print() and dry-run plans).
+  std::string output;
+  /// Write failures and the stderr of its shell commands.
+  std::string error_output;
+  /// Sums of the write_virtual_dir reports of the script.
+  std::size_t files_written = 0;
+  std::size_t write_errors = 0;
+  double seconds = 0;
+};
+
+/// @brief Run `job` on `lua`, capturing what it prints and any error.
+/// @param lua A fresh, configured engine.
+/// @param job
+JobResult run_job(LuaEngine &lua, const Job &job);
+
+/// @brief Runs many scripts concurrently, one LuaEngine per script.
+///
+/// Each job gets a fresh engine on a worker thread, so scripts share no Lua
+/// state, globals or nodes; engines are independent and never cross
+/// threads. Output is captured per job instead of interleaving on stdout,
+/// and engines are not interactive (LuaEngine::set_interactive()): a shell
+/// command that needs a prompt fails the job.
+class EnginePool {
+public:
+  /// @brief Applied to each engine before its script runs (write options,
+  /// compression...).
+  using Configure = std::function<void(LuaEngine &)>;
+  /// @brief Called as each job finishes, one call at a time.
+  using Done = std::function<void(const JobResult &)>;
+
+  /// @param workers Scripts run at once, 0 for one per hardware thread.
+  /// @param configure
+  explicit EnginePool(unsigned workers = 0, Configure configure = {})
+      : workers_(workers), configure_(std::move(configure)) {}
+
+  /// @brief Run every job and wait for all of them. A failing job does not
+  /// stop the others.
+  /// @param jobs
+  /// @param done
+  /// @return The results, in the order of `jobs`.
+  std::vector<JobResult> run(const std::vector<Job> &jobs,
+                             const Done &done = {}) const;
+
+  /// @brief Run one job on the calling thread.
+  /// @param job
+  JobResult run_one(const Job &job) const;
+
+private:
+  unsigned workers_;
+  Configure configure_;
+};
+
+} // namespace Lua
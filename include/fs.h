@@ -1,11 +1,150 @@
 #pragma once
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
 #include <filesystem>
+#include <functional>
+#include <iosfwd>
+#include <limits>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace fs {
 
+/// @brief System interface used to materialize a tree.
+enum class WriteBackend {
+  /// One std::ofstream per file (portable, always available).
+  Stream,
+  /// Batched mkdirat/openat/write/close through Linux io_uring. Falls back
+  /// to Stream when io_uring is not available.
+  IoUring,
+  /// Keeps the directory being written open and creates its entries with
+  /// mkdirat/openat and their name only, so the kernel never resolves the
+  /// same path prefix twice (POSIX). Falls back to Stream elsewhere.
+  Openat,
+};
+
+/// @brief How byte-identical files are produced when writing a tree.
+enum class DedupMode {
+  /// Every file is written from its own content.
+  Off,
+  /// The first copy is written, later ones are FICLONE reflinks of it
+  /// (falling back to an in-kernel copy). Files stay independent. Bodies
+  /// are matched on their size and content, compressed form, fill spec or
+  /// source file; streamed files are always written.
+  Reflink,
+  /// Like Reflink, but falls back to hardlinks before copying. Linked files
+  /// share an inode: editing one edits all of them.
+  Hardlink,
+};
+
+/// @brief What Dir::write_to_disk(options) guarantees once it returns, should
+/// the machine crash right after.
+enum class Durability {
+  /// Nothing is synced: files may still be empty or missing after a crash.
+  None,
+  /// Every file is fdatasync'ed as soon as it is written, then each
+  /// directory of the tree is fsync'ed once. Slow on large trees.
+  PerFile,
+  /// One syncfs of the output filesystem at the end of the write, then each
+  /// directory of the tree is fsync'ed once.
+  Batched,
+};
+
+/// @brief Options controlling how a virtual tree is materialized on disk.
+struct WriteOptions {
+  /// Worker threads used to write the tree. 1 writes sequentially on the
+  /// calling thread, 0 uses one worker per hardware thread. Ignored by the
+  /// io_uring backend, which batches from a single thread.
+  unsigned jobs = 1;
+  WriteBackend backend = WriteBackend::Stream;
+  DedupMode dedup = DedupMode::Off;
+  /// Keep a manifest (path, size, content hash) at the root of the output
+  /// and only write the files whose content differs from what is on disk.
+  bool incremental = false;
+  /// In incremental mode, delete the files recorded by the previous run
+  /// that the tree no longer contains.
+  bool prune = false;
+  /// Write the whole tree into a hidden sibling staging directory, then
+  /// swap it into place with one atomic rename. If anything fails, the
+  /// staging directory is removed and the destination is left untouched.
+  /// An existing destination is replaced as a whole.
+  bool transactional = false;
+  Durability durability = Durability::None;
+  /// Compute the plan of the write (see Dir::plan()) and throw instead of
+  /// writing anything if the target filesystem cannot hold the tree.
+  bool preflight = false;
+  /// Only compute the plan: nothing is written.
+  bool dry_run = false;
+  /// Where failures are reported while writing, std::cerr if null.
+  std::ostream *error_output = nullptr;
+};
+
+/// @brief What Dir::write_to_disk(options) would do, computed without
+/// writing anything (Dir::plan()).
+struct WritePlan {
+  std::size_t dirs = 0;
+  std::size_t files = 0;
+  std::size_t links = 0;
+  /// Size of every file whose size is known before writing it.
+  std::uint64_t bytes = 0;
+  /// Streamed files, whose size is only known once produced.
+  std::size_t unknown_size_files = 0;
+  /// Path with the most components, and that count relative to the root.
+  std::string deepest_path;
+  std::size_t max_depth = 0;
+  /// Existing files that would be replaced.
+  std::size_t existing_files = 0;
+  /// Paths already on disk with another type (a file where a directory is
+  /// planned, or the opposite): writing them would fail.
+  std::vector<std::string> conflicts;
+
+  /// Disk usage of the new nodes (rounded to blocks, holes excluded) minus
+  /// the files they replace, and inodes they need.
+  std::uint64_t required_bytes = 0;
+  std::uint64_t required_inodes = 0;
+  /// statvfs of the nearest existing ancestor of the root, for the caller.
+  std::uint64_t available_bytes = 0;
+  std::uint64_t available_inodes = 0;
+  /// Whether the filesystem reports enough space and inodes (always true
+  /// where statvfs is not available).
+  bool fits = true;
+
+  /// @brief Human readable report, one item per line.
+  std::string summary() const;
+};
+
+/// @brief Outcome of Dir::write_to_disk(options).
+struct WriteReport {
+  std::size_t files_written = 0;
+  /// Files left untouched because they already had the right content
+  /// (incremental mode).
+  std::size_t files_unchanged = 0;
+  /// Files recorded by the previous incremental run that the tree no longer
+  /// contains. They have been deleted if options.prune was set.
+  std::vector<std::string> stale_files;
+  std::size_t links_written = 0;
+  /// Copies produced by options.dedup from the first file with the same
+  /// body: cloned (reflink), hard linked, or copied because the filesystem
+  /// cannot clone them. Copies that could not be produced that way are
+  /// written from memory and only counted in files_written.
+  std::size_t files_cloned = 0;
+  std::size_t files_hardlinked = 0;
+  std::size_t files_copied = 0;
+  /// Time spent in fdatasync/syncfs/fsync, summed over every worker.
+  double sync_seconds = 0;
+  /// Failures reported on options.error_output while writing.
+  std::size_t errors = 0;
+  /// Filled in by options.preflight and options.dry_run.
+  WritePlan plan;
+};
+
 class Path {
 private:
   std::filesystem::path path_;
@@ -20,40 +159,514 @@ public:
   std::filesystem::path to_path() const { return path_; }
 };
 
+/// @brief Immutable file content, shared between every file that has the
+/// same bytes.
+using Content = std::shared_ptr<const std::string>;
+
+/// @brief Interns file contents so that byte-identical files share a single
+/// buffer. Entries do not keep contents alive: a content is released as soon
+/// as the last file using it is destroyed.
+class ContentPool {
+private:
+  std::unordered_map<std::size_t, std::vector<std::weak_ptr<const std::string>>>
+      contents_;
+
+public:
+  /// @brief Return the pooled content equal to `content`, adding it first if
+  /// needed.
+  /// @param content
+  Content intern(std::string content);
+  std::size_t size() const;
+};
+
+/// @brief Produces a file body piece by piece. Fills `buffer` with at most
+/// `capacity` bytes and returns how many were written; returning 0 ends the
+/// file. May throw to abort the write.
+using ContentProducer =
+    std::function<std::size_t(char *buffer, std::size_t capacity)>;
+
+/// @brief Body of a file described by its size rather than its bytes:
+/// `pattern` repeated from offset 0, except in `holes`, which read as zeros
+/// and take no disk space on filesystems with sparse files. Nothing but the
+/// pattern is ever held in memory.
+struct FillSpec {
+  std::uint64_t size = 0;
+  /// Empty: the whole file is a hole.
+  std::string pattern;
+  struct Hole {
+    std::uint64_t offset;
+    std::uint64_t length;
+  };
+  std::vector<Hole> holes;
+};
+
+class CompressedContent;
+class Dir;
+class File;
+class Link;
+
+/// @brief Index of a node in a Tree.
+using NodeId = std::uint32_t;
+inline constexpr NodeId kNoNode = std::numeric_limits<NodeId>::max();
+
+/// @brief Arena holding a virtual tree as a flat node table.
+///
+/// Nodes are linked through parent / first-child / next-sibling indices and
+/// store their own name only, interned in a string table, instead of a full
+/// path; full paths are rebuilt on demand. Dir and File are lightweight views
+/// (tree + index) over it, so attaching a node created in the same tree is
+/// O(1) and never moves a sub-tree.
+///
+/// Views are counted per node. A node stays allocated while a view of it,
+/// or of any node of the same detached sub-tree, exists, or while a link
+/// kept alive points into that sub-tree; collect() releases the other nodes
+/// and their bodies, and their slots are reused by later nodes.
+///
+/// Always owned through a std::shared_ptr (see create()).
+class Tree : public std::enable_shared_from_this<Tree> {
+public:
+  enum class Kind : std::uint8_t { Dir, File, Symlink, Hardlink };
+
+  struct Node {
+    Kind kind;
+    /// The name is a full path rather than a component: the node is detached
+    /// or its path does not live under its parent's path.
+    bool rooted;
+    /// The body is a ContentProducer rather than a Content.
+    bool streamed;
+    /// The body is copied from a file on disk (see source_of()).
+    bool sourced;
+    /// The body is a FillSpec (see fill_of()).
+    bool filled;
+    /// The body is held compressed (see compressed_of()).
+    bool compressed;
+    /// Freed by collect(), waiting to be reused.
+    bool released;
+    std::uint32_t name;
+    NodeId parent;
+    NodeId first_child;
+    NodeId last_child;
+    NodeId next_sibling;
+    std::uint32_t body;
+  };
+
+  static std::shared_ptr<Tree> create() { return std::make_shared<Tree>(); }
+
+  /// @brief Allocate a detached directory node.
+  /// @param path
+  Dir create_dir(const Path &path);
+  /// @brief Allocate a detached file node.
+  /// @param path
+  /// @param content
+  File create_file(const Path &path, Content content);
+  /// @brief Allocate a detached file node whose body is borrowed: `data`
+  /// must stay valid for as long as `owner` is alive (a mapped pack, for
+  /// instance). The tree keeps `owner` alive.
+  /// @param path
+  /// @param data
+  /// @param owner
+  File create_file(const Path &path, std::string_view data,
+                   std::shared_ptr<const void> owner);
+  /// @brief Allocate a detached file node whose body is the file at
+  /// `source`, read only when the tree is written.
+  /// @param path
+  /// @param source
+  File create_copy(const Path &path, std::filesystem::path source);
+  /// @brief Allocate a detached file node of `fill.size` bytes generated
+  /// when the tree is written. Holes are sorted and merged.
+  /// @param path
+  /// @param fill
+  /// @throws std::invalid_argument if a hole ends past the end of the file.
+  File create_file(const Path &path, FillSpec fill);
+  /// @brief Allocate a detached symbolic link whose content is `target`,
+  /// verbatim.
+  /// @param path
+  /// @param target
+  Link create_symlink(const Path &path, std::string target);
+  /// @brief Allocate a detached symbolic link to another node of this tree.
+  /// The link is written relative to its directory, so the tree stays
+  /// valid wherever it is written.
+  /// @param path
+  /// @param target
+  Link create_symlink(const Path &path, NodeId target);
+  /// @brief Allocate a detached hard link to the file at `target` on disk.
+  /// @param path
+  /// @param target
+  Link create_hardlink(const Path &path, std::string target);
+  /// @brief Allocate a detached hard link to a file node of this tree (a
+  /// hard link is followed to its file). Only the target file is written
+  /// to disk; the link costs one link(2).
+  /// @param path
+  /// @param target
+  /// @throws std::invalid_argument if `target` is not a file.
+  Link create_hardlink(const Path &path, NodeId target);
+  /// @brief Allocate a detached streamed file node.
+  /// @param path
+  /// @param producer
+  File create_file(const Path &path, ContentProducer producer);
+
+  /// @brief Keep the content of files of at least `threshold` bytes
+  /// compressed in memory from the moment they are attached to a directory
+  /// (0, the default, disables compression). Contents shared by several
+  /// files are compressed once; contents that do not shrink are kept as is.
+  /// @param threshold
+  void set_compression_threshold(std::size_t threshold) {
+    compression_threshold_ = threshold;
+  }
+  std::size_t compression_threshold() const { return compression_threshold_; }
+
+  /// @brief Make `child` the last child of `parent`, detaching it from its
+  /// current parent first. Throws std::invalid_argument on cycles.
+  /// @param parent
+  /// @param child
+  void attach(NodeId parent, NodeId child);
+  /// @brief Deep-copy the sub-tree rooted at `id` in `other` into this tree.
+  /// @return The id of the (detached) copy.
+  NodeId import(const Tree &other, NodeId id);
+  /// @brief Like import(), but the copy is rooted at `path`: every node of
+  /// the sub-tree keeps its position relative to the root.
+  /// @throws std::invalid_argument if a node lives outside of the root.
+  NodeId import(const Tree &other, NodeId id, const std::filesystem::path &path);
+
+  const Node &node(NodeId id) const { return nodes_[id]; }
+  /// @brief Name of the node in its parent directory, or its full path if
+  /// node(id).rooted.
+  const std::string &name_of(NodeId id) const { return name_of(nodes_[id]); }
+  std::filesystem::path path_of(NodeId id) const;
+  std::string_view content_of(NodeId id) const;
+  const ContentProducer &producer_of(NodeId id) const;
+  const std::filesystem::path &source_of(NodeId id) const;
+  const FillSpec &fill_of(NodeId id) const;
+  /// @brief Compressed body of a file, nullptr if it is not compressed.
+  const std::shared_ptr<const CompressedContent> &compressed_of(NodeId id) const;
+  /// @brief Node a link points to, kNoNode if its target is a plain path.
+  NodeId link_target_of(NodeId id) const;
+  /// @brief Path a link points to, as written to disk.
+  std::filesystem::path link_path_of(NodeId id) const;
+  /// @brief Number of link nodes allocated in this tree.
+  std::size_t link_count() const { return links_.size(); }
+
+  /// @brief Number of allocated nodes, released ones excluded.
+  std::size_t node_count() const {
+    return nodes_.size() - free_nodes_.size();
+  }
+  /// @brief Number of distinct interned name components.
+  std::size_t name_count() const { return names_.size(); }
+
+  /// @brief Count a view (Dir, File or Link) of `id`. Thread-safe.
+  void retain(NodeId id) const {
+    views_[id].fetch_add(1, std::memory_order_relaxed);
+  }
+  /// @brief Forget a view of `id`; the node is only released by collect().
+  /// Thread-safe.
+  void release(NodeId id) const {
+    views_[id].fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  /// @brief Release every node no view can reach any more, with its body
+  /// (dropping the owner of a borrowed body) and its path. Node ids held
+  /// without a view must not be used afterwards. Not thread-safe: nothing
+  /// else may use the tree meanwhile.
+  void collect();
+  /// @brief collect(), once at least as many nodes were allocated since the
+  /// last collection as were left by it (and kMinCollectNodes), so that
+  /// collections cost O(1) per allocated node.
+  void maybe_collect();
+
+  static constexpr std::size_t kMinCollectNodes = 4096;
+
+private:
+  /// @brief A vector whose released slots are reused.
+  template <typename T> class Slots {
+  public:
+    std::uint32_t add(T value) {
+      if (!free_.empty()) {
+        std::uint32_t slot = free_.back();
+        free_.pop_back();
+        items_[slot] = std::move(value);
+        return slot;
+      }
+      items_.push_back(std::move(value));
+      return static_cast<std::uint32_t>(items_.size() - 1);
+    }
+    void release(std::uint32_t slot) {
+      items_[slot] = T();
+      free_.push_back(slot);
+    }
+    T &operator[](std::uint32_t slot) { return items_[slot]; }
+    const T &operator[](std::uint32_t slot) const { return items_[slot]; }
+    std::size_t size() const { return items_.size() - free_.size(); }
+
+  private:
+    std::vector<T> items_;
+    std::vector<std::uint32_t> free_;
+  };
+
+  std::vector<Node> nodes_;
+  std::vector<NodeId> free_nodes_;
+  // Views of each node; std::deque never moves its elements
+  mutable std::deque<std::atomic<std::uint32_t>> views_;
+  std::size_t allocated_since_collect_ = 0;
+  std::size_t left_by_collect_ = 0;
+  // File bodies: a view kept valid by its owner (Content or a mapping)
+  struct Body {
+    std::string_view data;
+    std::shared_ptr<const void> owner;
+  };
+  Slots<Body> bodies_;
+  Slots<ContentProducer> producers_;
+  Slots<FillSpec> fills_;
+  Slots<std::shared_ptr<const CompressedContent>> compressed_;
+  std::size_t compression_threshold_ = 0;
+  // Bodies compressed so far, by address: files sharing a Content share the
+  // compressed copy too. The owner tells a live body from a new one that
+  // reuses the address of a released one.
+  struct CompressedBody {
+    std::weak_ptr<const void> owner;
+    std::size_t size;
+    // Expires with the last file holding it; never set if the body does not
+    // compress
+    std::weak_ptr<const CompressedContent> compressed;
+    bool compresses;
+  };
+  std::unordered_map<const char *, CompressedBody> compressed_bodies_;
+  Slots<std::filesystem::path> sources_;
+  struct LinkBody {
+    NodeId target;
+    std::string path;
+  };
+  Slots<LinkBody> links_;
+  std::deque<std::string> names_;
+  std::unordered_map<std::string_view, std::uint32_t> name_ids_;
+  Slots<std::string> rooted_paths_;
+
+  NodeId add_node(Kind kind, const std::filesystem::path &path);
+  /// @brief Release the body, path and slot of a node.
+  void free_node(NodeId id);
+  Link add_link(Kind kind, const Path &path, LinkBody body);
+  void compress_body(NodeId id);
+  std::uint32_t intern(std::string_view name);
+  const std::string &name_of(const Node &node) const;
+  void unlink(NodeId child);
+};
+
+/// @brief A file of a Tree. Copies are views of the same node.
 class File {
 private:
-  Path path_;
-  std::string content_;
+  std::shared_ptr<Tree> tree_;
+  NodeId id_ = kNoNode;
+
+  void retain() const {
+    if (tree_ && id_ != kNoNode) {
+      tree_->retain(id_);
+    }
+  }
 
 public:
-  File() : path_(std::filesystem::path()), content_("") {}
+  File() : File(Path()) {}
   File(const Path &path, const std::string &content)
-      : path_(path), content_(content) {}
+      : File(path, std::make_shared<const std::string>(content)) {}
   File(const std::string &path, const std::string &content)
-      : path_(path), content_(content) {}
-  File(const Path &path) : path_(path), content_("") {}
-  File(const std::string &path) : path_(path), content_("") {}
+      : File(Path(path), content) {}
+  /// @brief Take over `content` without copying its bytes.
+  File(const Path &path, std::string &&content)
+      : File(path, std::make_shared<const std::string>(std::move(content))) {}
+  File(const std::string &path, std::string &&content)
+      : File(Path(path), std::move(content)) {}
+  File(const Path &path, Content content)
+      : File(Tree::create()->create_file(path, std::move(content))) {}
+  /// @brief A file borrowing its body, see Tree::create_file().
+  File(const Path &path, std::string_view data,
+       std::shared_ptr<const void> owner)
+      : File(Tree::create()->create_file(path, data, std::move(owner))) {}
+  /// @brief A file whose body is pulled from `producer` while it is written,
+  /// through a buffer of kStreamBufferSize bytes. The body is never held in
+  /// memory as a whole, and a streamed file can only be written once.
+  File(const Path &path, ContentProducer producer)
+      : File(Tree::create()->create_file(path, std::move(producer))) {}
+  /// @brief A file generated from its size and fill pattern, for fixtures
+  /// and placeholders of any size.
+  File(const Path &path, FillSpec fill)
+      : File(Tree::create()->create_file(path, std::move(fill))) {}
+  File(const Path &path) : File(path, Content()) {}
+  File(const std::string &path) : File(Path(path)) {}
+  /// @brief View of an existing node.
+  File(std::shared_ptr<Tree> tree, NodeId id)
+      : tree_(std::move(tree)), id_(id) {
+    retain();
+  }
+  File(const File &other) : tree_(other.tree_), id_(other.id_) { retain(); }
+  File(File &&other) noexcept
+      : tree_(std::move(other.tree_)),
+        id_(std::exchange(other.id_, kNoNode)) {}
+  File &operator=(File other) noexcept {
+    std::swap(tree_, other.tree_);
+    std::swap(id_, other.id_);
+    return *this;
+  }
+
+  static constexpr std::size_t kStreamBufferSize = 64 * 1024;
+
+  const std::shared_ptr<Tree> &get_tree() const { return tree_; }
+  NodeId get_id() const { return id_; }
+  Path get_path() const;
+  /// @brief A file copied from `source` on disk when written. The copy
+  /// goes through reflink / copy_file_range where the kernel allows it, so
+  /// the bytes never reach user space.
+  static File copy_of(const Path &path, std::filesystem::path source) {
+    return Tree::create()->create_copy(path, std::move(source));
+  }
+
+  bool is_streamed() const { return tree_ && tree_->node(id_).streamed; }
+  bool has_source() const { return tree_ && tree_->node(id_).sourced; }
+  bool is_filled() const { return tree_ && tree_->node(id_).filled; }
+  /// @brief The content is held compressed until it is written (see
+  /// Tree::set_compression_threshold()).
+  bool is_compressed() const { return tree_ && tree_->node(id_).compressed; }
+  /// @brief Size of the file once written, when known before writing it
+  /// (0 for streamed and copied files).
+  std::uint64_t get_size() const;
+  /// @brief File copied by copy_of(), empty otherwise.
+  std::filesystem::path get_source() const {
+    return has_source() ? tree_->source_of(id_) : std::filesystem::path();
+  }
+  /// @brief Content of the file, empty for a streamed, copied, filled or
+  /// compressed file, or a file that was moved from.
+  /// The view stays valid as long as the tree.
+  std::string_view get_content() const {
+    return tree_ ? tree_->content_of(id_) : std::string_view();
+  }
   void write_to_disk() const;
   ~File();
 };
 
+/// @brief A symbolic or hard link of a Tree. Copies are views of the same
+/// node. Links are created once every directory and file of the write is on
+/// disk, so their targets always exist first.
+class Link {
+private:
+  std::shared_ptr<Tree> tree_;
+  NodeId id_ = kNoNode;
+
+  void retain() const {
+    if (tree_ && id_ != kNoNode) {
+      tree_->retain(id_);
+    }
+  }
+
+public:
+  /// @brief View of an existing node.
+  Link(std::shared_ptr<Tree> tree, NodeId id)
+      : tree_(std::move(tree)), id_(id) {
+    retain();
+  }
+  Link(const Link &other) : tree_(other.tree_), id_(other.id_) { retain(); }
+  Link(Link &&other) noexcept
+      : tree_(std::move(other.tree_)),
+        id_(std::exchange(other.id_, kNoNode)) {}
+  Link &operator=(Link other) noexcept {
+    std::swap(tree_, other.tree_);
+    std::swap(id_, other.id_);
+    return *this;
+  }
+
+  const std::shared_ptr<Tree> &get_tree() const { return tree_; }
+  NodeId get_id() const { return id_; }
+  Path get_path() const;
+  bool is_symlink() const {
+    return tree_ && tree_->node(id_).kind == Tree::Kind::Symlink;
+  }
+  /// @brief Target as written to disk.
+  std::filesystem::path get_target() const {
+    return tree_ ? tree_->link_path_of(id_) : std::filesystem::path();
+  }
+  /// @brief Create the link, replacing any file already at its path.
+  /// Throws if the link cannot be created.
+  void write_to_disk() const;
+  ~Link();
+};
+
+/// @brief A directory of a Tree. Copies are views of the same node.
 class Dir {
 private:
-  Path path_;
-  std::vector<Dir> sub_dir_;
-  std::vector<File> files_;
+  std::shared_ptr<Tree> tree_;
+  NodeId id_ = kNoNode;
+
+  void retain() const {
+    if (tree_ && id_ != kNoNode) {
+      tree_->retain(id_);
+    }
+  }
 
 public:
-  Dir() : path_(std::filesystem::path()) {}
-  Dir(const Path &path) : path_(path) {}
-  Dir(const std::string &path) : path_(path) {}
-  /// @brief Add a sub-directory to the current directory. Takes ownership.
+  Dir() : Dir(Path()) {}
+  Dir(const Path &path) : Dir(Tree::create()->create_dir(path)) {}
+  Dir(const std::string &path) : Dir(Path(path)) {}
+  /// @brief View of an existing node.
+  Dir(std::shared_ptr<Tree> tree, NodeId id)
+      : tree_(std::move(tree)), id_(id) {
+    retain();
+  }
+  Dir(const Dir &other) : tree_(other.tree_), id_(other.id_) { retain(); }
+  Dir(Dir &&other) noexcept
+      : tree_(std::move(other.tree_)),
+        id_(std::exchange(other.id_, kNoNode)) {}
+  Dir &operator=(Dir other) noexcept {
+    std::swap(tree_, other.tree_);
+    std::swap(id_, other.id_);
+    return *this;
+  }
+  /// @brief Build a tree at `destination` mirroring the directory `source`
+  /// on disk. Files are not read: they reference their source and are
+  /// copied in the kernel when the tree is written (see File::copy_of).
+  /// Symlinks to directories and special files are skipped.
+  /// @param source
+  /// @param destination
+  /// @throws std::runtime_error if `source` cannot be listed.
+  static Dir import_from_disk(const Path &source, const Path &destination);
+  /// @brief Add a sub-directory to the current directory. A directory of the
+  /// same tree is linked in place; one from another tree is copied in, and
+  /// `dir` is updated to view the copy.
   /// @param dir
-  void add_subdir(Dir &&dir) noexcept;
-  /// @brief Add a file to the current directory. Takes ownership.
+  void add_subdir(Dir &&dir);
+  /// @brief Add a file to the current directory, with the same rules as
+  /// add_subdir.
   /// @param file
-  void add_file(File &&file) noexcept;
+  void add_file(File &&file);
+  /// @brief Add a link to the current directory, with the same rules as
+  /// add_subdir. A link imported from another tree keeps pointing to its
+  /// target by path.
+  /// @param link
+  void add_link(Link &&link);
+  const std::shared_ptr<Tree> &get_tree() const { return tree_; }
+  NodeId get_id() const { return id_; }
+  Path get_path() const;
+  std::vector<Dir> get_subdirs() const;
+  std::vector<File> get_files() const;
+  std::vector<Link> get_links() const;
+  /// @brief Create this directory on disk (parents included), without
+  /// touching its children. Throws if the directory cannot be created.
+  void create_on_disk() const;
   void write_to_disk() const;
+  /// @brief Write the whole tree to disk. With options.jobs != 1, sub-trees
+  /// and batches of files are spread over a work-stealing thread pool; a
+  /// directory is always created before anything inside it. With
+  /// options.dedup, each distinct content is written once and its copies
+  /// are cloned from it at the end.
+  /// With options.incremental, unchanged files are skipped (see
+  /// WriteOptions::incremental). With options.transactional, the tree
+  /// appears on disk all at once or not at all, and errors are thrown
+  /// instead of being printed.
+  /// @param options
+  WriteReport write_to_disk(const WriteOptions &options) const;
+  /// @brief Walk the tree and the disk without writing anything: node
+  /// counts, bytes, deepest path, existing files and conflicts, and whether
+  /// the target filesystem has room for it (statvfs). Only paths whose
+  /// parent directory already exists are looked up on disk, so planning a
+  /// fresh output costs a single tree walk.
+  /// @param options The write being planned (a transactional write cannot
+  /// reuse the space of the files it replaces).
+  WritePlan plan(const WriteOptions &options = {}) const;
   ~Dir();
 };
 
@@ -1,20 +1,157 @@
 #pragma once
 
+#include "fs.h"
+#include "profiler.h"
+#include "template.h"
+#include <filesystem>
+#include <iostream>
+#include <memory>
 #include <sol/sol.hpp>
 #include <string>
+#include <string_view>
+#include <vector>
+
+namespace Process {
+struct Command;
+}
 
 namespace Lua {
+class StringPins;
+
 class LuaEngine {
 private:
   sol::state lua_state_;
+  // Lua strings borrowed by file bodies, pinned in the registry
+  std::shared_ptr<StringPins> pins_;
+  fs::WriteOptions write_options_;
+  // Identical file bodies created by a script share one buffer
+  fs::ContentPool contents_;
+  // Every node created by a script lives in this arena, so appending one to
+  // a directory only links indices. The bindings collect the nodes no
+  // script handle reaches any more.
+  std::shared_ptr<fs::Tree> tree_ = fs::Tree::create();
+  // cdirnuts.render: compiled templates and the output buffer
+  Templates::TemplateCache templates_;
+  std::string render_buffer_;
+  // Compiled chunks of the script files, none if empty
+  std::filesystem::path bytecode_cache_;
+  // Destination of print() and dry-run plans
+  std::ostream *out_ = &std::cout;
+  // Destination of write failures and of the stderr of commands
+  std::ostream *err_ = &std::cerr;
+  // Counters of every write_virtual_dir report
+  fs::WriteReport totals_;
+  // Shell commands run without a prompt (--yes)
+  bool assume_yes_ = false;
+  // Whether a user sits at this process' terminal
+  bool interactive_ = true;
+  // Declared after the state: its hook goes away before the state closes
+  std::unique_ptr<Profiler> profiler_;
+
+  sol::table plan_table(const fs::WritePlan &plan);
+  /// @brief File node for any content accepted by create_virtual_file.
+  fs::File make_file(const fs::Path &path, const sol::object &content);
+  /// @brief Directory node at `path` and everything `spec` describes below
+  /// it, for cdirnuts.build_tree. Named tables are subdirectories, except
+  /// those with a numeric `size`: fill specs, passed to make_file(). `ancestors` holds the tables being built,
+  /// to reject specs containing themselves.
+  fs::Dir build_dir(const std::filesystem::path &path, const sol::table &spec,
+                    std::vector<const void *> &ancestors);
+  /// @brief Run the chunk pushed by a load function returning `status`, or
+  /// throw its load error.
+  void run_loaded(int status, const std::string &name);
+  /// @brief Ask once before running `commands`, unless set_assume_yes().
+  /// @throws std::runtime_error if the user declines, or if the engine is
+  /// not interactive.
+  void confirm_commands(const std::vector<Process::Command> &commands);
+  /// @brief Release the nodes no script handle reaches any more, and the
+  /// Lua strings their bodies borrowed.
+  void collect();
 
 public:
   LuaEngine();
+  ~LuaEngine();
+  LuaEngine(const LuaEngine &) = delete;
+  LuaEngine &operator=(const LuaEngine &) = delete;
 
   void register_api();
 
+  /// @brief Default options used by cdirnuts.write_virtual_dir when the
+  /// script does not pass its own.
+  /// @param options
+  void set_write_options(const fs::WriteOptions &options) {
+    write_options_ = options;
+  }
+
+  /// @brief Keep file contents of at least `threshold` bytes compressed in
+  /// memory once they are added to a directory (0 disables compression).
+  /// @param threshold
+  void set_compression_threshold(std::size_t threshold) {
+    tree_->set_compression_threshold(threshold);
+  }
+
+  /// @brief Send what scripts print (print() and dry-run plans) to `out`
+  /// instead of stdout. `out` must outlive the engine.
+  /// @param out
+  void set_output(std::ostream &out);
+
+  /// @brief Send write failures and the stderr of shell commands to `err`
+  /// instead of stderr. `err` must outlive the engine.
+  /// @param err
+  void set_error_output(std::ostream &err) { err_ = &err; }
+
+  /// @brief Whether the engine may use the terminal of the process. When
+  /// not (daemon requests, batch jobs), shell commands that need a prompt
+  /// fail instead of reading stdin, and the output of every command is
+  /// captured and sent to the engine outputs.
+  /// @param interactive
+  void set_interactive(bool interactive) { interactive_ = interactive; }
+
+  /// @brief Run the commands of execute_shell_command and run_commands
+  /// without asking for confirmation first. Only the user can set this:
+  /// scripts have no way to skip the prompt.
+  /// @param assume_yes
+  void set_assume_yes(bool assume_yes) { assume_yes_ = assume_yes; }
+
+  /// @brief Sums of the counters (files written, unchanged, links, errors,
+  /// sync time) of every tree written by the scripts so far.
+  const fs::WriteReport &totals() const { return totals_; }
+
+  /// @brief Lua strings currently borrowed by file bodies (contents of
+  /// 4 KiB or more). A string is unpinned by the end of the chunk in which
+  /// the script dropped the last handle to its file.
+  std::size_t pinned_strings() const;
+
+  /// @brief Time every Lua function and cdirnuts.* call run from now on, see
+  /// Profiler.
+  void enable_profiler() {
+    if (!profiler_) {
+      profiler_ = std::make_unique<Profiler>(lua_state_.lua_state());
+    }
+  }
+
+  /// @brief The profiler started by enable_profiler(), null if none.
+  const Profiler *profiler() const { return profiler_.get(); }
+
+  /// @brief Directory where execute_file() keeps the compiled scripts.
+  /// Defaults to `$DIRNUTS_DIR_PATH/bytecode`; an empty path disables the
+  /// cache.
+  /// @param directory
+  void set_bytecode_cache(const std::filesystem::path &directory) {
+    bytecode_cache_ = directory;
+  }
+
+  /// @brief Run the script at `path`, loading its compiled chunk from the
+  /// bytecode cache when the script has not changed since it was cached.
+  /// @param path
   void execute_file(const std::string &path);
 
   void execute_string(const std::string &code);
+
+  /// @brief Run a chunk held in memory, either Lua source or bytecode
+  /// produced by lua_dump (the embedded default script).
+  /// @param chunk
+  /// @param name Reported in error messages and tracebacks.
+  void execute_chunk(std::string_view chunk, const std::string &name);
 };
 } // namespace Lua
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "fs.h"
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace fs {
+
+/// @brief Binary snapshot of a virtual tree (.cdnpack).
+///
+/// A pack is a single file holding a fixed-size header, a node table (one
+/// 32-byte record per directory, file or link, parents before children), a
+/// string table of node names and link targets and a blob region with every
+/// distinct file body.
+/// Opening a pack maps it in memory: the tree built by instantiate() views
+/// the mapped bodies directly, so writing it copies nothing in user space.
+///
+///     header | nodes | strings | padding | blob (page aligned)
+class Pack {
+public:
+  static constexpr const char *kExtension = ".cdnpack";
+
+  /// @brief Serialize `root` and everything below it to `path` (replaced
+  /// atomically). Streamed and copied files (File::copy_of) are read into
+  /// the pack; files sharing the same Content are stored once.
+  /// @param root
+  /// @param path
+  /// @throws std::invalid_argument if a node lives outside of the root.
+  /// @throws std::runtime_error if the file cannot be written.
+  static void save(const Dir &root, const std::string &path);
+
+  /// @brief Map a pack and check its structure.
+  /// @param path
+  /// @throws std::runtime_error if the file cannot be read or is not a
+  /// valid pack.
+  static Pack open(const std::string &path);
+
+  /// @brief Path of the root directory when the pack was saved.
+  Path get_root_path() const;
+  std::size_t node_count() const;
+
+  /// @brief Build the tree at the path it was saved from.
+  Dir instantiate() const;
+  /// @brief Build the tree rooted at `root` instead. The file bodies view
+  /// the mapping, which stays alive as long as the tree.
+  /// @param root
+  Dir instantiate(const Path &root) const;
+
+  class Mapping;
+
+private:
+  std::shared_ptr<const Mapping> mapping_;
+
+  explicit Pack(std::shared_ptr<const Mapping> mapping)
+      : mapping_(std::move(mapping)) {}
+};
+
+} // namespace fs
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace Process {
+
+/// @brief A shell command of a ProcessGraph.
+struct Command {
+  /// Unique name other commands refer to in `after`. Defaults to the
+  /// command line itself.
+  std::string name;
+  /// Run with /bin/sh -c.
+  std::string command;
+  /// Names of the commands that must succeed before this one starts.
+  std::vector<std::string> after;
+  /// Directory to run in, the current one if empty.
+  std::string cwd;
+  /// Collect stdout and stderr into the Result, stdin reading from
+  /// /dev/null. Otherwise the command inherits all three, so it can
+  /// interact with the user.
+  bool capture = true;
+};
+
+/// @brief What happened to one Command.
+struct Result {
+  enum class Status {
+    Succeeded,
+    /// Non-zero exit, killed by a signal or could not be started.
+    Failed,
+    /// Not started because a command it depends on did not succeed.
+    Skipped,
+  };
+
+  std::string name;
+  std::string command;
+  Status status = Status::Skipped;
+  /// Exit status, minus the signal number if it was killed, -1 if it never
+  /// ran.
+  int exit_code = -1;
+  std::string output;
+  std::string errors;
+  double seconds = 0;
+};
+
+/// @brief Shell commands with dependencies, run concurrently.
+///
+/// Commands are started with posix_spawn as soon as everything they depend
+/// on has succeeded, up to a concurrency limit; their output is read
+/// through pipes by a single poll() loop on the calling thread. A command
+/// that fails skips everything that depends on it, directly or not; the
+/// other commands still run.
+class ProcessGraph {
+public:
+  /// @brief Add a command.
+  /// @param command
+  /// @throws std::invalid_argument if its name is already taken.
+  void add(Command command);
+
+  const std::vector<Command> &commands() const { return commands_; }
+
+  /// @brief Run every command and wait for all of them.
+  /// @param max_parallel Commands running at once, 0 for one per hardware
+  /// thread.
+  /// @return One result per command, in the order they were added.
+  /// @throws std::invalid_argument if a command depends on an unknown name
+  /// or on itself through a cycle; nothing is run then.
+  std::vector<Result> run(unsigned max_parallel) const;
+
+private:
+  std::vector<Command> commands_;
+
+  /// @brief Index of the commands each command depends on.
+  std::vector<std::vector<std::size_t>> dependencies() const;
+};
+
+/// @brief Human readable status: "ok", "failed" or "skipped".
+const char *to_string(Result::Status status);
+
+} // namespace Process
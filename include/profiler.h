@@ -0,0 +1,118 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct lua_State;
+struct lua_Debug;
+
+namespace Lua {
+
+/// @brief Times the Lua functions and cdirnuts.* bindings run by a state.
+///
+/// Installs a call/return hook (lua_sethook): every call is counted and the
+/// time between two hook events is charged to the function on top of the
+/// stack, so self times add up to the time spent in the scripts. Time
+/// spent in the profiler itself is left out. Coroutines inherit the hook
+/// and get their own stack. Lua functions are told apart by prototype
+/// (source and line of definition), so the closures made by one expression
+/// share a row; C functions and bindings by identity. Bindings are named
+/// after their cdirnuts field, other functions after their name and
+/// definition.
+///
+/// Under LuaJIT, hooks do not fire in compiled traces, so the JIT compiler
+/// is turned off while profiling.
+class Profiler {
+public:
+  struct FunctionStats {
+    /// "cdirnuts.write_virtual_dir", "name (file.lua:12)", "name [C]"...
+    std::string name;
+    std::uint64_t calls = 0;
+    /// Time in the function itself.
+    double self_seconds = 0;
+    /// Time in the function and everything it called, recursive calls
+    /// counted once.
+    double total_seconds = 0;
+  };
+
+  /// @brief Start profiling `state`, whose cdirnuts table must be
+  /// registered already.
+  /// @param state
+  explicit Profiler(lua_State *state);
+  ~Profiler();
+  Profiler(const Profiler &) = delete;
+  Profiler &operator=(const Profiler &) = delete;
+
+  /// @brief Functions called so far, by decreasing self time.
+  std::vector<FunctionStats> report() const;
+
+  /// @brief Print report() as a table.
+  /// @param out
+  /// @param limit Rows printed, 0 for all.
+  void write_report(std::ostream &out, std::size_t limit = 0) const;
+
+  /// @brief Write the self time of each call stack in the "collapsed" format
+  /// of flamegraph.pl, speedscope and similar tools: one
+  /// `outer;inner;innermost <microseconds>` line per stack.
+  /// @param out
+  void write_collapsed(std::ostream &out) const;
+
+private:
+  using Clock = std::chrono::steady_clock;
+  static constexpr std::uint32_t kNoNode = UINT32_MAX;
+
+  struct Function {
+    FunctionStats stats;
+    // Frames of this function on the stacks, to count recursion once
+    std::uint32_t active = 0;
+  };
+  // A distinct call path: parent node + function
+  struct Node {
+    std::uint32_t parent;
+    std::uint32_t function;
+    double self_seconds = 0;
+  };
+  struct Frame {
+    // The function value, alive while it runs: matches its return event
+    const void *identity;
+    std::uint32_t function;
+    std::uint32_t node;
+    double inclusive_seconds = 0;
+    // Replaced its caller (Lua 5.2+ tail call): returns for it too
+    bool tail = false;
+  };
+
+  lua_State *state_;
+  std::vector<Function> functions_;
+  // C functions by identity, Lua functions by "short_src:linedefined"
+  std::unordered_map<const void *, std::uint32_t> function_ids_;
+  std::unordered_map<std::string, std::uint32_t> prototype_ids_;
+  // Function identity -> "cdirnuts.<field>"
+  std::unordered_map<const void *, std::string> bindings_;
+  std::vector<Node> nodes_;
+  std::unordered_map<std::uint64_t, std::uint32_t> children_;
+  // One call stack per coroutine
+  std::unordered_map<lua_State *, std::vector<Frame>> stacks_;
+  lua_State *current_ = nullptr;
+  Clock::time_point last_;
+
+  /// @brief The lua_Hook: finds the profiler of the state in the registry.
+  static void hook(lua_State *state, lua_Debug *event);
+  void on_event(lua_State *state, lua_Debug *event);
+  /// @brief Row of the function called, `event` holding its "S" info.
+  std::uint32_t function_id(lua_State *state, lua_Debug *event,
+                            const void *identity);
+  void enter(lua_State *state, lua_Debug *event, bool tail);
+  /// @brief Unwind to the frame of the function returning, dropping the
+  /// frames an error went through.
+  void leave(lua_State *state, lua_Debug *event);
+  /// @brief Return from the top frame of `stack`, accounting its time.
+  static void pop(std::vector<Function> &functions, std::vector<Frame> &stack);
+};
+
+} // namespace Lua
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace Templates {
+
+/// @brief Values a template is rendered against.
+///
+/// The renderer sees them as a stack: push() looks a name up and pushes its
+/// value, the other calls work on the value on top. Sections enter() their
+/// value, so that names inside them are looked up in it first, then in the
+/// enclosing sections, as in Mustache.
+class Context {
+public:
+  static constexpr std::size_t kNotAList = static_cast<std::size_t>(-1);
+
+  virtual ~Context() = default;
+
+  /// @brief Push the value of `name`: "." is the innermost section value,
+  /// "a.b" the field b of a. The first component is looked up from the
+  /// innermost section outwards.
+  /// @param name
+  /// @return false, with nothing pushed, if there is no such value.
+  virtual bool push(std::string_view name) = 0;
+  /// @brief Push item `index` (from 0) of the list on top.
+  /// @param index
+  virtual void push_item(std::size_t index) = 0;
+  virtual void pop() = 0;
+  /// @brief Number of items of the value on top, kNotAList if it is not a
+  /// list.
+  virtual std::size_t list_size() = 0;
+  /// @brief Whether a section over the value on top is rendered.
+  virtual bool truthy() = 0;
+  /// @brief Append the value on top as text (nothing for lists and maps).
+  /// @param out
+  virtual void append(std::string &out) = 0;
+  /// @brief Make the value on top the innermost section, until leave().
+  virtual void enter() = 0;
+  virtual void leave() = 0;
+};
+
+/// @brief Mustache-style template compiled to a flat instruction list.
+///
+/// Supported tags: `{{name}}` and `{{a.b}}` (inserted as is, nothing is
+/// escaped: the output is source code, not HTML; `{{{name}}}` and
+/// `{{&name}}` are accepted as synonyms), sections `{{#name}}...{{/name}}`
+/// rendered once per list item, once for another true value and skipped for
+/// false, nil and empty lists, inverted sections `{{^name}}...{{/name}}` and
+/// comments `{{! ... }}`. A line holding nothing but a section tag or a
+/// comment is removed entirely, so that they do not leave blank lines.
+class Template {
+public:
+  /// @brief Parse `source` once.
+  /// @param source
+  /// @throws std::invalid_argument on an unclosed tag or unbalanced
+  /// sections, naming the line.
+  static Template compile(std::string_view source);
+
+  /// @brief Append the rendering to `out`, reserving room for the literal
+  /// text first.
+  /// @param context
+  /// @param out
+  void render(Context &context, std::string &out) const;
+  std::string render(Context &context) const;
+
+  /// @brief Bytes of literal text, a lower bound of the output size.
+  std::size_t literal_size() const { return literal_size_; }
+
+private:
+  enum class Op : std::uint8_t { Text, Variable, Section, Inverted };
+
+  struct Instruction {
+    Op op;
+    /// Text or name, in pool_
+    std::uint32_t offset;
+    std::uint32_t length;
+    /// Sections: index of the first instruction after the section
+    std::uint32_t end;
+  };
+
+  std::string pool_;
+  std::vector<Instruction> code_;
+  std::size_t literal_size_ = 0;
+
+  void render(Context &context, std::string &out, std::size_t begin,
+              std::size_t end) const;
+  std::string_view text(const Instruction &instruction) const {
+    return std::string_view(pool_).substr(instruction.offset,
+                                          instruction.length);
+  }
+};
+
+/// @brief Compiled templates by source text, so that a template rendered
+/// many times is parsed once. Thread-safe.
+class TemplateCache {
+public:
+  /// @brief Past this many templates the cache starts over, in case a script
+  /// generates template sources on the fly.
+  static constexpr std::size_t kMaxTemplates = 4096;
+
+  /// @brief The compiled `source`, compiled now if it is not cached yet.
+  /// @param source
+  /// @throws std::invalid_argument see Template::compile().
+  std::shared_ptr<const Template> get(std::string_view source);
+  std::size_t size() const;
+
+private:
+  struct Hash {
+    using is_transparent = void;
+    std::size_t operator()(std::string_view source) const {
+      return std::hash<std::string_view>{}(source);
+    }
+  };
+
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, std::shared_ptr<const Template>, Hash,
+                     std::equal_to<>>
+      templates_;
+};
+
+} // namespace Templates
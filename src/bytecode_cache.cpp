@@ -0,0 +1,164 @@
+#include "bytecode_cache.h"
+#include "manifest.h"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+namespace Lua {
+
+namespace {
+
+constexpr char kMagic[8] = {'c', 'd', 'n', 'l', 'u', 'a', 'c', '1'};
+
+struct EntryHeader {
+  char magic[8];
+  std::uint32_t lua_version;
+  std::uint32_t reserved;
+  std::uint64_t size;
+  std::int64_t mtime;
+  std::uint64_t hash;
+};
+
+bool read_whole(const std::filesystem::path &path, std::string &out) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  out.assign(std::istreambuf_iterator<char>(file),
+             std::istreambuf_iterator<char>());
+  return !file.bad();
+}
+
+int append_chunk(lua_State *, const void *data, std::size_t size,
+                 void *output) {
+  static_cast<std::string *>(output)->append(static_cast<const char *>(data),
+                                             size);
+  return 0;
+}
+
+// Same treatment as luaL_loadfile: a UTF-8 BOM and a '#' first line are
+// skipped, keeping the newline so that line numbers do not move.
+std::string_view script_text(std::string_view source) {
+  if (source.starts_with("\xEF\xBB\xBF")) {
+    source.remove_prefix(3);
+  }
+  if (source.starts_with('#')) {
+    std::size_t end = source.find('\n');
+    source.remove_prefix(end == std::string_view::npos ? source.size() : end);
+  }
+  return source;
+}
+
+void store(const std::filesystem::path &entry, const EntryHeader &header,
+           const std::string &bytecode) {
+  std::error_code ec;
+  std::filesystem::create_directories(entry.parent_path(), ec);
+  // Several engines may compile the same script at once
+  std::filesystem::path temporary = entry;
+  temporary += ".tmp" + std::to_string(std::random_device{}());
+  {
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(bytecode.data(), static_cast<std::streamsize>(bytecode.size()));
+    if (!file) {
+      file.close();
+      std::filesystem::remove(temporary, ec);
+      return;
+    }
+  }
+  std::filesystem::rename(temporary, entry, ec);
+  if (ec) {
+    std::filesystem::remove(temporary, ec);
+  }
+}
+
+} // namespace
+
+// ============================================================================
+// BytecodeCache Implementation
+// ============================================================================
+
+std::filesystem::path BytecodeCache::default_directory() {
+  const char *root = std::getenv("DIRNUTS_DIR_PATH");
+  if (root == nullptr || *root == '\0') {
+    return {};
+  }
+  return std::filesystem::path(root) / "bytecode";
+}
+
+std::filesystem::path
+BytecodeCache::entry_path(const std::filesystem::path &path) const {
+  std::error_code ec;
+  std::filesystem::path absolute = std::filesystem::absolute(path, ec);
+  std::ostringstream name;
+  name << std::hex
+       << fs::content_hash((ec ? path : absolute).lexically_normal().string())
+       << ".luac";
+  return directory_ / name.str();
+}
+
+int BytecodeCache::load(lua_State *state,
+                        const std::filesystem::path &path) const {
+  std::string chunk_name = "@" + path.string();
+  std::string source;
+  std::error_code size_ec, time_ec;
+  auto size = std::filesystem::file_size(path, size_ec);
+  auto mtime = std::filesystem::last_write_time(path, time_ec);
+  if (size_ec || time_ec || !read_whole(path, source)) {
+    lua_pushstring(state, ("cannot open " + path.string()).c_str());
+    return LUA_ERRFILE;
+  }
+
+  EntryHeader header{};
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+#ifdef LUAJIT_VERSION_NUM
+  // LuaJIT reports 501 like PUC Lua 5.1, with another bytecode format
+  header.lua_version = LUAJIT_VERSION_NUM;
+#else
+  header.lua_version = LUA_VERSION_NUM;
+#endif
+  header.size = size;
+  header.mtime = static_cast<std::int64_t>(mtime.time_since_epoch().count());
+  header.hash = fs::content_hash(source);
+
+  std::filesystem::path entry = entry_path(path);
+  std::string cached;
+  if (read_whole(entry, cached) && cached.size() > sizeof(EntryHeader)) {
+    EntryHeader stored;
+    std::memcpy(&stored, cached.data(), sizeof(stored));
+    if (std::memcmp(&stored, &header, sizeof(header)) == 0) {
+      if (luaL_loadbufferx(state, cached.data() + sizeof(EntryHeader),
+                           cached.size() - sizeof(EntryHeader),
+                           chunk_name.c_str(), "b") == LUA_OK) {
+        return LUA_OK;
+      }
+      // Written by another Lua build: compile the source again
+      lua_pop(state, 1);
+    }
+  }
+
+  std::string_view text = script_text(source);
+  int status = luaL_loadbufferx(state, text.data(), text.size(),
+                                chunk_name.c_str(), nullptr);
+  if (status != LUA_OK) {
+    return status;
+  }
+  std::string bytecode;
+#if LUA_VERSION_NUM >= 503
+  int dumped = lua_dump(state, append_chunk, &bytecode, 0);
+#else
+  int dumped = lua_dump(state, append_chunk, &bytecode);
+#endif
+  if (dumped == 0 && !bytecode.empty()) {
+    store(entry, header, bytecode);
+  }
+  return LUA_OK;
+}
+
+} // namespace Lua
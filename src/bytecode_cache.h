@@ -0,0 +1,43 @@
+#pragma once
+
+#include <filesystem>
+#include <sol/sol.hpp>
+
+namespace Lua {
+
+/// @brief Compiled chunks of the script files run by the engine, so that
+/// large configs and presets are parsed once.
+///
+/// Each script gets one entry, named after a hash of its absolute path:
+///
+///     header (source size, mtime and content hash) | lua_dump output
+///
+/// An entry is only used when the script still has the same size, mtime and
+/// content hash; otherwise the script is compiled again and the entry
+/// replaced. Entries are replaced atomically (temporary file + rename), and
+/// failing to read or write one only costs a compilation.
+class BytecodeCache {
+public:
+  explicit BytecodeCache(std::filesystem::path directory)
+      : directory_(std::move(directory)) {}
+
+  /// @brief `$DIRNUTS_DIR_PATH/bytecode`, or an empty path (no cache) when
+  /// the variable is not set.
+  static std::filesystem::path default_directory();
+
+  /// @brief Push the main chunk of the script at `path`, like
+  /// luaL_loadfile: the first line is skipped if it starts with '#'.
+  /// @param state
+  /// @param path
+  /// @return LUA_OK, or an error status with the message pushed instead.
+  int load(lua_State *state, const std::filesystem::path &path) const;
+
+  /// @brief Entry of the script at `path`, existing or not.
+  /// @param path
+  std::filesystem::path entry_path(const std::filesystem::path &path) const;
+
+private:
+  std::filesystem::path directory_;
+};
+
+} // namespace Lua
@@ -0,0 +1,100 @@
+#include "compression.h"
+#include "manifest.h"
+#include <algorithm>
+#include <cstring>
+#include <lz4.h>
+#include <stdexcept>
+#include <vector>
+
+namespace fs {
+
+namespace {
+
+// Bodies that do not shrink by at least 1/8 are not worth decompressing
+constexpr std::size_t kMinSavingShift = 3;
+
+std::uint32_t read32(const char *p) {
+  std::uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+void put32(std::string &out, std::uint32_t value) {
+  out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+} // namespace
+
+// ============================================================================
+// CompressedContent Implementation
+// ============================================================================
+
+std::shared_ptr<const CompressedContent>
+CompressedContent::compress(std::string_view raw) {
+  auto result = std::make_shared<CompressedContent>();
+  result->size_ = raw.size();
+  result->hash_ = content_hash(raw);
+  std::string &out = result->data_;
+  out.reserve(raw.size() / 2);
+
+  std::vector<char> block(
+      static_cast<std::size_t>(LZ4_compressBound(static_cast<int>(kFrameSize))));
+  for (std::size_t offset = 0; offset < raw.size(); offset += kFrameSize) {
+    std::size_t size = std::min(kFrameSize, raw.size() - offset);
+    int compressed =
+        LZ4_compress_default(raw.data() + offset, block.data(),
+                             static_cast<int>(size),
+                             static_cast<int>(block.size()));
+    put32(out, static_cast<std::uint32_t>(size));
+    if (compressed > 0 && static_cast<std::size_t>(compressed) < size) {
+      put32(out, static_cast<std::uint32_t>(compressed));
+      out.append(block.data(), static_cast<std::size_t>(compressed));
+    } else {
+      put32(out, static_cast<std::uint32_t>(size));
+      out.append(raw.data() + offset, size);
+    }
+  }
+
+  if (out.size() > raw.size() - (raw.size() >> kMinSavingShift)) {
+    return nullptr;
+  }
+  out.shrink_to_fit();
+  return result;
+}
+
+bool CompressedContent::for_each_frame(
+    const std::function<bool(const char *, std::size_t)> &sink) const {
+  std::vector<char> buffer(kFrameSize);
+  std::size_t offset = 0;
+  while (offset < data_.size()) {
+    if (data_.size() - offset < 8) {
+      throw std::runtime_error("Corrupted compressed content");
+    }
+    std::size_t raw_size = read32(data_.data() + offset);
+    std::size_t stored_size = read32(data_.data() + offset + 4);
+    offset += 8;
+    if (raw_size > kFrameSize || stored_size > data_.size() - offset) {
+      throw std::runtime_error("Corrupted compressed content");
+    }
+    const char *frame = data_.data() + offset;
+    offset += stored_size;
+    if (stored_size == raw_size) {
+      if (!sink(frame, raw_size)) {
+        return false;
+      }
+      continue;
+    }
+    // Bounds-checked: never reads past the frame nor writes past raw_size
+    if (LZ4_decompress_safe(frame, buffer.data(), static_cast<int>(stored_size),
+                            static_cast<int>(raw_size)) !=
+        static_cast<int>(raw_size)) {
+      throw std::runtime_error("Corrupted compressed content");
+    }
+    if (!sink(buffer.data(), raw_size)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace fs
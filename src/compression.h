@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace fs {
+
+/// @brief A file body held compressed in memory (liblz4 blocks, in
+/// independent 64 KiB frames) until it is written.
+///
+/// Frames are decompressed one at a time into a single buffer, so writing a
+/// compressed file never holds more than one frame of raw bytes.
+///
+///     frame: raw size (u32) | stored size (u32) | bytes
+///     stored size == raw size: the frame is stored uncompressed
+class CompressedContent {
+public:
+  static constexpr std::size_t kFrameSize = 64 * 1024;
+
+  /// @brief Compress `raw`. Returns nullptr if it does not shrink enough to
+  /// be worth it: the body is then kept as is.
+  /// @param raw
+  static std::shared_ptr<const CompressedContent>
+  compress(std::string_view raw);
+
+  /// @brief Size of the raw body.
+  std::uint64_t size() const { return size_; }
+  /// @brief content_hash() of the raw body, as stored in manifests.
+  std::uint64_t hash() const { return hash_; }
+  std::size_t compressed_size() const { return data_.size(); }
+  /// @brief The frames. Compression is deterministic: two bodies are equal
+  /// exactly when their frames are.
+  std::string_view compressed_data() const { return data_; }
+
+  /// @brief Decompress frame by frame, calling `sink` with each one.
+  /// Stops when `sink` returns false.
+  /// @return false if `sink` stopped the decompression.
+  /// @throws std::runtime_error if the data is corrupted.
+  bool for_each_frame(
+      const std::function<bool(const char *data, std::size_t size)> &sink)
+      const;
+
+private:
+  std::string data_;
+  std::uint64_t size_ = 0;
+  std::uint64_t hash_ = 0;
+};
+
+} // namespace fs
@@ -0,0 +1,479 @@
+#include "../include/daemon.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define CDIRNUTS_HAS_UNIX_SOCKETS 1
+#endif
+
+namespace Lua {
+
+namespace {
+
+constexpr const char *kGreeting = "cdirnuts 1";
+// Requests are a few paths: anything longer is not a client
+constexpr std::size_t kMaxRequestBytes = 64 * 1024;
+
+#ifdef CDIRNUTS_HAS_UNIX_SOCKETS
+#ifdef MSG_NOSIGNAL
+constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+constexpr int kSendFlags = 0;
+#endif
+
+std::runtime_error socket_error(const std::string &what,
+                                const std::string &path) {
+  return std::runtime_error(what + " " + path + ": " +
+                            std::generic_category().message(errno));
+}
+
+sockaddr_un socket_address(const std::string &path) {
+  sockaddr_un address{};
+  if (path.size() >= sizeof(address.sun_path)) {
+    throw std::runtime_error("Socket path too long: " + path);
+  }
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  return address;
+}
+
+int open_socket() {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+  }
+  return fd;
+}
+
+// Whether the process at the other end of `fd` runs as this user
+bool same_user(int fd) {
+#if defined(__linux__) && defined(SO_PEERCRED)
+  ucred credentials{};
+  socklen_t size = sizeof(credentials);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size) != 0) {
+    return false;
+  }
+  return credentials.uid == geteuid();
+#else
+  uid_t uid;
+  gid_t gid;
+  return getpeereid(fd, &uid, &gid) == 0 && uid == geteuid();
+#endif
+}
+
+// Creates the directory of the socket, private to this user, when missing.
+// An existing one must not let another user swap the socket: owned by this
+// user or root, and writable by nobody else unless sticky.
+void prepare_socket_directory(const std::string &socket_path) {
+  std::string directory =
+      std::filesystem::path(socket_path).parent_path().string();
+  if (directory.empty()) {
+    return;
+  }
+  if (mkdir(directory.c_str(), 0700) != 0 && errno != EEXIST) {
+    throw socket_error("Failed to create the socket directory", directory);
+  }
+  struct stat st;
+  if (lstat(directory.c_str(), &st) != 0) {
+    throw socket_error("Cannot inspect the socket directory", directory);
+  }
+  bool owned = st.st_uid == geteuid() || st.st_uid == 0;
+  bool shared = (st.st_mode & (S_IWGRP | S_IWOTH)) != 0 &&
+                (st.st_mode & S_ISVTX) == 0;
+  if (!S_ISDIR(st.st_mode) || !owned || shared) {
+    throw std::runtime_error("Refusing to listen in " + directory +
+                             ": another user could replace the socket");
+  }
+}
+
+bool connect_to(int fd, const std::string &path) {
+  sockaddr_un address = socket_address(path);
+  return connect(fd, reinterpret_cast<const sockaddr *>(&address),
+                 sizeof(address)) == 0;
+}
+
+bool send_all(int fd, std::string_view data) {
+  while (!data.empty()) {
+    ssize_t sent = send(fd, data.data(), data.size(), kSendFlags);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data.remove_prefix(static_cast<std::size_t>(sent));
+  }
+  return true;
+}
+
+// Reads until `terminator` is received, EOF, or `limit` bytes
+std::string receive(int fd, std::string_view terminator, std::size_t limit) {
+  std::string data;
+  char buffer[4096];
+  while (data.size() < limit &&
+         (terminator.empty() || !data.ends_with(terminator))) {
+    ssize_t count = recv(fd, buffer, sizeof(buffer), 0);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      break;
+    }
+    data.append(buffer, static_cast<std::size_t>(count));
+  }
+  return data;
+}
+#endif
+
+std::optional<DaemonRequest> parse_request(const std::string &text) {
+  std::istringstream lines(text);
+  std::string line;
+  if (!std::getline(lines, line) || line != kGreeting) {
+    return std::nullopt;
+  }
+  DaemonRequest request;
+  while (std::getline(lines, line)) {
+    if (line == "end") {
+      return request;
+    }
+    std::size_t space = line.find(' ');
+    std::string key = line.substr(0, space);
+    std::string value = space == std::string::npos ? "" : line.substr(space + 1);
+    if (key == "cwd") {
+      request.cwd = value;
+    } else if (key == "script") {
+      request.script = value;
+    } else if (key == "preset") {
+      request.preset = value;
+    }
+  }
+  return std::nullopt;
+}
+
+} // namespace
+
+// ============================================================================
+// Daemon Implementation
+// ============================================================================
+
+Daemon::Daemon(std::string socket_path, unsigned warm_engines,
+               EnginePool::Configure configure, ResolvePreset resolve_preset)
+    : socket_path_(std::move(socket_path)),
+      warm_engines_(warm_engines == 0 ? 1 : warm_engines),
+      configure_(std::move(configure)),
+      resolve_preset_(std::move(resolve_preset)) {
+#ifdef CDIRNUTS_HAS_UNIX_SOCKETS
+  if (pipe(wake_fds_) != 0) {
+    throw std::runtime_error("Failed to create the daemon wake pipe");
+  }
+  fcntl(wake_fds_[0], F_SETFD, FD_CLOEXEC);
+  fcntl(wake_fds_[1], F_SETFD, FD_CLOEXEC);
+#endif
+  refill_thread_ = std::thread([this]() { refill(); });
+}
+
+Daemon::~Daemon() {
+  {
+    std::lock_guard<std::mutex> lock(engines_mutex_);
+    stopping_ = true;
+  }
+  engines_changed_.notify_all();
+  refill_thread_.join();
+#ifdef CDIRNUTS_HAS_UNIX_SOCKETS
+  close(wake_fds_[0]);
+  close(wake_fds_[1]);
+#endif
+}
+
+std::string Daemon::default_socket_path() {
+  const char *root = std::getenv("DIRNUTS_DIR_PATH");
+  if (root != nullptr && *root != '\0') {
+    return (std::filesystem::path(root) / "cdirnuts.sock").string();
+  }
+  const char *runtime = std::getenv("XDG_RUNTIME_DIR");
+  if (runtime != nullptr && *runtime != '\0') {
+    return (std::filesystem::path(runtime) / "cdirnuts.sock").string();
+  }
+#ifdef CDIRNUTS_HAS_UNIX_SOCKETS
+  // A directory of our own: serve() creates it 0700
+  return "/tmp/cdirnuts-" + std::to_string(geteuid()) + "/cdirnuts.sock";
+#else
+  return "cdirnuts.sock";
+#endif
+}
+
+void Daemon::refill() {
+  std::unique_lock<std::mutex> lock(engines_mutex_);
+  bool failed = false;
+  for (;;) {
+    engines_changed_.wait(lock, [&]() {
+      return stopping_ || !retired_.empty() ||
+             (!failed && ready_.size() < warm_engines_);
+    });
+    if (stopping_) {
+      break;
+    }
+    auto retired = std::move(retired_);
+    retired_.clear();
+    bool wanted = !failed && ready_.size() < warm_engines_;
+    lock.unlock();
+
+    // Engines are torn down and set up here, off the request path
+    retired.clear();
+    std::unique_ptr<LuaEngine> engine;
+    if (wanted) {
+      try {
+        engine = std::make_unique<LuaEngine>();
+        if (configure_) {
+          configure_(*engine);
+        }
+      } catch (const std::exception &e) {
+        // Requests then create their engine themselves
+        std::cerr << "Failed to prepare a Lua engine: " << e.what() << '\n';
+        engine.reset();
+        failed = true;
+      }
+    }
+
+    lock.lock();
+    if (engine) {
+      ready_.push_back(std::move(engine));
+    }
+  }
+  ready_.clear();
+  retired_.clear();
+}
+
+std::unique_ptr<LuaEngine> Daemon::take_engine() {
+  {
+    std::lock_guard<std::mutex> lock(engines_mutex_);
+    if (!ready_.empty()) {
+      auto engine = std::move(ready_.front());
+      ready_.pop_front();
+      engines_changed_.notify_all();
+      return engine;
+    }
+  }
+  auto engine = std::make_unique<LuaEngine>();
+  if (configure_) {
+    configure_(*engine);
+  }
+  return engine;
+}
+
+JobResult Daemon::run(const DaemonRequest &request) {
+  Job job{request.preset.empty() ? request.script : request.preset,
+          request.script};
+  JobResult result;
+  result.name = job.name;
+  if (!request.preset.empty()) {
+    std::optional<std::string> path =
+        resolve_preset_ ? resolve_preset_(request.preset) : std::nullopt;
+    if (!path) {
+      result.error = "Preset not found: " + request.preset;
+      return result;
+    }
+    job.path = *path;
+  }
+  if (job.path.empty()) {
+    result.error = "No script to run";
+    return result;
+  }
+
+  std::error_code ec;
+  std::filesystem::path home = std::filesystem::current_path(ec);
+  std::filesystem::current_path(request.cwd, ec);
+  if (ec) {
+    result.error = "Cannot enter " + request.cwd + ": " + ec.message();
+    return result;
+  }
+  try {
+    std::unique_ptr<LuaEngine> engine = take_engine();
+    // Nobody answers prompts on the daemon's terminal
+    engine->set_interactive(false);
+    result = run_job(*engine, job);
+    std::lock_guard<std::mutex> lock(engines_mutex_);
+    retired_.push_back(std::move(engine));
+    engines_changed_.notify_all();
+  } catch (const std::exception &e) {
+    result.error = e.what();
+  }
+  std::filesystem::current_path(home, ec);
+  return result;
+}
+
+#ifdef CDIRNUTS_HAS_UNIX_SOCKETS
+void Daemon::handle(int client) {
+  // A stuck client must not hold the daemon
+  timeval timeout{5, 0};
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  JobResult result;
+  if (!same_user(client)) {
+    // Requests run arbitrary scripts as this user
+    result.error = "Requests are only served to the daemon's owner";
+  } else {
+    std::string text = receive(client, "\nend\n", kMaxRequestBytes);
+    std::optional<DaemonRequest> request = parse_request(text);
+    if (request) {
+      result = run(*request);
+    } else {
+      result.error = "Malformed request";
+    }
+  }
+
+  std::string error = result.error;
+  if (error.empty() && result.write_errors > 0) {
+    error = std::to_string(result.write_errors) + " files could not be written";
+  }
+  if (!error.empty()) {
+    error += '\n';
+  }
+  error.insert(0, result.error_output);
+  std::string header = std::to_string(result.ok ? 0 : 1) + " " +
+                       std::to_string(result.output.size()) + " " +
+                       std::to_string(error.size()) + "\n";
+  send_all(client, header) && send_all(client, result.output) &&
+      send_all(client, error);
+}
+
+void Daemon::serve() {
+  sockaddr_un address = socket_address(socket_path_);
+  prepare_socket_directory(socket_path_);
+
+  // A socket file left by a daemon that died is replaced, a live one is not
+  int probe = open_socket();
+  if (probe >= 0) {
+    bool live = connect_to(probe, socket_path_);
+    close(probe);
+    if (live) {
+      throw std::runtime_error("A daemon already listens on " + socket_path_);
+    }
+  }
+  unlink(socket_path_.c_str());
+
+  int listener = open_socket();
+  if (listener < 0) {
+    throw socket_error("Failed to create the socket", socket_path_);
+  }
+  // Only the owner may connect: requests run arbitrary scripts
+  mode_t mask = umask(0077);
+  int bound = bind(listener, reinterpret_cast<const sockaddr *>(&address),
+                   sizeof(address));
+  umask(mask);
+  if (bound != 0 || listen(listener, 64) != 0) {
+    auto error = socket_error("Failed to listen on", socket_path_);
+    close(listener);
+    throw error;
+  }
+
+  for (;;) {
+    pollfd fds[2] = {{listener, POLLIN, 0}, {wake_fds_[0], POLLIN, 0}};
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (fds[1].revents != 0) {
+      char byte;
+      [[maybe_unused]] ssize_t drained = read(wake_fds_[0], &byte, 1);
+      break;
+    }
+    if ((fds[0].revents & POLLIN) != 0) {
+      int client = accept(listener, nullptr, nullptr);
+      if (client >= 0) {
+        handle(client);
+        close(client);
+      }
+    }
+  }
+
+  close(listener);
+  unlink(socket_path_.c_str());
+}
+
+void Daemon::stop() {
+  char byte = 1;
+  [[maybe_unused]] ssize_t written = write(wake_fds_[1], &byte, 1);
+}
+
+int send_request(const std::string &socket_path, const DaemonRequest &request,
+                 std::ostream &out, std::ostream &err) {
+  for (const std::string *field :
+       {&request.cwd, &request.script, &request.preset}) {
+    if (field->find('\n') != std::string::npos) {
+      throw std::invalid_argument("Daemon request fields cannot hold newlines");
+    }
+  }
+
+  int fd = open_socket();
+  if (fd < 0 || !connect_to(fd, socket_path)) {
+    auto error = socket_error("Cannot reach the cdirnuts daemon at",
+                              socket_path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    throw error;
+  }
+  // Someone else listening there would get the request and answer it
+  if (!same_user(fd)) {
+    close(fd);
+    throw std::runtime_error("The daemon at " + socket_path +
+                             " does not run as this user");
+  }
+
+  std::string text = std::string(kGreeting) + "\ncwd " + request.cwd + "\n";
+  text += request.preset.empty() ? "script " + request.script
+                                 : "preset " + request.preset;
+  text += "\nend\n";
+  bool sent = send_all(fd, text);
+  std::string response =
+      sent ? receive(fd, "", static_cast<std::size_t>(-1)) : std::string();
+  close(fd);
+
+  std::istringstream header(response.substr(0, response.find('\n')));
+  int status = 1;
+  std::size_t output_size = 0, error_size = 0;
+  header >> status >> output_size >> error_size;
+  std::size_t body = response.find('\n') + 1;
+  if (!sent || !header || body == 0 ||
+      response.size() != body + output_size + error_size) {
+    throw std::runtime_error("Invalid response from the cdirnuts daemon");
+  }
+  out << std::string_view(response).substr(body, output_size);
+  err << std::string_view(response).substr(body + output_size, error_size);
+  return status;
+}
+#else
+void Daemon::handle(int) {}
+
+void Daemon::serve() {
+  throw std::runtime_error("The daemon needs Unix domain sockets");
+}
+
+void Daemon::stop() {}
+
+int send_request(const std::string &, const DaemonRequest &, std::ostream &,
+                 std::ostream &) {
+  throw std::runtime_error("The daemon needs Unix domain sockets");
+}
+#endif
+
+} // namespace Lua
@@ -0,0 +1,156 @@
+#include "dedup.h"
+#include "compression.h"
+#include "file_copy.h"
+#include <algorithm>
+#include <filesystem>
+#include <functional>
+#include <string_view>
+
+namespace fs {
+
+namespace {
+
+// Below one filesystem block a clone saves no space and costs more syscalls
+// than simply writing the bytes again.
+constexpr std::size_t kMinReflinkBytes = 4096;
+
+void hash_combine(std::size_t &seed, std::size_t value) {
+  seed ^= value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2);
+}
+
+// Size of the file once written and a hash of what determines its bytes,
+// without producing them. False for streamed bodies, known only once
+// written.
+bool identify(const File &file, std::uint64_t &size, std::size_t &hash) {
+  const Tree &tree = *file.get_tree();
+  NodeId id = file.get_id();
+  if (file.is_streamed()) {
+    return false;
+  }
+  if (file.is_compressed()) {
+    const auto &compressed = tree.compressed_of(id);
+    size = compressed->size();
+    hash = static_cast<std::size_t>(compressed->hash());
+  } else if (file.is_filled()) {
+    const FillSpec &fill = tree.fill_of(id);
+    size = fill.size;
+    hash = std::hash<std::string>{}(fill.pattern);
+    for (const FillSpec::Hole &hole : fill.holes) {
+      hash_combine(hash, std::hash<std::uint64_t>{}(hole.offset));
+      hash_combine(hash, std::hash<std::uint64_t>{}(hole.length));
+    }
+  } else if (file.has_source()) {
+    std::error_code ec;
+    size = std::filesystem::file_size(file.get_source(), ec);
+    if (ec) {
+      return false;
+    }
+    hash = std::filesystem::hash_value(file.get_source().lexically_normal());
+  } else {
+    std::string_view content = file.get_content();
+    size = content.size();
+    hash = std::hash<std::string_view>{}(content);
+  }
+  hash_combine(hash, std::hash<std::uint64_t>{}(size));
+  return true;
+}
+
+// Whether two files of the same size and hash have the same body
+bool same_body(const File &a, const File &b) {
+  if (a.is_compressed() != b.is_compressed() ||
+      a.is_filled() != b.is_filled() || a.has_source() != b.has_source()) {
+    return false;
+  }
+  if (a.is_compressed()) {
+    const auto &first = a.get_tree()->compressed_of(a.get_id());
+    const auto &second = b.get_tree()->compressed_of(b.get_id());
+    return first == second ||
+           first->compressed_data() == second->compressed_data();
+  }
+  if (a.is_filled()) {
+    const FillSpec &first = a.get_tree()->fill_of(a.get_id());
+    const FillSpec &second = b.get_tree()->fill_of(b.get_id());
+    return first.pattern == second.pattern &&
+           std::equal(first.holes.begin(), first.holes.end(),
+                      second.holes.begin(), second.holes.end(),
+                      [](const FillSpec::Hole &x, const FillSpec::Hole &y) {
+                        return x.offset == y.offset && x.length == y.length;
+                      });
+  }
+  if (a.has_source()) {
+    return a.get_source().lexically_normal() ==
+           b.get_source().lexically_normal();
+  }
+  return a.get_content() == b.get_content();
+}
+
+} // namespace
+
+// ============================================================================
+// Deduper Implementation
+// ============================================================================
+
+bool Deduper::claim(const File &file) {
+  std::uint64_t size = 0;
+  std::size_t hash = 0;
+  if (!identify(file, size, hash) || size == 0 ||
+      (mode_ == DedupMode::Reflink && size < kMinReflinkBytes)) {
+    return true;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto &bucket = primaries_[hash];
+  for (const File &primary : bucket) {
+    if (primary.get_size() == file.get_size() && same_body(primary, file)) {
+      duplicates_.emplace_back(file, primary);
+      return false;
+    }
+  }
+  bucket.push_back(file);
+  return true;
+}
+
+void Deduper::mark_failed(const File &primary) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  failed_.insert(primary.get_id());
+}
+
+bool Deduper::link_duplicate(const File &duplicate, const File &primary) {
+  std::string from = primary.get_path().to_string();
+  std::string to = duplicate.get_path().to_string();
+  // Every way below truncates `to`, which may share the inode of `from`
+  unshare_file(to);
+
+  if (reflink_supported_) {
+    int cloned = reflink_file(from, to);
+    if (cloned == 1) {
+      ++cloned_;
+      return true;
+    }
+    if (cloned == 0) {
+      // Same answer for every other file on this filesystem
+      reflink_supported_ = false;
+    }
+  }
+
+  std::error_code ec;
+  if (mode_ == DedupMode::Hardlink) {
+    std::filesystem::remove(to, ec);
+    std::filesystem::create_hard_link(from, to, ec);
+    if (!ec) {
+      ++hardlinked_;
+      return true;
+    }
+  }
+
+  // In-kernel copy (copy_file_range/sendfile where available)
+  if (std::filesystem::copy_file(
+          from, to, std::filesystem::copy_options::overwrite_existing, ec) &&
+      !ec) {
+    ++copied_;
+    return true;
+  }
+  return false;
+}
+
+} // namespace fs
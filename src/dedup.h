@@ -0,0 +1,78 @@
+#pragma once
+
+#include "../include/fs.h"
+#include <cstddef>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace fs {
+
+/// @brief Tracks byte-identical files during one tree write.
+///
+/// The first file seen with a given body is the primary and is written
+/// normally; every later copy is recorded and produced in link_all() once
+/// all primaries are on disk, as a reflink, a hardlink or an in-kernel copy.
+///
+/// Bodies are told apart without producing them: plain and borrowed bodies
+/// by their bytes, compressed ones by their frames, filled ones by their
+/// FillSpec and copied ones by their source path. Streamed bodies are only
+/// known once written, so streamed files are never deduplicated.
+class Deduper {
+public:
+  explicit Deduper(DedupMode mode) : mode_(mode) {}
+
+  /// @brief Thread-safe. Returns true if the caller must write `file`
+  /// itself, false if it is a duplicate that link_all() will produce.
+  /// @param file
+  bool claim(const File &file);
+
+  /// @brief Thread-safe. Record that writing a primary failed, so that its
+  /// duplicates are written from memory rather than cloned from a partial
+  /// file.
+  /// @param primary
+  void mark_failed(const File &primary);
+
+  /// @brief Produce every duplicate from its primary. Files that cannot be
+  /// linked or copied are written from memory instead; failures are passed
+  /// to `report`, successes to `written`.
+  /// @param report
+  /// @param written
+  template <typename Report, typename Written>
+  void link_all(Report &&report, Written &&written) {
+    for (const auto &[duplicate, primary] : duplicates_) {
+      try {
+        if (failed_.contains(primary.get_id()) ||
+            !link_duplicate(duplicate, primary)) {
+          duplicate.write_to_disk();
+        }
+        written(duplicate);
+      } catch (const std::exception &e) {
+        report(e);
+      }
+    }
+    duplicates_.clear();
+  }
+
+  /// @brief Duplicates produced by link_all(), by how (see WriteReport).
+  std::size_t cloned() const { return cloned_; }
+  std::size_t hardlinked() const { return hardlinked_; }
+  std::size_t copied() const { return copied_; }
+
+private:
+  DedupMode mode_;
+  std::mutex mutex_;
+  std::unordered_map<std::size_t, std::vector<File>> primaries_;
+  std::vector<std::pair<File, File>> duplicates_;
+  std::unordered_set<NodeId> failed_;
+  bool reflink_supported_ = true;
+  std::size_t cloned_ = 0;
+  std::size_t hardlinked_ = 0;
+  std::size_t copied_ = 0;
+
+  bool link_duplicate(const File &duplicate, const File &primary);
+};
+
+} // namespace fs
@@ -0,0 +1,148 @@
+#include "durability.h"
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unordered_set>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#define CDIRNUTS_HAS_FSYNC 1
+#endif
+
+namespace fs {
+
+namespace {
+
+[[noreturn]] void sync_failed(const std::filesystem::path &path, int error) {
+  throw std::runtime_error("Failed to sync: " + path.string() + " - " +
+                           std::generic_category().message(error));
+}
+
+#ifdef CDIRNUTS_HAS_FSYNC
+int sync_descriptor(int fd, bool data_only) {
+#if defined(__linux__)
+  return data_only ? ::fdatasync(fd) : ::fsync(fd);
+#else
+  (void)data_only;
+  return ::fsync(fd);
+#endif
+}
+
+// Directories cannot be opened for writing; fsync works on any descriptor
+void sync_path(const std::filesystem::path &path, bool data_only) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    sync_failed(path, errno);
+  }
+  int result = sync_descriptor(fd, data_only);
+  int error = errno;
+  ::close(fd);
+  if (result != 0) {
+    sync_failed(path, error);
+  }
+}
+#else
+void sync_path(const std::filesystem::path &, bool) {}
+#endif
+
+class Timer {
+public:
+  explicit Timer(std::atomic<std::int64_t> &total)
+      : total_(total), start_(std::chrono::steady_clock::now()) {}
+  Timer(const Timer &) = delete;
+  Timer &operator=(const Timer &) = delete;
+  ~Timer() {
+    total_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - start_)
+                  .count();
+  }
+
+private:
+  std::atomic<std::int64_t> &total_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+} // namespace
+
+void sync_directory(const std::filesystem::path &path) {
+  sync_path(path.empty() ? std::filesystem::path(".") : path, false);
+}
+
+// ============================================================================
+// Syncer Implementation
+// ============================================================================
+
+void Syncer::file_written(int fd, const std::filesystem::path &path) {
+  if (durability_ != Durability::PerFile) {
+    return;
+  }
+  Timer timer(nanoseconds_);
+#ifdef CDIRNUTS_HAS_FSYNC
+  if (sync_descriptor(fd, true) != 0) {
+    sync_failed(path, errno);
+  }
+#else
+  (void)fd;
+  (void)path;
+#endif
+}
+
+void Syncer::file_written(const std::filesystem::path &path) {
+  if (durability_ != Durability::PerFile) {
+    return;
+  }
+  Timer timer(nanoseconds_);
+  sync_path(path, true);
+}
+
+void Syncer::finish(
+    const std::filesystem::path &root,
+    const std::vector<std::filesystem::path> &dirs,
+    const std::function<void(const std::exception &)> &report) {
+  if (durability_ == Durability::None) {
+    return;
+  }
+  Timer timer(nanoseconds_);
+
+  if (durability_ == Durability::Batched) {
+#ifdef __linux__
+    // One call flushes every file of the tree, however many there are
+    int fd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || ::syncfs(fd) != 0) {
+      report(std::runtime_error(
+          "Failed to sync filesystem of " + root.string() + " - " +
+          std::generic_category().message(errno)));
+    }
+    if (fd >= 0) {
+      ::close(fd);
+    }
+#elif defined(CDIRNUTS_HAS_FSYNC)
+    ::sync();
+#endif
+  }
+
+  std::unordered_set<std::string> synced;
+  auto sync_once = [&](const std::filesystem::path &dir) {
+    if (!synced.insert(dir.lexically_normal().generic_string()).second) {
+      return;
+    }
+    try {
+      sync_directory(dir);
+    } catch (const std::exception &e) {
+      report(e);
+    }
+  };
+  for (const auto &dir : dirs) {
+    sync_once(dir);
+  }
+  // The entry of the root itself
+  std::filesystem::path normal = root.lexically_normal();
+  if (!normal.has_filename()) {
+    normal = normal.parent_path();
+  }
+  sync_once(normal.parent_path());
+}
+
+} // namespace fs
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "../include/fs.h"
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <vector>
+
+namespace fs {
+
+/// @brief Applies WriteOptions::durability to one tree write and measures
+/// the time it costs.
+class Syncer {
+public:
+  explicit Syncer(Durability durability) : durability_(durability) {}
+
+  Durability durability() const { return durability_; }
+
+  /// @brief Thread-safe. PerFile: fdatasync `fd`, the descriptor the file
+  /// at `path` was just written through, before the writer closes it.
+  /// Nothing to do for the other policies.
+  /// @param fd
+  /// @param path Reported in errors.
+  /// @throws std::runtime_error if the file cannot be synced.
+  void file_written(int fd, const std::filesystem::path &path);
+
+  /// @brief Same, reopening the file by path, for files written without a
+  /// descriptor of ours: io_uring direct descriptors, dedup clones.
+  /// @param path
+  /// @throws std::runtime_error if the file cannot be synced.
+  void file_written(const std::filesystem::path &path);
+
+  /// @brief Batched: syncfs the filesystem holding `root`. Then, for both
+  /// policies, fsync every directory of `dirs` once so that the entries
+  /// created in them survive a crash, along with the parent of `root`.
+  /// Failures are passed to `report`.
+  /// @param root
+  /// @param dirs
+  /// @param report
+  void finish(const std::filesystem::path &root,
+              const std::vector<std::filesystem::path> &dirs,
+              const std::function<void(const std::exception &)> &report);
+
+  /// @brief Time spent syncing so far, summed over every thread.
+  double seconds() const {
+    return std::chrono::duration<double>(
+               std::chrono::nanoseconds(nanoseconds_.load()))
+        .count();
+  }
+
+private:
+  Durability durability_;
+  std::atomic<std::int64_t> nanoseconds_{0};
+};
+
+/// @brief fsync the directory at `path`, so that entries created or renamed
+/// in it are durable.
+/// @param path
+/// @throws std::runtime_error on failure.
+void sync_directory(const std::filesystem::path &path);
+
+} // namespace fs
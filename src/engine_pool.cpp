@@ -0,0 +1,84 @@
+#include "../include/engine_pool.h"
+#include "work_pool.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+namespace Lua {
+
+JobResult run_job(LuaEngine &lua, const Job &job) {
+  JobResult result;
+  result.name = job.name;
+  auto start = std::chrono::steady_clock::now();
+  std::ostringstream output, error_output;
+  try {
+    lua.set_output(output);
+    lua.set_error_output(error_output);
+    lua.execute_file(job.path);
+    result.files_written = lua.totals().files_written;
+    result.write_errors = lua.totals().errors;
+    result.ok = result.write_errors == 0;
+  } catch (const std::exception &e) {
+    result.error = e.what();
+  }
+  // The streams die with this call
+  lua.set_output(std::cout);
+  lua.set_error_output(std::cerr);
+  result.output = output.str();
+  result.error_output = error_output.str();
+  result.seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  return result;
+}
+
+// ============================================================================
+// EnginePool Implementation
+// ============================================================================
+
+JobResult EnginePool::run_one(const Job &job) const {
+  try {
+    LuaEngine lua;
+    if (configure_) {
+      configure_(lua);
+    }
+    // Jobs run side by side: none of them may prompt on the terminal
+    lua.set_interactive(false);
+    return run_job(lua, job);
+  } catch (const std::exception &e) {
+    JobResult result;
+    result.name = job.name;
+    result.error = e.what();
+    return result;
+  }
+}
+
+std::vector<JobResult> EnginePool::run(const std::vector<Job> &jobs,
+                                       const Done &done) const {
+  std::vector<JobResult> results(jobs.size());
+  unsigned workers =
+      workers_ != 0 ? workers_ : std::max(1u, std::thread::hardware_concurrency());
+  workers = static_cast<unsigned>(
+      std::min<std::size_t>(workers, std::max<std::size_t>(jobs.size(), 1)));
+
+  std::mutex done_mutex;
+  {
+    fs::WorkPool pool(workers);
+    for (std::size_t i = 0; i < jobs.size(); ++i) {
+      pool.submit([&, i]() {
+        results[i] = run_one(jobs[i]);
+        if (done) {
+          std::lock_guard<std::mutex> lock(done_mutex);
+          done(results[i]);
+        }
+      });
+    }
+    pool.wait();
+  }
+  return results;
+}
+
+} // namespace Lua
@@ -0,0 +1,209 @@
+#include "file_copy.h"
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+#define CDIRNUTS_HAS_FD_COPY 1
+#endif
+
+namespace fs {
+
+#ifdef __linux__
+int reflink_file(const std::filesystem::path &from,
+                 const std::filesystem::path &to) {
+  int src = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (src < 0) {
+    return -1;
+  }
+  int dst = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (dst < 0) {
+    close(src);
+    return -1;
+  }
+  int result = 1;
+  if (ioctl(dst, FICLONE, src) != 0) {
+    result = (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV ||
+              errno == EINVAL)
+                 ? 0
+                 : -1;
+  }
+  close(dst);
+  close(src);
+  return result;
+}
+#else
+int reflink_file(const std::filesystem::path &,
+                 const std::filesystem::path &) {
+  return 0;
+}
+#endif
+
+#ifdef CDIRNUTS_HAS_FD_COPY
+bool copy_file_contents(int from_fd, int to_fd) {
+  struct stat from_st, to_st;
+  if (fstat(from_fd, &from_st) != 0 || fstat(to_fd, &to_st) != 0) {
+    return false;
+  }
+  if (from_st.st_dev == to_st.st_dev && from_st.st_ino == to_st.st_ino) {
+    return true;
+  }
+  if (ftruncate(to_fd, 0) != 0) {
+    return false;
+  }
+
+#ifdef __linux__
+  if (ioctl(to_fd, FICLONE, from_fd) == 0) {
+    return true;
+  }
+  // copy_file_range moves the file offsets; both start at 0 here
+  bool copied_any = false;
+  for (;;) {
+    ssize_t count =
+        copy_file_range(from_fd, nullptr, to_fd, nullptr, 1 << 30, 0);
+    if (count == 0) {
+      return true;
+    }
+    if (count > 0) {
+      copied_any = true;
+      continue;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    // Unsupported between these filesystems: fall back to read/write
+    if (!copied_any && (errno == EXDEV || errno == ENOSYS ||
+                        errno == EINVAL || errno == EOPNOTSUPP)) {
+      break;
+    }
+    return false;
+  }
+#endif
+
+  std::vector<char> buffer(64 * 1024);
+  for (;;) {
+    ssize_t count = read(from_fd, buffer.data(), buffer.size());
+    if (count == 0) {
+      return true;
+    }
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    const char *data = buffer.data();
+    auto remaining = static_cast<std::size_t>(count);
+    while (remaining > 0) {
+      ssize_t written = write(to_fd, data, remaining);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      data += written;
+      remaining -= static_cast<std::size_t>(written);
+    }
+  }
+}
+
+void unshare_file(int dirfd, const char *name) {
+  struct stat st;
+  if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+      !S_ISREG(st.st_mode) || st.st_nlink <= 1) {
+    return;
+  }
+  if (unlinkat(dirfd, name, 0) != 0 && errno != ENOENT) {
+    throw std::runtime_error("Failed to replace hard-linked file: " +
+                             std::string(name) + " - " +
+                             std::generic_category().message(errno));
+  }
+}
+
+void unshare_file(const std::filesystem::path &path) {
+  unshare_file(AT_FDCWD, path.c_str());
+}
+
+void copy_file_contents(const std::filesystem::path &from,
+                        const std::filesystem::path &to) {
+  auto fail = [&](int error) {
+    throw std::runtime_error("Failed to copy file: " + from.string() + " to " +
+                             to.string() + " - " +
+                             std::generic_category().message(error));
+  };
+
+  int src = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (src < 0) {
+    fail(errno);
+  }
+  // The source stays readable through `src` if it is the file unlinked
+  try {
+    unshare_file(to);
+  } catch (...) {
+    close(src);
+    throw;
+  }
+  // Not O_TRUNC: the destination may be the source itself
+  int dst = open(to.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+  if (dst < 0) {
+    int error = errno;
+    close(src);
+    fail(error);
+  }
+  bool copied = copy_file_contents(src, dst);
+  int error = errno;
+  close(src);
+  if (close(dst) != 0 && copied) {
+    copied = false;
+    error = errno;
+  }
+  if (!copied) {
+    fail(error);
+  }
+}
+#else
+bool copy_file_contents(int, int) { return false; }
+
+void unshare_file(int, const char *) {}
+
+void unshare_file(const std::filesystem::path &path) {
+  std::error_code ec;
+  if (!std::filesystem::is_regular_file(std::filesystem::symlink_status(path, ec)) ||
+      std::filesystem::hard_link_count(path, ec) <= 1 || ec) {
+    return;
+  }
+  std::filesystem::remove(path, ec);
+  if (ec) {
+    throw std::runtime_error("Failed to replace hard-linked file: " +
+                             path.string() + " - " + ec.message());
+  }
+}
+
+void copy_file_contents(const std::filesystem::path &from,
+                        const std::filesystem::path &to) {
+  std::error_code ec;
+  if (std::filesystem::exists(to, ec) &&
+      std::filesystem::equivalent(from, to, ec)) {
+    return;
+  }
+  unshare_file(to);
+  std::filesystem::copy_file(
+      from, to, std::filesystem::copy_options::overwrite_existing, ec);
+  if (ec) {
+    throw std::runtime_error("Failed to copy file: " + from.string() + " to " +
+                             to.string() + " - " + ec.message());
+  }
+}
+#endif
+
+} // namespace fs
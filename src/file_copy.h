@@ -0,0 +1,37 @@
+#pragma once
+
+#include <filesystem>
+
+namespace fs {
+
+/// @brief Clone `from` into `to` (created or truncated) with FICLONE.
+/// @return 1: cloned, 0: the filesystem cannot clone, -1: other failure.
+/// Always 0 outside of Linux.
+int reflink_file(const std::filesystem::path &from,
+                 const std::filesystem::path &to);
+
+/// @brief Copy everything from `from_fd` into `to_fd` without passing the
+/// bytes through user space where the kernel allows it: FICLONE reflink
+/// first, then copy_file_range, then a plain read/write loop. `to_fd` is
+/// truncated first, unless both descriptors refer to the same file (the
+/// copy is then a no-op).
+/// @return false on I/O error (errno is set).
+bool copy_file_contents(int from_fd, int to_fd);
+
+/// @brief Same as the descriptor version, by path.
+/// @throws std::runtime_error on failure.
+void copy_file_contents(const std::filesystem::path &from,
+                        const std::filesystem::path &to);
+
+/// @brief Call before rewriting the file `name` (relative to `dirfd`,
+/// AT_FDCWD for a path) in place: a regular file with other hard links
+/// (hardlink dedup, hard link nodes of a previous write) is unlinked, so
+/// that the write creates a new inode instead of changing the content of
+/// every other name. Does nothing elsewhere or if the file is missing.
+/// @throws std::runtime_error if the file cannot be unlinked.
+void unshare_file(int dirfd, const char *name);
+
+/// @brief Same, by path.
+void unshare_file(const std::filesystem::path &path);
+
+} // namespace fs
@@ -0,0 +1,146 @@
+#include "fill.h"
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#define CDIRNUTS_HAS_FD_FILL 1
+#endif
+
+namespace fs {
+
+namespace {
+
+// The pattern repeated to about this many bytes, whole repetitions only
+constexpr std::size_t kFillBufferSize = 256 * 1024;
+
+std::string pattern_buffer(const std::string &pattern) {
+  std::size_t repeat = std::max<std::size_t>(1, kFillBufferSize / pattern.size());
+  std::string buffer;
+  buffer.reserve(repeat * pattern.size());
+  for (std::size_t i = 0; i < repeat; ++i) {
+    buffer += pattern;
+  }
+  return buffer;
+}
+
+// Calls `write(offset, length)` for every region of the file that is not a
+// hole, in order. Stops at the first failure.
+template <typename Write> bool for_each_data_region(const FillSpec &fill,
+                                                     Write write) {
+  std::uint64_t offset = 0;
+  for (const auto &hole : fill.holes) {
+    if (hole.offset > offset && !write(offset, hole.offset - offset)) {
+      return false;
+    }
+    offset = std::max(offset, hole.offset + hole.length);
+  }
+  return offset >= fill.size || write(offset, fill.size - offset);
+}
+
+} // namespace
+
+#ifdef CDIRNUTS_HAS_FD_FILL
+bool write_fill(int fd, const FillSpec &fill) {
+  if (::ftruncate(fd, static_cast<off_t>(fill.size)) != 0) {
+    return false;
+  }
+  if (fill.pattern.empty()) {
+    return true;
+  }
+
+  const std::string buffer = pattern_buffer(fill.pattern);
+  const std::uint64_t period = fill.pattern.size();
+  return for_each_data_region(fill, [&](std::uint64_t offset,
+                                        std::uint64_t length) {
+#ifdef __linux__
+    // Contiguous extents up front; filesystems without fallocate are fine
+    if (::fallocate(fd, 0, static_cast<off_t>(offset),
+                    static_cast<off_t>(length)) != 0 &&
+        errno != EOPNOTSUPP && errno != ENOSYS) {
+      return false;
+    }
+#endif
+    std::uint64_t end = offset + length;
+    while (offset < end) {
+      // Byte `offset` of the file is byte `offset % period` of the pattern
+      auto phase = static_cast<std::size_t>(offset % period);
+      auto count = static_cast<std::size_t>(
+          std::min<std::uint64_t>(buffer.size() - phase, end - offset));
+      ssize_t written = ::pwrite(fd, buffer.data() + phase, count,
+                                 static_cast<off_t>(offset));
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      offset += static_cast<std::uint64_t>(written);
+    }
+    return true;
+  });
+}
+
+void write_fill(const std::filesystem::path &path, const FillSpec &fill) {
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0666);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to create file: " + path.string());
+  }
+  bool complete = write_fill(fd, fill);
+  int error = errno;
+  if (::close(fd) != 0 && complete) {
+    complete = false;
+    error = errno;
+  }
+  if (!complete) {
+    throw std::runtime_error("Failed to write complete content to file: " +
+                             path.string() + " - " +
+                             std::generic_category().message(error));
+  }
+}
+#else
+bool write_fill(int, const FillSpec &) { return false; }
+
+// No sparse files: holes are written as zeros
+void write_fill(const std::filesystem::path &path, const FillSpec &fill) {
+  std::ofstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Failed to create file: " + path.string());
+  }
+  const std::string buffer =
+      fill.pattern.empty() ? std::string() : pattern_buffer(fill.pattern);
+  const std::string zeros(kFillBufferSize, '\0');
+  std::uint64_t position = 0;
+  auto put = [&](const std::string &source, std::uint64_t end, bool pattern) {
+    while (file && position < end) {
+      auto phase =
+          pattern ? static_cast<std::size_t>(position % fill.pattern.size())
+                  : 0;
+      auto count = static_cast<std::size_t>(
+          std::min<std::uint64_t>(source.size() - phase, end - position));
+      file.write(source.data() + phase, static_cast<std::streamsize>(count));
+      position += count;
+    }
+    return static_cast<bool>(file);
+  };
+  for_each_data_region(fill, [&](std::uint64_t offset, std::uint64_t length) {
+    return put(zeros, offset, false) &&
+           (buffer.empty() ? put(zeros, offset + length, false)
+                           : put(buffer, offset + length, true));
+  });
+  put(zeros, fill.size, false);
+  if (!file) {
+    throw std::runtime_error("Failed to write complete content to file: " +
+                             path.string());
+  }
+}
+#endif
+
+} // namespace fs
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "../include/fs.h"
+#include <filesystem>
+
+namespace fs {
+
+/// @brief Write `fill` to `fd`, an empty file open for writing: the file is
+/// extended to its size with ftruncate (so that holes cost nothing), data
+/// regions are preallocated with fallocate where supported, then the
+/// pattern is written from one small buffer reused for the whole file.
+/// @return false on I/O error (errno is set).
+bool write_fill(int fd, const FillSpec &fill);
+
+/// @brief Same as the descriptor version, by path (created or truncated).
+/// @throws std::runtime_error on failure.
+void write_fill(const std::filesystem::path &path, const FillSpec &fill);
+
+} // namespace fs
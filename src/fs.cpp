@@ -1,7 +1,21 @@
 #include "../include/fs.h"
+#include "compression.h"
+#include "file_copy.h"
+#include "fill.h"
+#include "openat_writer.h"
+#include "plan.h"
+#include "transaction.h"
+#include "uring_writer.h"
+#include "work_pool.h"
+#include "write_session.h"
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <thread>
+#include <utility>
+#include <vector>
 
 namespace fs {
 
@@ -18,21 +32,161 @@ Path Path::from_parent(const std::string &parent,
 
 Path::~Path() {}
 
+// ============================================================================
+// ContentPool Implementation
+// ============================================================================
+
+Content ContentPool::intern(std::string content) {
+  auto &bucket = contents_[std::hash<std::string>{}(content)];
+
+  for (auto it = bucket.begin(); it != bucket.end();) {
+    if (Content existing = it->lock()) {
+      if (*existing == content) {
+        return existing;
+      }
+      ++it;
+    } else {
+      it = bucket.erase(it);
+    }
+  }
+
+  auto interned = std::make_shared<const std::string>(std::move(content));
+  bucket.push_back(interned);
+  return interned;
+}
+
+std::size_t ContentPool::size() const {
+  std::size_t alive = 0;
+  for (const auto &[hash, bucket] : contents_) {
+    for (const auto &content : bucket) {
+      if (!content.expired()) {
+        ++alive;
+      }
+    }
+  }
+  return alive;
+}
+
 // ============================================================================
 // Dir Implementation
 // ============================================================================
 
-void Dir::add_subdir(Dir &&dir) noexcept {
-  this->sub_dir_.push_back(std::move(dir));
+void Dir::add_subdir(Dir &&dir) {
+  if (dir.tree_ != this->tree_) {
+    dir = Dir(this->tree_, this->tree_->import(*dir.tree_, dir.id_));
+  }
+  this->tree_->attach(this->id_, dir.id_);
+}
+
+void Dir::add_file(File &&file) {
+  if (file.get_tree() != this->tree_) {
+    file = File(this->tree_, this->tree_->import(*file.get_tree(),
+                                                 file.get_id()));
+  }
+  this->tree_->attach(this->id_, file.get_id());
 }
 
-void Dir::add_file(File &&file) noexcept {
-  this->files_.push_back(std::move(file));
+void Dir::add_link(Link &&link) {
+  if (link.get_tree() != this->tree_) {
+    link = Link(this->tree_, this->tree_->import(*link.get_tree(),
+                                                 link.get_id()));
+  }
+  this->tree_->attach(this->id_, link.get_id());
 }
 
-void Dir::write_to_disk() const {
+Path Dir::get_path() const {
+  return this->tree_ ? Path(this->tree_->path_of(this->id_)) : Path();
+}
+
+std::vector<Dir> Dir::get_subdirs() const {
+  std::vector<Dir> sub_dirs;
+  if (!this->tree_) {
+    return sub_dirs;
+  }
+  for (NodeId child = this->tree_->node(this->id_).first_child;
+       child != kNoNode; child = this->tree_->node(child).next_sibling) {
+    if (this->tree_->node(child).kind == Tree::Kind::Dir) {
+      sub_dirs.emplace_back(this->tree_, child);
+    }
+  }
+  return sub_dirs;
+}
 
-  std::filesystem::path dir_path = this->path_.to_path();
+std::vector<File> Dir::get_files() const {
+  std::vector<File> files;
+  if (!this->tree_) {
+    return files;
+  }
+  for (NodeId child = this->tree_->node(this->id_).first_child;
+       child != kNoNode; child = this->tree_->node(child).next_sibling) {
+    if (this->tree_->node(child).kind == Tree::Kind::File) {
+      files.emplace_back(this->tree_, child);
+    }
+  }
+  return files;
+}
+
+std::vector<Link> Dir::get_links() const {
+  std::vector<Link> links;
+  if (!this->tree_) {
+    return links;
+  }
+  for (NodeId child = this->tree_->node(this->id_).first_child;
+       child != kNoNode; child = this->tree_->node(child).next_sibling) {
+    Tree::Kind kind = this->tree_->node(child).kind;
+    if (kind == Tree::Kind::Symlink || kind == Tree::Kind::Hardlink) {
+      links.emplace_back(this->tree_, child);
+    }
+  }
+  return links;
+}
+
+Dir Dir::import_from_disk(const Path &source, const Path &destination) {
+  auto tree = Tree::create();
+  Dir root = tree->create_dir(destination);
+
+  // Directory entries come in no particular order: sort them so that the
+  // tree, and hence the write order, is reproducible
+  std::vector<std::pair<std::filesystem::path, Dir>> pending{
+      {source.to_path(), root}};
+  while (!pending.empty()) {
+    auto [from, dir] = std::move(pending.back());
+    pending.pop_back();
+
+    std::error_code ec;
+    std::vector<std::filesystem::directory_entry> entries;
+    for (std::filesystem::directory_iterator it(from, ec), end; !ec && it != end;
+         it.increment(ec)) {
+      entries.push_back(*it);
+    }
+    if (ec) {
+      throw std::runtime_error("Failed to read directory: " + from.string() +
+                               " - " + ec.message());
+    }
+    std::sort(entries.begin(), entries.end());
+
+    std::filesystem::path to = dir.get_path().to_path();
+    std::vector<std::pair<std::filesystem::path, Dir>> sub_dirs;
+    for (const auto &entry : entries) {
+      std::filesystem::path name = entry.path().filename();
+      if (entry.is_directory(ec) && !entry.is_symlink(ec)) {
+        Dir sub_dir = tree->create_dir(Path(to / name));
+        tree->attach(dir.get_id(), sub_dir.get_id());
+        sub_dirs.emplace_back(entry.path(), std::move(sub_dir));
+      } else if (entry.is_regular_file(ec)) {
+        File file = tree->create_copy(Path(to / name), entry.path());
+        tree->attach(dir.get_id(), file.get_id());
+      }
+    }
+    // Visited in order: the stack pops the first sub-directory first
+    pending.insert(pending.end(), std::make_move_iterator(sub_dirs.rbegin()),
+                   std::make_move_iterator(sub_dirs.rend()));
+  }
+  return root;
+}
+
+void Dir::create_on_disk() const {
+  std::filesystem::path dir_path = this->get_path().to_path();
 
   // Create the directory and all parent directories if needed
   std::error_code ec;
@@ -43,41 +197,191 @@ void Dir::write_to_disk() const {
                                dir_path.string() + " - " + ec.message());
     }
   }
+}
+
+void Dir::write_to_disk() const { this->write_to_disk(WriteOptions{}); }
+
+namespace {
+
+// Files are handed to the pool in batches so that directories full of tiny
+// files do not pay one task per file, while big files still spread out.
+constexpr std::size_t kBatchFiles = 64;
+constexpr std::size_t kBatchBytes = 1 << 20;
+
+void write_tree(WriteSession &session, const Dir &dir) {
+  dir.create_on_disk();
 
   // Write all files to disk
-  for (const auto &file : this->files_) {
-    try {
-      file.write_to_disk();
-    } catch (const std::exception &e) {
-      std::cerr << e.what() << '\n';
-    }
+  for (const auto &file : dir.get_files()) {
+    session.write_file(file);
   }
 
   // Recursively write all sub-directories to disk
-  for (const auto &sub_dir : this->sub_dir_) {
+  for (const auto &sub_dir : dir.get_subdirs()) {
     try {
-      sub_dir.write_to_disk();
+      write_tree(session, sub_dir);
     } catch (const std::exception &e) {
-      std::cerr << e.what() << '\n';
+      session.report(e);
     }
   }
 }
 
-Dir::~Dir() {}
+// Queue the contents of a directory that already exists on disk.
+void schedule_children(WorkPool &pool, WriteSession &session, const Dir &dir) {
+  std::vector<File> batch;
+  std::size_t bytes = 0;
+  auto submit_batch = [&]() {
+    pool.submit([&session, files = std::move(batch)]() {
+      for (const auto &file : files) {
+        session.write_file(file);
+      }
+    });
+    batch.clear();
+    bytes = 0;
+  };
+
+  for (auto &file : dir.get_files()) {
+    bytes += file.get_size();
+    batch.push_back(std::move(file));
+    if (batch.size() >= kBatchFiles || bytes >= kBatchBytes) {
+      submit_batch();
+    }
+  }
+  if (!batch.empty()) {
+    submit_batch();
+  }
+
+  for (auto &sub_dir : dir.get_subdirs()) {
+    pool.submit([&pool, &session, child = std::move(sub_dir)]() {
+      try {
+        child.create_on_disk();
+      } catch (const std::exception &e) {
+        session.report(e);
+        return;
+      }
+      schedule_children(pool, session, child);
+    });
+  }
+}
+
+unsigned resolve_jobs(unsigned jobs) {
+  if (jobs == 0) {
+    jobs = std::max(1u, std::thread::hardware_concurrency());
+  }
+  return jobs;
+}
+
+} // namespace
+
+WriteReport Dir::write_to_disk(const WriteOptions &options) const {
+  if (options.dry_run || options.preflight) {
+    WritePlan plan = this->plan(options);
+    WriteReport report;
+    if (!options.dry_run) {
+      if (!plan.fits) {
+        throw std::runtime_error(
+            "Not enough space to write " + this->get_path().to_string() +
+            ": " + std::to_string(plan.required_bytes) + " bytes and " +
+            std::to_string(plan.required_inodes) + " inodes needed, " +
+            std::to_string(plan.available_bytes) + " bytes and " +
+            std::to_string(plan.available_inodes) + " inodes available");
+      }
+      WriteOptions checked = options;
+      checked.preflight = false;
+      report = this->write_to_disk(checked);
+    }
+    report.plan = std::move(plan);
+    return report;
+  }
+
+  if (options.transactional) {
+    return write_tree_transactional(*this, options);
+  }
+  WriteSession session(options, *this);
+
+  if (options.backend == WriteBackend::IoUring &&
+      write_tree_uring(session, *this)) {
+    return session.finish();
+  }
+
+  unsigned jobs = resolve_jobs(options.jobs);
+  if (options.backend == WriteBackend::Openat &&
+      write_tree_openat(session, *this, jobs)) {
+    return session.finish();
+  }
+
+  if (jobs == 1) {
+    write_tree(session, *this);
+  } else {
+    // The root is created on the calling thread so that failing to create
+    // it still throws, exactly like the sequential writer.
+    this->create_on_disk();
+
+    session.set_threaded(true);
+    WorkPool pool(jobs);
+    schedule_children(pool, session, *this);
+    pool.wait();
+  }
+  return session.finish();
+}
+
+WritePlan Dir::plan(const WriteOptions &options) const {
+  return plan_tree(*this, options);
+}
+
+Dir::~Dir() {
+  if (this->tree_ && this->id_ != kNoNode) {
+    this->tree_->release(this->id_);
+  }
+}
 
 // ============================================================================
 // File Implementation
 // ============================================================================
+
+Path File::get_path() const {
+  return this->tree_ ? Path(this->tree_->path_of(this->id_)) : Path();
+}
+
 void File::write_to_disk() const {
-  std::filesystem::path file_path = this->path_.to_path();
+  std::filesystem::path file_path = this->get_path().to_path();
+  if (this->has_source()) {
+    copy_file_contents(this->tree_->source_of(this->id_), file_path);
+    return;
+  }
+  unshare_file(file_path);
+  if (this->is_filled()) {
+    write_fill(file_path, this->tree_->fill_of(this->id_));
+    return;
+  }
+
   std::ofstream file(file_path);
 
   if (!file) {
     throw std::runtime_error("Failed to create file: " + file_path.string());
   }
 
-  file.write(this->content_.c_str(),
-             static_cast<std::streamsize>(this->content_.size()));
+  if (this->is_streamed()) {
+    const ContentProducer &producer = this->tree_->producer_of(this->id_);
+    std::vector<char> buffer(kStreamBufferSize);
+    std::size_t count;
+    while ((count = producer(buffer.data(), buffer.size())) > 0) {
+      file.write(buffer.data(), static_cast<std::streamsize>(
+                                    std::min(count, buffer.size())));
+      if (!file) {
+        break;
+      }
+    }
+  } else if (this->is_compressed()) {
+    this->tree_->compressed_of(this->id_)->for_each_frame(
+        [&file](const char *data, std::size_t size) {
+          file.write(data, static_cast<std::streamsize>(size));
+          return static_cast<bool>(file);
+        });
+  } else {
+    std::string_view content = this->get_content();
+    file.write(content.data(), static_cast<std::streamsize>(content.size()));
+  }
 
   if (!file) {
     throw std::runtime_error("Failed to write complete content to file: " +
@@ -85,6 +389,63 @@ void File::write_to_disk() const {
   }
 }
 
-File::~File() {}
+std::uint64_t File::get_size() const {
+  if (this->is_filled()) {
+    return this->tree_->fill_of(this->id_).size;
+  }
+  if (this->is_compressed()) {
+    return this->tree_->compressed_of(this->id_)->size();
+  }
+  return this->get_content().size();
+}
+
+File::~File() {
+  if (this->tree_ && this->id_ != kNoNode) {
+    this->tree_->release(this->id_);
+  }
+}
+
+// ============================================================================
+// Link Implementation
+// ============================================================================
+
+Path Link::get_path() const {
+  return this->tree_ ? Path(this->tree_->path_of(this->id_)) : Path();
+}
+
+void Link::write_to_disk() const {
+  std::filesystem::path link_path = this->get_path().to_path();
+  std::filesystem::path target = this->get_target();
+
+  std::error_code ec;
+  std::filesystem::remove(link_path, ec);
+  ec.clear();
+  if (!this->is_symlink()) {
+    std::filesystem::create_hard_link(target, link_path, ec);
+  } else {
+    // Windows needs to know; elsewhere both calls are the same symlink(2)
+    NodeId node = this->tree_->link_target_of(this->id_);
+    bool to_dir = node != kNoNode
+                      ? this->tree_->node(node).kind == Tree::Kind::Dir
+                      : std::filesystem::is_directory(
+                            link_path.parent_path() / target, ec);
+    ec.clear();
+    if (to_dir) {
+      std::filesystem::create_directory_symlink(target, link_path, ec);
+    } else {
+      std::filesystem::create_symlink(target, link_path, ec);
+    }
+  }
+  if (ec) {
+    throw std::runtime_error("Failed to create link: " + link_path.string() +
+                             " - " + ec.message());
+  }
+}
+
+Link::~Link() {
+  if (this->tree_ && this->id_ != kNoNode) {
+    this->tree_->release(this->id_);
+  }
+}
 
 } // namespace fs
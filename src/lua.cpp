@@ -1,20 +1,468 @@
 #include "../include/lua.h"
+#include "../include/pack.h"
+#include "../include/process_graph.h"
 #include "./fs.h"
+#include "bytecode_cache.h"
+#include <algorithm>
 #include <filesystem>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 namespace Lua {
-LuaEngine::LuaEngine() {
+
+// ============================================================================
+// StringPins Implementation
+// ============================================================================
+
+/// @brief Keeps Lua strings alive while file bodies view their bytes.
+///
+/// Each pinned string holds a registry reference, dropped when the last
+/// file body using it goes away, i.e. when the tree collects its node or
+/// compresses its body. That may happen on any thread and even while the
+/// state is closing, so released references are only queued and handed
+/// back to Lua by collect(), on the thread running the engine.
+class StringPins {
+public:
+  explicit StringPins(lua_State *state) : state_(state) {}
+
+  /// @brief Pin the string on top of `value` and return the owner to give to
+  /// the file body.
+  /// @param self
+  /// @param value
+  static std::shared_ptr<const void>
+  pin(const std::shared_ptr<StringPins> &self, const sol::object &value) {
+    value.push(self->state_);
+    auto ref = std::make_unique<int>(luaL_ref(self->state_, LUA_REGISTRYINDEX));
+    ++self->pinned_;
+    return std::shared_ptr<const int>(ref.release(), [self](const int *ref) {
+      self->release(*ref);
+      delete ref;
+    });
+  }
+
+  /// @brief Thread-safe.
+  void release(int ref) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!closed_) {
+      released_.push_back(ref);
+    }
+  }
+
+  /// @brief Unreference the released strings. Lua thread only.
+  void collect() {
+    std::vector<int> released;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      released.swap(released_);
+    }
+    for (int ref : released) {
+      luaL_unref(state_, LUA_REGISTRYINDEX, ref);
+    }
+    pinned_ -= released.size();
+  }
+
+  /// @brief Registry references held. Lua thread only.
+  std::size_t pinned() const { return pinned_; }
+
+  /// @brief The state is going away along with every reference.
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    released_.clear();
+  }
+
+private:
+  lua_State *state_;
+  std::mutex mutex_;
+  std::vector<int> released_;
+  bool closed_ = false;
+  // Only touched by pin() and collect()
+  std::size_t pinned_ = 0;
+};
+
+namespace {
+
+// Below this size a string is copied into the engine's ContentPool, where
+// identical bodies share one buffer; above it, the file body views the Lua
+// string itself.
+constexpr std::size_t kBorrowMinSize = 4096;
+
+// Accepts nil (use the defaults), a number (worker count) or an options
+// table such as { jobs = 8, backend = "io_uring", dedup = "reflink",
+// incremental = true, prune = true, transactional = true,
+// durability = "batched", preflight = true, dry_run = true }.
+fs::WriteOptions parse_write_options(const sol::object &value,
+                                     fs::WriteOptions options) {
+  if (value.get_type() == sol::type::lua_nil ||
+      value.get_type() == sol::type::none) {
+    return options;
+  }
+
+  auto read_jobs = [](const sol::object &jobs) {
+    if (jobs.get_type() != sol::type::number || jobs.as<double>() < 0) {
+      throw std::runtime_error("jobs must be a non-negative number");
+    }
+    return static_cast<unsigned>(jobs.as<double>());
+  };
+
+  if (value.get_type() == sol::type::number) {
+    options.jobs = read_jobs(value);
+  } else if (value.get_type() == sol::type::table) {
+    sol::table table = value.as<sol::table>();
+    sol::object jobs = table["jobs"];
+    if (jobs.valid()) {
+      options.jobs = read_jobs(jobs);
+    }
+    sol::optional<std::string> backend = table["backend"];
+    if (backend) {
+      if (*backend == "stream") {
+        options.backend = fs::WriteBackend::Stream;
+      } else if (*backend == "io_uring") {
+        options.backend = fs::WriteBackend::IoUring;
+      } else if (*backend == "openat") {
+        options.backend = fs::WriteBackend::Openat;
+      } else {
+        throw std::runtime_error("Unknown write backend: " + *backend);
+      }
+    }
+    sol::object dedup = table["dedup"];
+    if (dedup.get_type() == sol::type::boolean) {
+      options.dedup = dedup.as<bool>() ? fs::DedupMode::Reflink
+                                       : fs::DedupMode::Off;
+    } else if (dedup.get_type() == sol::type::string) {
+      std::string mode = dedup.as<std::string>();
+      if (mode == "off") {
+        options.dedup = fs::DedupMode::Off;
+      } else if (mode == "reflink") {
+        options.dedup = fs::DedupMode::Reflink;
+      } else if (mode == "hardlink") {
+        options.dedup = fs::DedupMode::Hardlink;
+      } else {
+        throw std::runtime_error("Unknown dedup mode: " + mode);
+      }
+    } else if (dedup.valid()) {
+      throw std::runtime_error("dedup must be a boolean or a string");
+    }
+    sol::optional<std::string> durability = table["durability"];
+    if (durability) {
+      if (*durability == "none") {
+        options.durability = fs::Durability::None;
+      } else if (*durability == "file") {
+        options.durability = fs::Durability::PerFile;
+      } else if (*durability == "batched") {
+        options.durability = fs::Durability::Batched;
+      } else {
+        throw std::runtime_error("Unknown durability policy: " + *durability);
+      }
+    }
+    for (auto [key, flag] : {std::pair{"incremental", &options.incremental},
+                             std::pair{"prune", &options.prune},
+                             std::pair{"transactional", &options.transactional},
+                             std::pair{"preflight", &options.preflight},
+                             std::pair{"dry_run", &options.dry_run}}) {
+      sol::object field = table[key];
+      if (field.get_type() == sol::type::boolean) {
+        *flag = field.as<bool>();
+      } else if (field.valid()) {
+        throw std::runtime_error(std::string(key) + " must be a boolean");
+      }
+    }
+  } else {
+    throw std::runtime_error(
+        "write_virtual_dir options must be a number or a table");
+  }
+  return options;
+}
+
+// Adapts a Lua function returning string chunks (nil or "" at the end) to a
+// ContentProducer. Chunks larger than the write buffer are handed over in
+// several pulls, so only one chunk is alive at a time.
+class LuaChunkProducer {
+private:
+  sol::protected_function next_;
+  std::string pending_;
+  std::size_t offset_ = 0;
+  bool done_ = false;
+
+public:
+  explicit LuaChunkProducer(sol::protected_function next)
+      : next_(std::move(next)) {}
+
+  std::size_t operator()(char *buffer, std::size_t capacity) {
+    std::size_t filled = 0;
+    while (filled < capacity && !done_) {
+      if (offset_ == pending_.size()) {
+        sol::protected_function_result result = next_();
+        if (!result.valid()) {
+          sol::error err = result;
+          throw std::runtime_error(std::string("Content producer failed: ") +
+                                   err.what());
+        }
+        auto chunk = result.get<sol::optional<std::string>>();
+        if (!chunk || chunk->empty()) {
+          done_ = true;
+          break;
+        }
+        pending_ = std::move(*chunk);
+        offset_ = 0;
+      }
+      std::size_t count =
+          std::min(capacity - filled, pending_.size() - offset_);
+      pending_.copy(buffer + filled, count, offset_);
+      offset_ += count;
+      filled += count;
+    }
+    return filled;
+  }
+};
+
+std::uint64_t read_size(const sol::object &value, const char *what) {
+  if (value.get_type() != sol::type::number || value.as<double>() < 0) {
+    throw std::runtime_error(std::string(what) +
+                             " must be a non-negative number");
+  }
+  return static_cast<std::uint64_t>(value.as<double>());
+}
+
+// { size = n, pattern = "...", holes = { { offset, length }, ... } }
+fs::FillSpec parse_fill(const sol::table &table) {
+  fs::FillSpec fill;
+  fill.size = read_size(table["size"], "size");
+  sol::optional<std::string> pattern = table["pattern"];
+  if (pattern) {
+    fill.pattern = std::move(*pattern);
+  }
+  sol::optional<sol::table> holes = table["holes"];
+  if (holes) {
+    for (std::size_t i = 1; i <= holes->size(); ++i) {
+      sol::table hole = (*holes)[i];
+      fill.holes.push_back(
+          {read_size(hole[1], "hole offset"), read_size(hole[2], "hole length")});
+    }
+  }
+  return fill;
+}
+
+// Node behind a Dir, File or Link handle used as a link target.
+std::pair<std::shared_ptr<fs::Tree>, fs::NodeId>
+link_target(const sol::object &target, const char *function) {
+  if (target.is<std::shared_ptr<fs::File>>()) {
+    auto file = target.as<std::shared_ptr<fs::File>>();
+    return {file->get_tree(), file->get_id()};
+  }
+  if (target.is<std::shared_ptr<fs::Dir>>()) {
+    auto dir = target.as<std::shared_ptr<fs::Dir>>();
+    return {dir->get_tree(), dir->get_id()};
+  }
+  if (target.is<std::shared_ptr<fs::Link>>()) {
+    auto link = target.as<std::shared_ptr<fs::Link>>();
+    return {link->get_tree(), link->get_id()};
+  }
+  throw std::runtime_error(std::string(function) +
+                           " target must be a path or a node");
+}
+
+// Renders templates straight from the Lua values, on the Lua stack: tables
+// with a sequence part are lists, other tables maps; nil and false are
+// false. Nothing is converted or copied besides the output.
+class LuaTemplateContext : public Templates::Context {
+public:
+  LuaTemplateContext(lua_State *state, int root)
+      : state_(state), sections_{root} {}
+
+  bool push(std::string_view name) override {
+    luaL_checkstack(state_, 3, "template sections nested too deeply");
+    if (name == ".") {
+      lua_pushvalue(state_, sections_.back());
+      return true;
+    }
+    std::string_view first = name.substr(0, name.find('.'));
+    bool found = false;
+    for (auto it = sections_.rbegin(); it != sections_.rend() && !found;
+         ++it) {
+      if (lua_istable(state_, *it)) {
+        lua_pushlstring(state_, first.data(), first.size());
+        lua_gettable(state_, *it);
+        found = !lua_isnil(state_, -1);
+        if (!found) {
+          lua_pop(state_, 1);
+        }
+      }
+    }
+    if (!found) {
+      return false;
+    }
+    while (first.size() < name.size()) {
+      name.remove_prefix(first.size() + 1);
+      first = name.substr(0, name.find('.'));
+      if (!lua_istable(state_, -1)) {
+        lua_pop(state_, 1);
+        return false;
+      }
+      lua_pushlstring(state_, first.data(), first.size());
+      lua_gettable(state_, -2);
+      lua_remove(state_, -2);
+      if (lua_isnil(state_, -1)) {
+        lua_pop(state_, 1);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void push_item(std::size_t index) override {
+    lua_rawgeti(state_, -1, static_cast<int>(index + 1));
+  }
+
+  void pop() override { lua_pop(state_, 1); }
+
+  std::size_t list_size() override {
+    if (!lua_istable(state_, -1)) {
+      return kNotAList;
+    }
+    std::size_t size = lua_rawlen(state_, -1);
+    if (size > 0) {
+      return size;
+    }
+    // {} is an empty list, a table with other keys a map
+    lua_pushnil(state_);
+    if (lua_next(state_, -2) != 0) {
+      lua_pop(state_, 2);
+      return kNotAList;
+    }
+    return 0;
+  }
+
+  bool truthy() override { return lua_toboolean(state_, -1) != 0; }
+
+  void append(std::string &out) override {
+    switch (lua_type(state_, -1)) {
+    case LUA_TSTRING:
+    case LUA_TNUMBER: {
+      std::size_t length = 0;
+      const char *text = lua_tolstring(state_, -1, &length);
+      out.append(text, length);
+      break;
+    }
+    case LUA_TBOOLEAN:
+      out += lua_toboolean(state_, -1) ? "true" : "false";
+      break;
+    default:
+      break;
+    }
+  }
+
+  void enter() override { sections_.push_back(lua_gettop(state_)); }
+  void leave() override { sections_.pop_back(); }
+
+private:
+  lua_State *state_;
+  // Stack indices of the section values, outermost first
+  std::vector<int> sections_;
+};
+
+// "command line" or { name = "...", command = "...", after = { names... },
+// cwd = "...", capture = bool }
+Process::Command parse_command(const sol::object &entry) {
+  Process::Command command;
+  if (entry.get_type() == sol::type::string) {
+    command.command = entry.as<std::string>();
+    return command;
+  }
+  if (entry.get_type() != sol::type::table) {
+    throw std::runtime_error("run_commands: commands must be strings or "
+                             "tables");
+  }
+  sol::table table = entry.as<sol::table>();
+  sol::optional<std::string> line = table["command"];
+  if (!line) {
+    throw std::runtime_error("run_commands: command missing");
+  }
+  command.command = std::move(*line);
+  command.name = table.get_or<std::string>("name", "");
+  command.cwd = table.get_or<std::string>("cwd", "");
+  command.capture = table.get_or("capture", true);
+  sol::optional<sol::table> after = table["after"];
+  if (after) {
+    for (std::size_t i = 1; i <= after->size(); ++i) {
+      command.after.push_back((*after)[i].get<std::string>());
+    }
+  }
+  return command;
+}
+
+} // namespace
+
+// One prompt for the whole batch
+void LuaEngine::confirm_commands(
+    const std::vector<Process::Command> &commands) {
+  if (assume_yes_ || commands.empty()) {
+    return;
+  }
+  if (!interactive_) {
+    throw std::runtime_error(
+        "Cannot ask to run shell commands without a terminal: start "
+        "cdirnuts with --yes to allow them");
+  }
+  if (commands.size() == 1) {
+    std::cout << "Execute command: " << commands.front().command
+              << "? (y/n): ";
+  } else {
+    std::cout << "Execute " << commands.size() << " commands:\n";
+    for (const Process::Command &command : commands) {
+      std::cout << "  " << command.command << "\n";
+    }
+    std::cout << "? (y/n): ";
+  }
+  std::string response;
+  std::getline(std::cin, response);
+  if (response != "y" && response != "Y") {
+    throw std::runtime_error("Command execution cancelled by user");
+  }
+}
+
+LuaEngine::LuaEngine()
+    : pins_(std::make_shared<StringPins>(lua_state_.lua_state())),
+      bytecode_cache_(BytecodeCache::default_directory()) {
   lua_state_.open_libraries(sol::lib::base, sol::lib::io, sol::lib::string);
+#ifdef LUAJIT_VERSION
+  // Opening the jit library is what turns the compiler on
+  lua_state_.open_libraries(sol::lib::jit);
+#endif
   register_api();
 }
 
+// Nodes still referenced from Lua die while the state closes
+LuaEngine::~LuaEngine() { pins_->close(); }
+
+void LuaEngine::set_output(std::ostream &out) {
+  out_ = &out;
+  // Same format as the base library's print
+  sol::protected_function tostring = lua_state_["tostring"];
+  lua_state_["print"] = [this, tostring](sol::variadic_args args) {
+    bool first = true;
+    for (const auto &arg : args) {
+      if (!first) {
+        *out_ << '\t';
+      }
+      first = false;
+      sol::protected_function_result text = tostring(arg);
+      *out_ << (text.valid() ? text.get<std::string>() : "?");
+    }
+    *out_ << '\n';
+  };
+}
+
 void LuaEngine::register_api() {
   // Register usertypes for fs::Dir and fs::File to enable Sol2 to handle
   // shared_ptr instances
   lua_state_.new_usertype<fs::Dir>("Dir");
   lua_state_.new_usertype<fs::File>("File");
+  lua_state_.new_usertype<fs::Link>("Link");
 
   auto cdirnuts = lua_state_.create_table("cdirnuts");
 
@@ -24,14 +472,85 @@ void LuaEngine::register_api() {
 
   // Modified factories to return std::shared_ptr for managed ownership
   cdirnuts["create_virtual_dir"] =
-      [](const std::string &path) -> std::shared_ptr<fs::Dir> {
-    return std::make_shared<fs::Dir>(path);
+      [this](const std::string &path) -> std::shared_ptr<fs::Dir> {
+    tree_->maybe_collect();
+    return std::make_shared<fs::Dir>(tree_->create_dir(fs::Path(path)));
   };
 
+  // The content is either a string, a function returning successive
+  // chunks of the body (e.g. coroutine.wrap), pulled while the file is
+  // written so that large bodies never sit in memory, or a fill table
+  // { size = n, pattern = "...", holes = { { offset, length }, ... } }.
   cdirnuts["create_virtual_file"] =
-      [](const std::string &name,
-         const std::string &content) -> std::shared_ptr<fs::File> {
-    return std::make_shared<fs::File>(name, content);
+      [this](const std::string &name,
+             sol::object content) -> std::shared_ptr<fs::File> {
+    return std::make_shared<fs::File>(make_file(fs::Path(name), content));
+  };
+
+  // Mustache-style templates, each distinct source compiled once. The
+  // output is built in a buffer reused from one call to the next.
+  cdirnuts["render"] = [this](sol::this_state state, std::string_view source,
+                              sol::object vars) {
+    std::shared_ptr<const Templates::Template> compiled =
+        templates_.get(source);
+    // Moved out while in use: a render nested in a metamethod gets its own
+    std::string out = std::move(render_buffer_);
+    out.clear();
+    vars.push(state);
+    LuaTemplateContext context(state, lua_gettop(state));
+    compiled->render(context, out);
+    lua_pop(state, 1);
+    sol::object result = sol::make_object(state, std::string_view(out));
+    render_buffer_ = std::move(out);
+    return result;
+  };
+
+  // { name = content, fill spec or { ...subdirectory... }, node, ... }: the
+  // whole tree in one call, see build_dir()
+  cdirnuts["build_tree"] =
+      [this](const std::string &path,
+             sol::table spec) -> std::shared_ptr<fs::Dir> {
+    tree_->maybe_collect();
+    std::vector<const void *> ancestors;
+    return std::make_shared<fs::Dir>(
+        build_dir(std::filesystem::path(path), spec, ancestors));
+  };
+
+  // The target is a path as written on disk, or a Dir / File / Link handle:
+  // the link then follows the node wherever it ends up in the tree. Links
+  // are created after every directory and file of a write.
+  cdirnuts["create_virtual_symlink"] =
+      [this](const std::string &path,
+             sol::object target) -> std::shared_ptr<fs::Link> {
+    tree_->maybe_collect();
+    if (target.get_type() == sol::type::string) {
+      return std::make_shared<fs::Link>(
+          tree_->create_symlink(fs::Path(path), target.as<std::string>()));
+    }
+    auto [tree, id] = link_target(target, "create_virtual_symlink");
+    if (tree != tree_) {
+      return std::make_shared<fs::Link>(
+          tree_->create_symlink(fs::Path(path), tree->path_of(id).string()));
+    }
+    return std::make_shared<fs::Link>(
+        tree_->create_symlink(fs::Path(path), id));
+  };
+
+  cdirnuts["create_virtual_hardlink"] =
+      [this](const std::string &path,
+             sol::object target) -> std::shared_ptr<fs::Link> {
+    tree_->maybe_collect();
+    if (target.get_type() == sol::type::string) {
+      return std::make_shared<fs::Link>(
+          tree_->create_hardlink(fs::Path(path), target.as<std::string>()));
+    }
+    auto [tree, id] = link_target(target, "create_virtual_hardlink");
+    if (tree != tree_) {
+      return std::make_shared<fs::Link>(
+          tree_->create_hardlink(fs::Path(path), tree->path_of(id).string()));
+    }
+    return std::make_shared<fs::Link>(
+        tree_->create_hardlink(fs::Path(path), id));
   };
 
   // Updated bindings to accept std::shared_ptr for consistency
@@ -39,41 +558,316 @@ void LuaEngine::register_api() {
     file->write_to_disk();
   };
 
-  cdirnuts["write_virtual_dir"] = [](std::shared_ptr<fs::Dir> dir) {
-    dir->write_to_disk();
+  // Returns { written = n, unchanged = n, links = n, stale = { paths... },
+  // sync_time = seconds, errors = n }, plus the plan with preflight or
+  // dry_run (printed on stdout for a dry run)
+  cdirnuts["write_virtual_dir"] = [this](std::shared_ptr<fs::Dir> dir,
+                                         sol::object options) {
+    fs::WriteOptions parsed = parse_write_options(options, write_options_);
+    parsed.error_output = err_;
+    fs::WriteReport report = dir->write_to_disk(parsed);
+    collect();
+    totals_.files_written += report.files_written;
+    totals_.files_unchanged += report.files_unchanged;
+    totals_.links_written += report.links_written;
+    totals_.files_cloned += report.files_cloned;
+    totals_.files_hardlinked += report.files_hardlinked;
+    totals_.files_copied += report.files_copied;
+    totals_.errors += report.errors;
+    totals_.sync_seconds += report.sync_seconds;
+    if (parsed.dry_run) {
+      *out_ << "Plan for " << dir->get_path().to_string() << ":\n"
+                << report.plan.summary();
+    }
+    sol::table result = lua_state_.create_table();
+    if (parsed.dry_run || parsed.preflight) {
+      result["plan"] = plan_table(report.plan);
+    }
+    result["written"] = report.files_written;
+    result["unchanged"] = report.files_unchanged;
+    result["links"] = report.links_written;
+    result["cloned"] = report.files_cloned;
+    result["hardlinked"] = report.files_hardlinked;
+    result["copied"] = report.files_copied;
+    result["stale"] = sol::as_table(std::move(report.stale_files));
+    result["sync_time"] = report.sync_seconds;
+    result["errors"] = report.errors;
+    return result;
+  };
+
+  // Files reference their source and are copied in the kernel when written
+  cdirnuts["import_dir"] = [](const std::string &source,
+                              const std::string &destination) {
+    return std::make_shared<fs::Dir>(
+        fs::Dir::import_from_disk(fs::Path(source), fs::Path(destination)));
+  };
+
+  cdirnuts["plan_virtual_dir"] = [this](std::shared_ptr<fs::Dir> dir,
+                                        sol::object options) {
+    return plan_table(
+        dir->plan(parse_write_options(options, write_options_)));
+  };
+
+  cdirnuts["save_pack"] = [](std::shared_ptr<fs::Dir> dir,
+                             const std::string &path) {
+    fs::Pack::save(*dir, path);
   };
 
+  // The returned tree views the mapped pack; nothing is copied
+  cdirnuts["load_pack"] = [](const std::string &path,
+                             sol::optional<std::string> root) {
+    fs::Pack pack = fs::Pack::open(path);
+    return std::make_shared<fs::Dir>(root ? pack.instantiate(fs::Path(*root))
+                                          : pack.instantiate());
+  };
+
+  // Contents of at least `threshold` bytes are compressed in memory once
+  // appended to a directory; 0 or nil turns compression off
+  cdirnuts["set_compression"] = [this](sol::optional<double> threshold) {
+    if (threshold && *threshold < 0) {
+      throw std::runtime_error("set_compression threshold must be positive");
+    }
+    tree_->set_compression_threshold(
+        threshold ? static_cast<std::size_t>(*threshold) : 0);
+  };
+
+  // Handles are views over the engine tree: linking keeps them usable
   cdirnuts["append_subdir"] = [](std::shared_ptr<fs::Dir> parent,
                                  std::shared_ptr<fs::Dir> child) {
-    parent->add_subdir(std::move(*child));
+    parent->add_subdir(fs::Dir(*child));
   };
 
   cdirnuts["append_file"] = [](std::shared_ptr<fs::Dir> parent,
                                std::shared_ptr<fs::File> file) {
-    parent->add_file(std::move(*file));
+    parent->add_file(fs::File(*file));
   };
 
-  cdirnuts["execute_shell_command"] = [](const std::string &command) {
-    std::cout << "Execute command: " << command << "? (y/n): ";
-    std::string response;
-    std::getline(std::cin, response);
-    if (response != "y" && response != "Y") {
-      throw std::runtime_error("Command execution cancelled by user");
-    }
+  cdirnuts["append_link"] = [](std::shared_ptr<fs::Dir> parent,
+                               std::shared_ptr<fs::Link> link) {
+    parent->add_link(fs::Link(*link));
+  };
 
-    int ret = std::system(command.c_str());
-    if (ret != 0) {
+  cdirnuts["execute_shell_command"] = [this](const std::string &command) {
+    Process::ProcessGraph graph;
+    Process::Command single;
+    single.command = command;
+    single.capture = !interactive_;
+    graph.add(std::move(single));
+    confirm_commands(graph.commands());
+
+    Process::Result result = graph.run(1).front();
+    *out_ << result.output;
+    *err_ << result.errors;
+    if (result.status != Process::Result::Status::Succeeded) {
       throw std::runtime_error("Shell command failed with exit code " +
-                               std::to_string(ret));
+                               std::to_string(result.exit_code));
+    }
+  };
+
+  // Commands run concurrently once what they come `after` has succeeded;
+  // a failure skips its dependents. Returns { { name, command, status =
+  // "ok" | "failed" | "skipped", exit_code, stdout, stderr, time }, ... }
+  // in the order given, and whether everything succeeded.
+  cdirnuts["run_commands"] = [this](sol::table commands,
+                                    sol::object options) {
+    Process::ProcessGraph graph;
+    for (std::size_t i = 1; i <= commands.size(); ++i) {
+      Process::Command command = parse_command(commands[i]);
+      command.capture = command.capture || !interactive_;
+      graph.add(std::move(command));
     }
+    unsigned parallel = 0;
+    if (options.get_type() == sol::type::table) {
+      sol::table table = options.as<sol::table>();
+      sol::object limit = table["parallel"];
+      if (limit.valid()) {
+        parallel = static_cast<unsigned>(read_size(limit, "parallel"));
+      }
+    }
+    confirm_commands(graph.commands());
+
+    std::vector<Process::Result> results = graph.run(parallel);
+    sol::table list = lua_state_.create_table(static_cast<int>(results.size()));
+    bool ok = true;
+    for (std::size_t i = 0; i < results.size(); ++i) {
+      const Process::Result &result = results[i];
+      sol::table entry = lua_state_.create_table();
+      entry["name"] = result.name;
+      entry["command"] = result.command;
+      entry["status"] = Process::to_string(result.status);
+      entry["exit_code"] = result.exit_code;
+      entry["stdout"] = result.output;
+      entry["stderr"] = result.errors;
+      entry["time"] = result.seconds;
+      list[i + 1] = entry;
+      ok = ok && result.status == Process::Result::Status::Succeeded;
+    }
+    return std::make_tuple(list, ok);
   };
 }
 
+fs::File LuaEngine::make_file(const fs::Path &path,
+                              const sol::object &content) {
+  // Nodes dropped by the script give back their bodies first
+  tree_->maybe_collect();
+  if (content.get_type() == sol::type::function) {
+    return tree_->create_file(
+        path, fs::ContentProducer(
+                  LuaChunkProducer(content.as<sol::protected_function>())));
+  }
+  if (content.get_type() == sol::type::table) {
+    return tree_->create_file(path, parse_fill(content.as<sol::table>()));
+  }
+  if (content.get_type() != sol::type::string &&
+      content.get_type() != sol::type::number) {
+    throw std::runtime_error("File content must be a string, a function or "
+                             "a table");
+  }
+  pins_->collect();
+  if (content.get_type() == sol::type::string) {
+    auto bytes = content.as<std::string_view>();
+    if (bytes.size() >= kBorrowMinSize) {
+      return tree_->create_file(path, bytes, StringPins::pin(pins_, content));
+    }
+  }
+  return tree_->create_file(path, contents_.intern(content.as<std::string>()));
+}
+
+fs::Dir LuaEngine::build_dir(const std::filesystem::path &path,
+                             const sol::table &spec,
+                             std::vector<const void *> &ancestors) {
+  if (std::find(ancestors.begin(), ancestors.end(), spec.pointer()) !=
+      ancestors.end()) {
+    throw std::runtime_error("build_tree: " + path.string() +
+                             " contains itself");
+  }
+  ancestors.push_back(spec.pointer());
+
+  // Named entries are created in name order, so that the same spec always
+  // yields the same tree; array entries are existing nodes, appended as is
+  std::vector<std::pair<std::string, sol::object>> entries;
+  std::vector<sol::object> nodes;
+  for (const auto &[key, value] : spec) {
+    if (key.get_type() == sol::type::number) {
+      nodes.push_back(value);
+      continue;
+    }
+    if (key.get_type() != sol::type::string) {
+      throw std::runtime_error("build_tree: keys of " + path.string() +
+                               " must be names");
+    }
+    auto name = key.as<std::string>();
+    if (name.empty() || name == "." || name == ".." ||
+        name.find('/') != std::string::npos) {
+      throw std::runtime_error("build_tree: invalid name '" + name +
+                               "' in " + path.string());
+    }
+    entries.emplace_back(std::move(name), value);
+  }
+  std::sort(entries.begin(), entries.end(),
+            [](const auto &a, const auto &b) { return a.first < b.first; });
+
+  fs::Dir dir = tree_->create_dir(fs::Path(path));
+  for (const auto &[name, value] : entries) {
+    std::filesystem::path child = path / name;
+    bool subdir = value.get_type() == sol::type::table;
+    if (subdir) {
+      // A table with a numeric size is a fill spec, as for create_virtual_file
+      sol::object size = value.as<sol::table>()["size"];
+      subdir = size.get_type() != sol::type::number;
+    }
+    if (subdir) {
+      dir.add_subdir(build_dir(child, value.as<sol::table>(), ancestors));
+    } else {
+      dir.add_file(make_file(fs::Path(child), value));
+    }
+  }
+  for (const sol::object &node : nodes) {
+    if (node.is<std::shared_ptr<fs::File>>()) {
+      dir.add_file(fs::File(*node.as<std::shared_ptr<fs::File>>()));
+    } else if (node.is<std::shared_ptr<fs::Dir>>()) {
+      dir.add_subdir(fs::Dir(*node.as<std::shared_ptr<fs::Dir>>()));
+    } else if (node.is<std::shared_ptr<fs::Link>>()) {
+      dir.add_link(fs::Link(*node.as<std::shared_ptr<fs::Link>>()));
+    } else {
+      throw std::runtime_error("build_tree: array entries of " +
+                               path.string() + " must be nodes");
+    }
+  }
+
+  ancestors.pop_back();
+  return dir;
+}
+
+sol::table LuaEngine::plan_table(const fs::WritePlan &plan) {
+  sol::table table = lua_state_.create_table();
+  table["dirs"] = plan.dirs;
+  table["files"] = plan.files;
+  table["links"] = plan.links;
+  table["bytes"] = plan.bytes;
+  table["unknown_size_files"] = plan.unknown_size_files;
+  table["deepest_path"] = plan.deepest_path;
+  table["max_depth"] = plan.max_depth;
+  table["existing_files"] = plan.existing_files;
+  table["conflicts"] = sol::as_table(plan.conflicts);
+  table["required_bytes"] = plan.required_bytes;
+  table["required_inodes"] = plan.required_inodes;
+  table["available_bytes"] = plan.available_bytes;
+  table["available_inodes"] = plan.available_inodes;
+  table["fits"] = plan.fits;
+  return table;
+}
+
 void LuaEngine::execute_file(const std::string &path) {
-  lua_state_.script_file(path);
+  if (bytecode_cache_.empty()) {
+    lua_state_.script_file(path);
+    return;
+  }
+
+  lua_State *state = lua_state_.lua_state();
+  run_loaded(BytecodeCache(bytecode_cache_).load(state, path), path);
+}
+
+void LuaEngine::execute_chunk(std::string_view chunk,
+                              const std::string &name) {
+  lua_State *state = lua_state_.lua_state();
+  run_loaded(luaL_loadbufferx(state, chunk.data(), chunk.size(),
+                              ("=" + name).c_str(), nullptr),
+             name);
+}
+
+void LuaEngine::run_loaded(int status, const std::string &name) {
+  lua_State *state = lua_state_.lua_state();
+  if (status != LUA_OK) {
+    const char *error = lua_tostring(state, -1);
+    std::string message = error ? error : "cannot load " + name;
+    lua_pop(state, 1);
+    throw sol::error(message);
+  }
+  sol::protected_function chunk(state, -1);
+  lua_pop(state, 1);
+  sol::protected_function_result result = chunk();
+  collect();
+  if (!result.valid()) {
+    sol::error error = result;
+    throw error;
+  }
 }
 
 void LuaEngine::execute_string(const std::string &code) {
-  lua_state_.script(code);
+  sol::protected_function_result result =
+      lua_state_.safe_script(code, sol::script_pass_on_error);
+  collect();
+  if (!result.valid()) {
+    sol::error error = result;
+    throw error;
+  }
 }
+
+void LuaEngine::collect() {
+  tree_->collect();
+  pins_->collect();
+}
+
+std::size_t LuaEngine::pinned_strings() const { return pins_->pinned(); }
 } // namespace Lua
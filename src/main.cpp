@@ -1,9 +1,16 @@
+#include "../include/daemon.h"
 #include "../include/default_lua_script.h"
+#include "../include/engine_pool.h"
 #include "../include/lua.h"
+#include "../include/pack.h"
 #include "../include/presets.h"
 #include <CLI/CLI.hpp>
+#include <csignal>
 #include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
 
 /**
  * Program entry point that parses command-line options, performs default
@@ -16,7 +23,36 @@
  * - --preset list: lists all saved presets
  * - --preset add <name> <path>: adds a new preset
  * - --preset remove <name>: removes a preset by name
+ * - unpack <pack> [destination]: writes the tree stored in a .cdnpack file
+ * - batch [files...] [--preset <name>...] [--workers <n>]: runs several
+ *   configs and presets concurrently, one Lua engine each
+ * - serve [--socket <path>] [--engines <n>]: runs the resident daemon
+ * - send [file] [--preset <name>] [--socket <path>]: has the daemon run a
+ *   config or preset from the current directory
+ * - --jobs <n>: writes generated trees with <n> threads (0 = all cores)
+ * - --backend <stream|io_uring|openat>: system interface used to write trees
+ * - --dedup <off|reflink|hardlink>: writes identical files only once
+ * - --incremental: only rewrites files whose content changed since last run
+ * - --prune: with --incremental, deletes files the tree no longer contains
+ * - --transactional: writes each tree all-or-nothing through a staging dir
+ * - --durability <none|file|batched>: syncs written trees to disk
+ * - --compress-above <bytes>: compresses large file contents in memory
+ * - --preflight: checks free space and inodes before writing each tree
+ * - --dry-run: prints the plan of each tree write instead of writing it
+ * - --profile: prints where the Lua script spent its time
+ * - --profile-output <file>: writes that profile as collapsed stacks for
+ *   flame graph tools
  */
+namespace {
+Lua::Daemon *running_daemon = nullptr;
+
+void stop_daemon(int) {
+  if (running_daemon) {
+    running_daemon->stop();
+  }
+}
+} // namespace
+
 int main(int argc, char **argv) {
 
   Presets::PresetManager preset_manager;
@@ -44,6 +80,103 @@ int main(int argc, char **argv) {
 
   int result = 0;
 
+  // Materialization options shared by every Lua engine created below
+  fs::WriteOptions write_options;
+  app.add_option("-j,--jobs", write_options.jobs,
+                 "Threads used to write generated trees (0 = all cores)")
+      ->check(CLI::NonNegativeNumber);
+  app.add_option("--backend", write_options.backend,
+                 "Backend used to write generated trees")
+      ->transform(CLI::CheckedTransformer(
+          std::map<std::string, fs::WriteBackend>{
+              {"stream", fs::WriteBackend::Stream},
+              {"io_uring", fs::WriteBackend::IoUring},
+              {"openat", fs::WriteBackend::Openat}},
+          CLI::ignore_case));
+  app.add_option("--dedup", write_options.dedup,
+                 "Write identical files once and clone the copies")
+      ->transform(CLI::CheckedTransformer(
+          std::map<std::string, fs::DedupMode>{
+              {"off", fs::DedupMode::Off},
+              {"reflink", fs::DedupMode::Reflink},
+              {"hardlink", fs::DedupMode::Hardlink}},
+          CLI::ignore_case));
+  auto *incremental =
+      app.add_flag("--incremental", write_options.incremental,
+                   "Only write files whose content differs from the disk");
+  app.add_flag("--prune", write_options.prune,
+               "Delete files written by the previous run that are gone")
+      ->needs(incremental);
+  app.add_flag("--transactional", write_options.transactional,
+               "Write each tree to a staging directory and swap it in place")
+      ->excludes(incremental);
+  app.add_option("--durability", write_options.durability,
+                 "Sync written trees to disk (none, file, batched)")
+      ->transform(CLI::CheckedTransformer(
+          std::map<std::string, fs::Durability>{
+              {"none", fs::Durability::None},
+              {"file", fs::Durability::PerFile},
+              {"batched", fs::Durability::Batched}},
+          CLI::ignore_case));
+
+  app.add_flag("--preflight", write_options.preflight,
+               "Refuse to write a tree the target filesystem cannot hold");
+  app.add_flag("--dry-run", write_options.dry_run,
+               "Print what each tree write would do without writing it");
+
+  std::size_t compress_above = 0;
+  app.add_option("--compress-above", compress_above,
+                 "Keep file contents of at least this many bytes compressed "
+                 "in memory until they are written (0 = never)")
+      ->check(CLI::NonNegativeNumber);
+
+  bool assume_yes = false;
+  app.add_flag("-y,--yes", assume_yes,
+               "Run shell commands of scripts without asking first");
+
+  // Profiling of single runs (config file, preset use, default script)
+  bool profile = false;
+  std::string profile_output;
+  app.add_flag("--profile", profile,
+               "Print the time spent in each Lua function and binding");
+  app.add_option("--profile-output", profile_output,
+                 "Write the profile as collapsed stacks for flame graph "
+                 "tools");
+
+  // Runs `script` on `lua`, then reports where its time went, even when the
+  // script failed
+  auto run_profiled = [&](Lua::LuaEngine &lua,
+                          const std::function<void()> &script) {
+    bool profiling = profile || !profile_output.empty();
+    if (profiling) {
+      lua.enable_profiler();
+    }
+    auto write_profile = [&]() {
+      if (profile) {
+        lua.profiler()->write_report(std::cerr, 30);
+      }
+      if (!profile_output.empty()) {
+        std::ofstream out(profile_output);
+        lua.profiler()->write_collapsed(out);
+        if (!out) {
+          std::cerr << "Could not write the profile to " << profile_output
+                    << '\n';
+        }
+      }
+    };
+    try {
+      script();
+    } catch (...) {
+      if (profiling) {
+        write_profile();
+      }
+      throw;
+    }
+    if (profiling) {
+      write_profile();
+    }
+  };
+
   // Optional positional config file argument
   std::string config_file;
   app.add_option("file", config_file, "Configuration file path (optional)");
@@ -56,6 +189,9 @@ int main(int argc, char **argv) {
       ->required();
   config_cmd->callback([&]() {
     Lua::LuaEngine lua;
+    lua.set_write_options(write_options);
+    lua.set_compression_threshold(compress_above);
+    lua.set_assume_yes(assume_yes);
 
     if (!std::ifstream(config_file_cmd)) {
       std::cerr << "Configuration file does not exist: " << config_file_cmd
@@ -64,7 +200,7 @@ int main(int argc, char **argv) {
       return;
     }
 
-    lua.execute_file(config_file_cmd);
+    run_profiled(lua, [&]() { lua.execute_file(config_file_cmd); });
   });
 
   // --preset subcommand with nested options
@@ -126,13 +262,188 @@ int main(int argc, char **argv) {
       result = 1;
       return;
     }
-    preset->use();
+    Lua::LuaEngine lua;
+    lua.set_write_options(write_options);
+    lua.set_compression_threshold(compress_above);
+    lua.set_assume_yes(assume_yes);
+    run_profiled(lua, [&]() { lua.execute_file(preset->get_path()); });
+  });
+
+  // unpack <pack> [destination]
+  auto *unpack_cmd = app.add_subcommand(
+      "unpack", "Write the tree stored in a .cdnpack file");
+  std::string unpack_file, unpack_destination;
+  unpack_cmd->add_option("pack", unpack_file, "Pack file path")->required();
+  unpack_cmd->add_option("destination", unpack_destination,
+                         "Root of the written tree (default: saved root)");
+  unpack_cmd->callback([&]() {
+    try {
+      fs::Pack pack = fs::Pack::open(unpack_file);
+      fs::Dir root = unpack_destination.empty()
+                         ? pack.instantiate()
+                         : pack.instantiate(fs::Path(unpack_destination));
+      fs::WriteReport report = root.write_to_disk(write_options);
+      if (write_options.dry_run) {
+        std::cout << report.plan.summary();
+      }
+      if (write_options.durability != fs::Durability::None) {
+        std::cout << "Synced in " << report.sync_seconds << " s\n";
+      }
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << '\n';
+      result = 1;
+    }
+  });
+
+  // batch [files...] [--preset <name>...]
+  auto *batch_cmd = app.add_subcommand(
+      "batch", "Run several configs and presets in parallel");
+  std::vector<std::string> batch_files, batch_presets;
+  unsigned batch_workers = 0;
+  batch_cmd->add_option("files", batch_files, "Configuration file paths");
+  batch_cmd->add_option("-p,--preset", batch_presets, "Preset to run");
+  batch_cmd->add_option("-w,--workers", batch_workers,
+                        "Scripts run at once (0 = all cores)")
+      ->check(CLI::NonNegativeNumber);
+  batch_cmd->callback([&]() {
+    std::vector<Lua::Job> jobs;
+    for (const auto &file : batch_files) {
+      jobs.push_back({file, file});
+    }
+    for (const auto &name : batch_presets) {
+      const auto *preset = preset_manager.get_preset(name);
+      if (!preset) {
+        std::cerr << "Preset not found: " << name << '\n';
+        result = 1;
+        return;
+      }
+      jobs.push_back({name, preset->get_path()});
+    }
+    if (jobs.empty()) {
+      std::cerr << "Nothing to run: give config files or --preset\n";
+      result = 1;
+      return;
+    }
+
+    Lua::EnginePool pool(batch_workers, [&](Lua::LuaEngine &lua) {
+      lua.set_write_options(write_options);
+      lua.set_compression_threshold(compress_above);
+      lua.set_assume_yes(assume_yes);
+    });
+    std::size_t failed = 0;
+    pool.run(jobs, [&](const Lua::JobResult &job) {
+      std::cout << "== " << job.name << ": "
+                << (job.ok ? "ok" : "failed") << ", " << job.files_written
+                << " files written in " << job.seconds << " s\n"
+                << job.output;
+      std::cerr << job.error_output;
+      if (!job.error.empty()) {
+        std::cerr << job.name << ": " << job.error << '\n';
+      } else if (job.write_errors > 0) {
+        std::cerr << job.name << ": " << job.write_errors
+                  << " files could not be written\n";
+      }
+      failed += job.ok ? 0 : 1;
+    });
+    std::cout << jobs.size() - failed << "/" << jobs.size()
+              << " jobs succeeded\n";
+    if (failed > 0) {
+      result = 1;
+    }
+  });
+
+  // serve: keeps configured engines warm for `send`
+  auto *serve_cmd = app.add_subcommand(
+      "serve", "Run the daemon that executes scripts for `send`");
+  std::string socket_path = Lua::Daemon::default_socket_path();
+  unsigned warm_engines = 2;
+  serve_cmd->add_option("--socket", socket_path, "Unix socket to listen on");
+  serve_cmd->add_option("--engines", warm_engines,
+                        "Lua engines kept ready between requests")
+      ->check(CLI::PositiveNumber);
+  serve_cmd->callback([&]() {
+    // Presets edited while the daemon runs are picked up on the next request
+    std::filesystem::file_time_type presets_time;
+    std::error_code ec;
+    presets_time = std::filesystem::last_write_time(file_path, ec);
+    auto resolve_preset =
+        [&](const std::string &name) -> std::optional<std::string> {
+      std::error_code time_ec;
+      auto time = std::filesystem::last_write_time(file_path, time_ec);
+      if (!time_ec && time != presets_time) {
+        try {
+          preset_manager = Presets::PresetManager::load_presets_from_file(
+              file_path.string());
+          presets_time = time;
+        } catch (const std::exception &e) {
+          std::cerr << e.what() << '\n';
+        }
+      }
+      const auto *preset = preset_manager.get_preset(name);
+      if (!preset) {
+        return std::nullopt;
+      }
+      return preset->get_path();
+    };
+
+    try {
+      Lua::Daemon daemon(
+          socket_path, warm_engines,
+          [&](Lua::LuaEngine &lua) {
+            lua.set_write_options(write_options);
+            lua.set_compression_threshold(compress_above);
+            lua.set_assume_yes(assume_yes);
+          },
+          resolve_preset);
+      running_daemon = &daemon;
+      std::signal(SIGINT, stop_daemon);
+      std::signal(SIGTERM, stop_daemon);
+      std::cout << "Listening on " << socket_path << '\n';
+      daemon.serve();
+      running_daemon = nullptr;
+    } catch (const std::exception &e) {
+      running_daemon = nullptr;
+      std::cerr << e.what() << '\n';
+      result = 1;
+    }
+  });
+
+  // send [file] [--preset <name>]: thin client of `serve`
+  auto *send_cmd = app.add_subcommand(
+      "send", "Have the daemon run a config or preset from this directory");
+  std::string send_file, send_preset;
+  send_cmd->add_option("file", send_file, "Configuration file path");
+  send_cmd->add_option("-p,--preset", send_preset, "Preset to run")
+      ->excludes(send_cmd->get_option("file"));
+  send_cmd->add_option("--socket", socket_path, "Unix socket of the daemon");
+  send_cmd->callback([&]() {
+    if (send_file.empty() && send_preset.empty()) {
+      std::cerr << "Nothing to run: give a config file or --preset\n";
+      result = 1;
+      return;
+    }
+    Lua::DaemonRequest request;
+    request.cwd = std::filesystem::current_path().string();
+    if (!send_file.empty()) {
+      request.script = std::filesystem::absolute(send_file).string();
+    }
+    request.preset = send_preset;
+    try {
+      result = Lua::send_request(socket_path, request, std::cout, std::cerr);
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << '\n';
+      result = 1;
+    }
   });
 
   // Default behavior (no args)
   app.callback([&]() {
-    if (!*config_cmd && !*preset_cmd) {
+    if (!*config_cmd && !*preset_cmd && !*unpack_cmd && !*batch_cmd &&
+        !*serve_cmd && !*send_cmd) {
       Lua::LuaEngine lua;
+      lua.set_write_options(write_options);
+      lua.set_compression_threshold(compress_above);
+      lua.set_assume_yes(assume_yes);
 
       // If a config file was provided as positional argument, use it
       if (!config_file.empty()) {
@@ -142,10 +453,16 @@ int main(int argc, char **argv) {
           result = 1;
           return;
         }
-        lua.execute_file(config_file);
+        run_profiled(lua, [&]() { lua.execute_file(config_file); });
       } else {
         // Otherwise use default script
-        lua.execute_string(std::string(DEFAULT_LUA_SCRIPT));
+        run_profiled(lua, [&]() {
+          lua.execute_chunk(
+              std::string_view(
+                  reinterpret_cast<const char *>(DEFAULT_LUA_CHUNK),
+                  DEFAULT_LUA_CHUNK_SIZE),
+              "default_init.lua");
+        });
       }
     }
   });
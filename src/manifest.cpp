@@ -0,0 +1,99 @@
+#include "manifest.h"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace fs {
+
+namespace {
+constexpr const char *kHeader = "cdirnuts-manifest 1";
+
+// Stale entries get removed from disk: only paths that stay under the root
+// are trusted
+bool is_under_root(const std::string &relative_path) {
+  std::filesystem::path path(relative_path);
+  if (relative_path.empty() || path.has_root_path()) {
+    return false;
+  }
+  for (const auto &component : path) {
+    if (component == "..") {
+      return false;
+    }
+  }
+  return true;
+}
+} // namespace
+
+std::uint64_t content_hash(std::string_view content) {
+  std::uint64_t hash = 14695981039346656037ull;
+  for (char c : content) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// ============================================================================
+// Manifest Implementation
+// ============================================================================
+
+Manifest Manifest::load(const std::filesystem::path &path) {
+  Manifest manifest;
+  std::ifstream file(path);
+  std::string line;
+  if (!file || !std::getline(file, line) || line != kHeader) {
+    return manifest;
+  }
+
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    Entry entry;
+    fields >> std::hex >> entry.hash >> std::dec >> entry.size >> entry.mtime;
+    if (!fields || fields.get() != ' ') {
+      continue;
+    }
+    std::string relative_path;
+    std::getline(fields, relative_path);
+    if (is_under_root(relative_path)) {
+      manifest.entries_[relative_path] = entry;
+    }
+  }
+  return manifest;
+}
+
+void Manifest::save(const std::filesystem::path &path) const {
+  std::filesystem::path temporary = path;
+  temporary += ".tmp";
+  {
+    std::ofstream file(temporary);
+    if (!file) {
+      throw std::runtime_error("Failed to write manifest: " +
+                               temporary.string());
+    }
+    file << kHeader << '\n';
+    for (const auto &[relative_path, entry] : entries_) {
+      file << std::hex << entry.hash << std::dec << ' ' << entry.size << ' '
+           << entry.mtime << ' ' << relative_path << '\n';
+    }
+    if (!file) {
+      throw std::runtime_error("Failed to write manifest: " +
+                               temporary.string());
+    }
+  }
+  std::filesystem::rename(temporary, path);
+}
+
+std::optional<Manifest::Entry>
+Manifest::find(const std::string &relative_path) const {
+  auto it = entries_.find(relative_path);
+  if (it == entries_.end()) {
+    return std::nullopt;
+  }
+  return it->second;
+}
+
+void Manifest::set(const std::string &relative_path, const Entry &entry) {
+  entries_[relative_path] = entry;
+}
+
+} // namespace fs
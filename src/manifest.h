@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace fs {
+
+/// @brief Stable 64-bit FNV-1a hash of a file body, as stored in manifests.
+/// @param content
+std::uint64_t content_hash(std::string_view content);
+
+/// @brief Record of the files written by the previous incremental run,
+/// stored as a text file at the root of the output:
+///
+///     cdirnuts-manifest 1
+///     <hash hex> <size> <mtime> <path relative to the root>
+class Manifest {
+public:
+  struct Entry {
+    std::uint64_t hash = 0;
+    std::uint64_t size = 0;
+    /// Modification time of the file right after it was written, used to
+    /// notice files edited by hand since.
+    std::int64_t mtime = 0;
+  };
+
+  static constexpr const char *kFileName = ".cdirnuts-manifest";
+
+  /// @brief Load a manifest. A missing or unreadable file yields an empty
+  /// manifest: every file is then compared against the disk instead.
+  /// Entries whose path is absolute or contains ".." are dropped.
+  /// @param path
+  static Manifest load(const std::filesystem::path &path);
+
+  /// @brief Write the manifest atomically (temporary file + rename).
+  /// @param path
+  void save(const std::filesystem::path &path) const;
+
+  std::optional<Entry> find(const std::string &relative_path) const;
+  void set(const std::string &relative_path, const Entry &entry);
+  const std::unordered_map<std::string, Entry> &entries() const {
+    return entries_;
+  }
+
+private:
+  std::unordered_map<std::string, Entry> entries_;
+};
+
+} // namespace fs
@@ -0,0 +1,351 @@
+#include "openat_writer.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include "compression.h"
+#include "file_copy.h"
+#include "fill.h"
+#include "work_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <fcntl.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace fs {
+
+namespace {
+
+// Directories kept open at the same time. Well below the usual 1024
+// descriptor limit so that file opens never run out.
+constexpr int kMaxOpenDirs = 256;
+
+// Files are handed to the pool in batches, as in the stream writer.
+constexpr std::size_t kBatchFiles = 64;
+constexpr std::size_t kBatchBytes = 1 << 20;
+
+// An open directory. Without a descriptor (budget exhausted), its entries
+// are reached through their full path.
+class DirHandle {
+public:
+  DirHandle() = default;
+  DirHandle(int fd, std::atomic<int> &open_dirs)
+      : fd_(fd), open_dirs_(&open_dirs) {}
+  DirHandle(const DirHandle &) = delete;
+  DirHandle &operator=(const DirHandle &) = delete;
+  ~DirHandle() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+      --*open_dirs_;
+    }
+  }
+
+  int fd() const { return fd_; }
+
+private:
+  int fd_ = -1;
+  std::atomic<int> *open_dirs_ = nullptr;
+};
+
+using DirRef = std::shared_ptr<const DirHandle>;
+
+// Descriptor and name to pass to the *at() calls for a node
+struct Location {
+  int dirfd;
+  std::string name;
+};
+
+Location locate(const DirHandle &parent, const Tree &tree, NodeId id) {
+  if (parent.fd() < 0 || tree.node(id).rooted) {
+    return {AT_FDCWD, tree.path_of(id).string()};
+  }
+  return {parent.fd(), tree.name_of(id)};
+}
+
+bool write_all(int fd, const char *data, std::size_t size) {
+  while (size > 0) {
+    ssize_t count = ::write(fd, data, size);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += count;
+    size -= static_cast<std::size_t>(count);
+  }
+  return true;
+}
+
+class OpenatWriter {
+public:
+  explicit OpenatWriter(WriteSession &session) : session_(session) {}
+
+  DirRef open_root(const Dir &root) {
+    root.create_on_disk();
+    return open(Location{AT_FDCWD, root.get_path().to_path().string()}, root);
+  }
+
+  // Create `dir` and open it.
+  DirRef open_dir(const DirHandle &parent, const Dir &dir) {
+    Location at = locate(parent, *dir.get_tree(), dir.get_id());
+    if (at.dirfd == AT_FDCWD) {
+      // Intermediate directories may be missing
+      dir.create_on_disk();
+    } else if (::mkdirat(at.dirfd, at.name.c_str(), 0777) != 0 &&
+               errno != EEXIST) {
+      throw directory_error(dir, errno);
+    }
+    return open(at, dir);
+  }
+
+  void write_file(const DirHandle &parent, const File &file) {
+    // Streamed files must be produced on the calling thread
+    if (file.is_streamed() && session_.threaded()) {
+      session_.write_file(file);
+      return;
+    }
+    if (!session_.claim(file)) {
+      return;
+    }
+    try {
+      write_contents(parent, file, session_.syncer());
+      session_.written(file);
+    } catch (const std::exception &e) {
+      session_.report_file(file, e);
+    }
+  }
+
+  void write_tree(const DirHandle &handle, const Dir &dir) {
+    for (const auto &file : dir.get_files()) {
+      write_file(handle, file);
+    }
+    for (const auto &sub_dir : dir.get_subdirs()) {
+      try {
+        DirRef child = open_dir(handle, sub_dir);
+        write_tree(*child, sub_dir);
+      } catch (const std::exception &e) {
+        session_.report(e);
+      }
+    }
+  }
+
+  // Queue the contents of a directory that is already open.
+  void schedule_children(WorkPool &pool, const DirRef &handle,
+                         const Dir &dir) {
+    std::vector<File> batch;
+    std::size_t bytes = 0;
+    auto submit_batch = [&]() {
+      pool.submit([this, handle, files = std::move(batch)]() {
+        for (const auto &file : files) {
+          write_file(*handle, file);
+        }
+      });
+      batch.clear();
+      bytes = 0;
+    };
+
+    for (auto &file : dir.get_files()) {
+      bytes += file.get_size();
+      batch.push_back(std::move(file));
+      if (batch.size() >= kBatchFiles || bytes >= kBatchBytes) {
+        submit_batch();
+      }
+    }
+    if (!batch.empty()) {
+      submit_batch();
+    }
+
+    for (auto &sub_dir : dir.get_subdirs()) {
+      pool.submit([this, &pool, handle, child = std::move(sub_dir)]() {
+        DirRef child_handle;
+        try {
+          child_handle = open_dir(*handle, child);
+        } catch (const std::exception &e) {
+          session_.report(e);
+          return;
+        }
+        schedule_children(pool, child_handle, child);
+      });
+    }
+  }
+
+private:
+  WriteSession &session_;
+  std::atomic<int> open_dirs_{0};
+
+  DirRef open(const Location &at, const Dir &dir) {
+    if (++open_dirs_ > kMaxOpenDirs) {
+      --open_dirs_;
+      return std::make_shared<const DirHandle>();
+    }
+    int fd = ::openat(at.dirfd, at.name.c_str(),
+                      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+      int error = errno;
+      --open_dirs_;
+      if (error == EMFILE || error == ENFILE) {
+        return std::make_shared<const DirHandle>();
+      }
+      throw directory_error(dir, error);
+    }
+    return std::make_shared<const DirHandle>(fd, open_dirs_);
+  }
+
+  static std::runtime_error directory_error(const Dir &dir, int error) {
+    return std::runtime_error(
+        "Failed to create directory: " + dir.get_path().to_path().string() +
+        " - " + std::generic_category().message(error));
+  }
+
+  // Sync through `fd` before it is closed, the file counts as failed if
+  // that fails
+  static void sync(Syncer &syncer, int fd, const File &file) {
+    try {
+      syncer.file_written(fd, file.get_path().to_path());
+    } catch (...) {
+      ::close(fd);
+      throw;
+    }
+  }
+
+  static void copy_contents(const Location &at, const File &file,
+                            Syncer &syncer) {
+    const std::filesystem::path &source =
+        file.get_tree()->source_of(file.get_id());
+    int src = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (src >= 0) {
+      try {
+        unshare_file(at.dirfd, at.name.c_str());
+      } catch (...) {
+        ::close(src);
+        throw;
+      }
+    }
+    // Not O_TRUNC: the destination may be the source itself
+    int dst = src < 0 ? -1
+                      : ::openat(at.dirfd, at.name.c_str(),
+                                 O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+    bool copied = dst >= 0 && copy_file_contents(src, dst);
+    int error = errno;
+    if (src >= 0) {
+      ::close(src);
+    }
+    if (copied) {
+      sync(syncer, dst, file);
+    }
+    if (dst >= 0 && ::close(dst) != 0 && copied) {
+      copied = false;
+      error = errno;
+    }
+    if (!copied) {
+      throw std::runtime_error(
+          "Failed to copy file: " + source.string() + " to " +
+          file.get_path().to_path().string() + " - " +
+          std::generic_category().message(error));
+    }
+  }
+
+public:
+  static void write_contents(const DirHandle &parent, const File &file,
+                             Syncer &syncer) {
+    const Tree &tree = *file.get_tree();
+    Location at = locate(parent, tree, file.get_id());
+    if (file.has_source()) {
+      copy_contents(at, file, syncer);
+      return;
+    }
+    unshare_file(at.dirfd, at.name.c_str());
+    int fd = ::openat(at.dirfd, at.name.c_str(),
+                      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+      throw std::runtime_error("Failed to create file: " +
+                               file.get_path().to_path().string());
+    }
+
+    bool complete = true;
+    try {
+      if (file.is_filled()) {
+        complete = write_fill(fd, tree.fill_of(file.get_id()));
+      } else if (file.is_streamed()) {
+        const ContentProducer &producer = tree.producer_of(file.get_id());
+        std::vector<char> buffer(File::kStreamBufferSize);
+        std::size_t count;
+        while (complete &&
+               (count = producer(buffer.data(), buffer.size())) > 0) {
+          complete =
+              write_all(fd, buffer.data(), std::min(count, buffer.size()));
+        }
+      } else if (file.is_compressed()) {
+        complete = tree.compressed_of(file.get_id())
+                       ->for_each_frame([fd](const char *data,
+                                             std::size_t size) {
+                         return write_all(fd, data, size);
+                       });
+      } else {
+        std::string_view content = file.get_content();
+        complete = write_all(fd, content.data(), content.size());
+      }
+    } catch (...) {
+      ::close(fd);
+      throw;
+    }
+
+    if (complete) {
+      sync(syncer, fd, file);
+    }
+    if (::close(fd) != 0) {
+      complete = false;
+    }
+    if (!complete) {
+      throw std::runtime_error("Failed to write complete content to file: " +
+                               file.get_path().to_path().string());
+    }
+  }
+};
+
+} // namespace
+
+bool write_tree_openat(WriteSession &session, const Dir &root, unsigned jobs) {
+  OpenatWriter writer(session);
+  DirRef handle = writer.open_root(root);
+
+  if (jobs == 1) {
+    writer.write_tree(*handle, root);
+    return true;
+  }
+
+  session.set_threaded(true);
+  WorkPool pool(jobs);
+  writer.schedule_children(pool, handle, root);
+  handle.reset();
+  pool.wait();
+  return true;
+}
+
+bool write_file_openat(const File &file, Syncer &syncer) {
+  // No descriptor: the file is opened by full path
+  OpenatWriter::write_contents(DirHandle(), file, syncer);
+  return true;
+}
+
+} // namespace fs
+
+#else
+
+namespace fs {
+
+bool write_tree_openat(WriteSession &, const Dir &, unsigned) { return false; }
+
+bool write_file_openat(const File &, Syncer &) { return false; }
+
+} // namespace fs
+
+#endif
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "../include/fs.h"
+#include "write_session.h"
+
+namespace fs {
+
+/// @brief Materialize a tree relative to directory file descriptors: the
+/// directory being filled stays open and its entries are created with
+/// mkdirat/openat from their name only, so the kernel resolves one path
+/// component per node instead of the whole path. EEXIST from mkdirat is
+/// the only existence check.
+///
+/// Nodes that do not live directly under their parent, and directories
+/// beyond the open descriptor budget, are written by full path instead.
+/// Error messages match the stream writer. The root itself throws on
+/// failure, everything below it is reported through the session.
+/// @param session
+/// @param root
+/// @param jobs Resolved worker count; 1 writes on the calling thread.
+/// @return false if the platform has no *at() system calls. Nothing has been
+/// written in that case and the caller should fall back to the stream
+/// writer.
+bool write_tree_openat(WriteSession &session, const Dir &root, unsigned jobs);
+
+/// @brief Write one file by full path through openat, like the stream
+/// writer, handing its descriptor to `syncer` before closing it.
+/// @param file
+/// @param syncer
+/// @return false if the platform has no *at() system calls: nothing has
+/// been written.
+/// @throws std::runtime_error on failure, with the stream writer's messages.
+bool write_file_openat(const File &file, Syncer &syncer);
+
+} // namespace fs
@@ -0,0 +1,628 @@
+#include "../include/pack.h"
+#include "compression.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CDIRNUTS_HAS_MMAP 1
+#endif
+
+namespace fs {
+
+namespace {
+
+constexpr char kMagic[8] = {'C', 'D', 'N', 'P', 'A', 'C', 'K', '\0'};
+constexpr std::uint32_t kVersion = 1;
+// Written in host order; a pack is only read back on the same endianness
+constexpr std::uint32_t kByteOrder = 0x01020304;
+constexpr std::uint64_t kBlobAlignment = 4096;
+
+struct PackHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t byte_order;
+  std::uint32_t node_count;
+  std::uint32_t root_path_size;
+  std::uint64_t root_path_offset;
+  std::uint64_t nodes_offset;
+  std::uint64_t strings_offset;
+  std::uint64_t strings_size;
+  std::uint64_t blob_offset;
+  std::uint64_t blob_size;
+};
+static_assert(sizeof(PackHeader) == 72);
+
+enum PackKind : std::uint32_t {
+  kPackDir = 0,
+  kPackFile = 1,
+  kPackSymlink = 2,
+  kPackHardlink = 3,
+  kPackFill = 4
+};
+
+// Link records: content_size is kLinkToNode and content_offset the index of
+// the target record, or content_offset/size locate the target path in the
+// string table.
+constexpr std::uint64_t kLinkToNode = UINT64_MAX;
+
+struct PackNode {
+  std::uint32_t kind;
+  /// Index of the parent record, kNoNode for the root.
+  std::uint32_t parent;
+  /// Path relative to the parent, usually a single component.
+  std::uint32_t name_offset;
+  std::uint32_t name_size;
+  std::uint64_t content_offset;
+  std::uint64_t content_size;
+};
+static_assert(sizeof(PackNode) == 32);
+
+std::filesystem::path normalized(const std::filesystem::path &path) {
+  std::filesystem::path result = path.lexically_normal();
+  if (!result.has_filename() && result.has_parent_path() &&
+      result != result.root_path()) {
+    result = result.parent_path();
+  }
+  return result;
+}
+
+// A record name must stay below its parent once joined to its path: plain
+// components separated by '/' (several for nodes not directly under their
+// parent), none empty, "." or "..", and nothing absolute.
+bool is_safe_name(std::string_view name) {
+  if (name.empty() || name.find('\0') != std::string_view::npos ||
+      std::filesystem::path(name).has_root_path()) {
+    return false;
+  }
+  constexpr auto kNative =
+      static_cast<char>(std::filesystem::path::preferred_separator);
+  for (std::size_t start = 0; start <= name.size();) {
+    std::size_t end = name.find('/', start);
+    if (end == std::string_view::npos) {
+      end = name.size();
+    }
+    std::string_view component = name.substr(start, end - start);
+    if (component.empty() || component == "." || component == ".." ||
+        (kNative != '/' && component.find(kNative) != std::string_view::npos)) {
+      return false;
+    }
+    start = end + 1;
+  }
+  return true;
+}
+
+// Fill records: content_offset/size locate this encoding of the FillSpec in
+// the string table.
+//     size: u64 | hole count: u64 | (offset: u64, length: u64)... | pattern
+std::string encode_fill(const FillSpec &fill) {
+  std::string encoded;
+  auto put = [&](std::uint64_t value) {
+    encoded.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  };
+  put(fill.size);
+  put(fill.holes.size());
+  for (const auto &hole : fill.holes) {
+    put(hole.offset);
+    put(hole.length);
+  }
+  encoded += fill.pattern;
+  return encoded;
+}
+
+bool decode_fill(std::string_view encoded, FillSpec &fill) {
+  auto get = [&](std::uint64_t &value) {
+    if (encoded.size() < sizeof(value)) {
+      return false;
+    }
+    std::memcpy(&value, encoded.data(), sizeof(value));
+    encoded.remove_prefix(sizeof(value));
+    return true;
+  };
+  std::uint64_t count = 0;
+  if (!get(fill.size) || !get(count) || count > encoded.size() / 16) {
+    return false;
+  }
+  fill.holes.resize(static_cast<std::size_t>(count));
+  for (auto &hole : fill.holes) {
+    get(hole.offset);
+    get(hole.length);
+  }
+  fill.pattern = encoded;
+  return true;
+}
+
+// Offset + size is within [0, limit), without overflowing
+bool in_range(std::uint64_t offset, std::uint64_t size, std::uint64_t limit) {
+  return offset <= limit && size <= limit - offset;
+}
+
+} // namespace
+
+// ============================================================================
+// Pack::Mapping Implementation
+// ============================================================================
+
+/// @brief Read-only view of a whole pack file: mmap where available, a
+/// heap copy elsewhere.
+class Pack::Mapping {
+public:
+  explicit Mapping(const std::string &path) : path_(path) {
+#ifdef CDIRNUTS_HAS_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::runtime_error("Failed to open pack: " + path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw std::runtime_error("Failed to open pack: " + path);
+    }
+    size_ = static_cast<std::size_t>(st.st_size);
+    if (size_ > 0) {
+      void *data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error("Failed to map pack: " + path);
+      }
+      data_ = static_cast<const char *>(data);
+    }
+    ::close(fd);
+#else
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      throw std::runtime_error("Failed to open pack: " + path);
+    }
+    buffer_.assign(std::istreambuf_iterator<char>(file), {});
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+#endif
+  }
+
+  Mapping(const Mapping &) = delete;
+  Mapping &operator=(const Mapping &) = delete;
+
+  ~Mapping() {
+#ifdef CDIRNUTS_HAS_MMAP
+    if (data_) {
+      ::munmap(const_cast<char *>(data_), size_);
+    }
+#endif
+  }
+
+  const PackHeader &header() const { return header_; }
+
+  PackNode node(std::uint32_t index) const {
+    PackNode node;
+    std::memcpy(&node, data_ + header_.nodes_offset + index * sizeof(PackNode),
+                sizeof(PackNode));
+    return node;
+  }
+
+  std::string_view string_at(std::uint64_t offset, std::uint64_t size) const {
+    return {data_ + header_.strings_offset + offset,
+            static_cast<std::size_t>(size)};
+  }
+
+  std::string_view blob_at(std::uint64_t offset, std::uint64_t size) const {
+    return {data_ + header_.blob_offset + offset,
+            static_cast<std::size_t>(size)};
+  }
+
+  // Bounds-check every record once, so that instantiating never reads
+  // outside of the file.
+  void validate() {
+    if (size_ < sizeof(PackHeader)) {
+      invalid("truncated header");
+    }
+    std::memcpy(&header_, data_, sizeof(PackHeader));
+    if (std::memcmp(header_.magic, kMagic, sizeof(kMagic)) != 0) {
+      invalid("bad magic");
+    }
+    if (header_.version != kVersion || header_.byte_order != kByteOrder) {
+      invalid("unsupported version or byte order");
+    }
+    if (header_.node_count == 0 ||
+        !in_range(header_.nodes_offset,
+                  std::uint64_t{header_.node_count} * sizeof(PackNode),
+                  size_) ||
+        !in_range(header_.strings_offset, header_.strings_size, size_) ||
+        !in_range(header_.blob_offset, header_.blob_size, size_) ||
+        !in_range(header_.root_path_offset, header_.root_path_size,
+                  header_.strings_size)) {
+      invalid("section out of bounds");
+    }
+
+    for (std::uint32_t i = 0; i < header_.node_count; ++i) {
+      PackNode record = node(i);
+      bool is_root = i == 0;
+      if (record.kind > kPackFill) {
+        invalid("bad node kind");
+      }
+      if (is_root ? (record.kind != kPackDir || record.parent != kNoNode)
+                  : (record.parent >= i ||
+                     node(record.parent).kind != kPackDir ||
+                     record.name_size == 0)) {
+        invalid("bad node hierarchy");
+      }
+      bool is_link = record.kind == kPackSymlink ||
+                     record.kind == kPackHardlink;
+      if (is_link && record.content_size == kLinkToNode) {
+        std::uint32_t target =
+            record.content_offset < header_.node_count
+                ? node(static_cast<std::uint32_t>(record.content_offset)).kind
+                : kPackSymlink;
+        if (target == kPackSymlink || target == kPackHardlink ||
+            (record.kind == kPackHardlink && target != kPackFile &&
+             target != kPackFill)) {
+          invalid("bad link target");
+        }
+      } else if (!in_range(record.content_offset, record.content_size,
+                           is_link || record.kind == kPackFill
+                               ? header_.strings_size
+                               : header_.blob_size)) {
+        invalid("node out of bounds");
+      }
+      if (!in_range(record.name_offset, record.name_size,
+                    header_.strings_size)) {
+        invalid("node out of bounds");
+      }
+      if (!is_root &&
+          !is_safe_name(string_at(record.name_offset, record.name_size))) {
+        invalid("unsafe node name");
+      }
+    }
+  }
+
+private:
+  std::string path_;
+  const char *data_ = nullptr;
+  std::size_t size_ = 0;
+  PackHeader header_{};
+#ifndef CDIRNUTS_HAS_MMAP
+  std::string buffer_;
+#endif
+
+  [[noreturn]] void invalid(const std::string &reason) const {
+    throw std::runtime_error("Invalid pack file: " + path_ + " - " + reason);
+  }
+};
+
+// ============================================================================
+// Pack Implementation
+// ============================================================================
+
+void Pack::save(const Dir &root, const std::string &path) {
+  const Tree &tree = *root.get_tree();
+
+  std::vector<PackNode> nodes;
+  std::string strings;
+  std::unordered_map<std::string_view, std::uint32_t> string_offsets;
+  std::deque<std::string> names;    // stable storage for computed names
+  std::deque<std::string> produced; // bodies of streamed files
+  // A body, or a compressed one decompressed frame by frame as it is written
+  struct Blob {
+    std::string_view bytes;
+    const CompressedContent *compressed = nullptr;
+  };
+  std::vector<Blob> blobs;
+  std::uint64_t blob_size = 0;
+  std::unordered_map<const char *, PackNode> stored_bodies;
+  std::unordered_map<const CompressedContent *, PackNode> stored_compressed;
+
+  auto add_string = [&](std::string_view value) {
+    auto it = string_offsets.find(value);
+    if (it != string_offsets.end()) {
+      return it->second;
+    }
+    if (strings.size() + value.size() > UINT32_MAX) {
+      throw std::runtime_error("Too many names for a pack: " + path);
+    }
+    auto offset = static_cast<std::uint32_t>(strings.size());
+    strings.append(value);
+    string_offsets.emplace(names.emplace_back(value), offset);
+    return offset;
+  };
+
+  auto add_body = [&](const File &file, PackNode &record) {
+    std::string_view body = file.get_content();
+    if (file.is_streamed()) {
+      std::string &buffer = produced.emplace_back();
+      const ContentProducer &producer = tree.producer_of(file.get_id());
+      std::vector<char> chunk(File::kStreamBufferSize);
+      std::size_t count;
+      while ((count = producer(chunk.data(), chunk.size())) > 0) {
+        buffer.append(chunk.data(), std::min(count, chunk.size()));
+      }
+      body = buffer;
+    } else if (file.is_compressed()) {
+      // Stored once per shared body, never decompressed as a whole
+      const CompressedContent *compressed =
+          tree.compressed_of(file.get_id()).get();
+      auto [it, added] = stored_compressed.try_emplace(compressed, record);
+      if (added) {
+        it->second.content_offset = blob_size;
+        it->second.content_size = compressed->size();
+        blobs.push_back({{}, compressed});
+        blob_size += compressed->size();
+      }
+      record.content_offset = it->second.content_offset;
+      record.content_size = it->second.content_size;
+      return;
+    } else if (file.has_source()) {
+      std::ifstream source(file.get_source(), std::ios::binary);
+      std::string &buffer =
+          produced.emplace_back(std::istreambuf_iterator<char>(source),
+                                std::istreambuf_iterator<char>());
+      if (!source && !source.eof()) {
+        throw std::runtime_error("Failed to read file: " +
+                                 file.get_source().string());
+      }
+      body = buffer;
+    }
+    // Files sharing a Content (see ContentPool) are stored once
+    auto it = body.empty() ? stored_bodies.end()
+                           : stored_bodies.find(body.data());
+    if (it != stored_bodies.end() && it->second.content_size == body.size()) {
+      record.content_offset = it->second.content_offset;
+      record.content_size = it->second.content_size;
+      return;
+    }
+    record.content_offset = blob_size;
+    record.content_size = body.size();
+    blobs.push_back({body});
+    blob_size += body.size();
+    if (!body.empty()) {
+      stored_bodies[body.data()] = record;
+    }
+  };
+
+  std::filesystem::path root_path = normalized(root.get_path().to_path());
+  std::uint32_t root_path_offset = add_string(root_path.generic_string());
+
+  // Pre-order, children in their original order
+  struct Pending {
+    NodeId id;
+    std::uint32_t parent;
+  };
+  std::vector<Pending> stack{{root.get_id(), kNoNode}};
+  std::vector<std::filesystem::path> dir_paths; // per record, empty for files
+  std::unordered_map<NodeId, std::uint32_t> indices;
+  std::vector<std::pair<std::uint32_t, NodeId>> node_links;
+  while (!stack.empty()) {
+    auto [id, parent] = stack.back();
+    stack.pop_back();
+    if (nodes.size() >= kNoNode) {
+      throw std::runtime_error("Too many nodes for a pack: " + path);
+    }
+    auto index = static_cast<std::uint32_t>(nodes.size());
+    const Tree::Node &node = tree.node(id);
+
+    PackNode record{};
+    switch (node.kind) {
+    case Tree::Kind::Dir:
+      record.kind = kPackDir;
+      break;
+    case Tree::Kind::File:
+      record.kind = node.filled ? kPackFill : kPackFile;
+      break;
+    case Tree::Kind::Symlink:
+      record.kind = kPackSymlink;
+      break;
+    case Tree::Kind::Hardlink:
+      record.kind = kPackHardlink;
+      break;
+    }
+    indices.emplace(id, index);
+    record.parent = parent;
+    if (parent != kNoNode) {
+      std::string name;
+      if (!node.rooted) {
+        name = tree.name_of(id);
+      } else {
+        // Not directly under its parent: store the relative path
+        const std::filesystem::path &parent_path = dir_paths[parent];
+        std::filesystem::path relative =
+            normalized(tree.path_of(id)).lexically_relative(parent_path);
+        if (relative.empty() || relative == "." ||
+            *relative.begin() == "..") {
+          throw std::invalid_argument("Cannot pack " +
+                                      tree.path_of(id).string() +
+                                      ": it is outside of " +
+                                      parent_path.string());
+        }
+        name = relative.generic_string();
+      }
+      record.name_offset = add_string(name);
+      record.name_size = static_cast<std::uint32_t>(name.size());
+    }
+
+    if (node.kind == Tree::Kind::Dir) {
+      dir_paths.push_back(normalized(tree.path_of(id)));
+      std::vector<NodeId> children;
+      for (NodeId child = node.first_child; child != kNoNode;
+           child = tree.node(child).next_sibling) {
+        children.push_back(child);
+      }
+      for (auto it = children.rbegin(); it != children.rend(); ++it) {
+        stack.push_back({*it, index});
+      }
+    } else if (node.filled) {
+      // Stored as its description, however large the file
+      dir_paths.emplace_back();
+      std::string fill = encode_fill(tree.fill_of(id));
+      record.content_offset = add_string(fill);
+      record.content_size = fill.size();
+    } else if (node.kind == Tree::Kind::File) {
+      dir_paths.emplace_back();
+      add_body(File(root.get_tree(), id), record);
+    } else {
+      dir_paths.emplace_back();
+      if (tree.link_target_of(id) != kNoNode) {
+        node_links.emplace_back(index, id);
+      } else {
+        std::string target = tree.link_path_of(id).generic_string();
+        record.content_offset = add_string(target);
+        record.content_size = target.size();
+      }
+    }
+    nodes.push_back(record);
+  }
+
+  // Targets are known once every record has its index. Links to links are
+  // kept by path: instantiate() only creates links to files and dirs.
+  for (auto [index, id] : node_links) {
+    PackNode &record = nodes[index];
+    NodeId target = tree.link_target_of(id);
+    auto it = indices.find(target);
+    if (it != indices.end() && (tree.node(target).kind == Tree::Kind::Dir ||
+                                tree.node(target).kind == Tree::Kind::File)) {
+      record.content_offset = it->second;
+      record.content_size = kLinkToNode;
+    } else {
+      std::string target = tree.link_path_of(id).generic_string();
+      record.content_offset = add_string(target);
+      record.content_size = target.size();
+    }
+  }
+
+  PackHeader header{};
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.byte_order = kByteOrder;
+  header.node_count = static_cast<std::uint32_t>(nodes.size());
+  header.root_path_offset = root_path_offset;
+  header.root_path_size =
+      static_cast<std::uint32_t>(root_path.generic_string().size());
+  header.nodes_offset = sizeof(PackHeader);
+  header.strings_offset = header.nodes_offset + nodes.size() * sizeof(PackNode);
+  header.strings_size = strings.size();
+  header.blob_offset = (header.strings_offset + header.strings_size +
+                        kBlobAlignment - 1) /
+                       kBlobAlignment * kBlobAlignment;
+  header.blob_size = blob_size;
+
+  std::filesystem::path temporary = path;
+  temporary += ".tmp";
+  {
+    std::ofstream file(temporary, std::ios::binary);
+    if (!file) {
+      throw std::runtime_error("Failed to write pack: " + path);
+    }
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(nodes.data()),
+               static_cast<std::streamsize>(nodes.size() * sizeof(PackNode)));
+    file.write(strings.data(), static_cast<std::streamsize>(strings.size()));
+    std::string padding(header.blob_offset - header.strings_offset -
+                            header.strings_size,
+                        '\0');
+    file.write(padding.data(), static_cast<std::streamsize>(padding.size()));
+    for (const Blob &blob : blobs) {
+      if (blob.compressed == nullptr) {
+        file.write(blob.bytes.data(),
+                   static_cast<std::streamsize>(blob.bytes.size()));
+        continue;
+      }
+      blob.compressed->for_each_frame([&](const char *data, std::size_t size) {
+        file.write(data, static_cast<std::streamsize>(size));
+        return static_cast<bool>(file);
+      });
+    }
+    if (!file) {
+      throw std::runtime_error("Failed to write pack: " + path);
+    }
+  }
+  std::filesystem::rename(temporary, path);
+}
+
+Pack Pack::open(const std::string &path) {
+  auto mapping = std::make_shared<Mapping>(path);
+  mapping->validate();
+  return Pack(std::move(mapping));
+}
+
+Path Pack::get_root_path() const {
+  const PackHeader &header = mapping_->header();
+  return Path(std::filesystem::path(std::string(mapping_->string_at(
+      header.root_path_offset, header.root_path_size))));
+}
+
+std::size_t Pack::node_count() const { return mapping_->header().node_count; }
+
+Dir Pack::instantiate() const { return instantiate(get_root_path()); }
+
+Dir Pack::instantiate(const Path &root) const {
+  auto tree = Tree::create();
+  std::uint32_t count = mapping_->header().node_count;
+  std::vector<NodeId> ids(count);
+  std::vector<std::filesystem::path> dir_paths(count);
+
+  std::vector<std::uint32_t> links;
+
+  ids[0] = tree->create_dir(root).get_id();
+  dir_paths[0] = root.to_path();
+  for (std::uint32_t i = 1; i < count; ++i) {
+    PackNode record = mapping_->node(i);
+    std::filesystem::path path =
+        dir_paths[record.parent] /
+        mapping_->string_at(record.name_offset, record.name_size);
+    if (record.kind == kPackDir) {
+      ids[i] = tree->create_dir(Path(path)).get_id();
+      dir_paths[i] = std::move(path);
+    } else if (record.kind == kPackFile) {
+      ids[i] = tree->create_file(Path(path),
+                                 mapping_->blob_at(record.content_offset,
+                                                   record.content_size),
+                                 mapping_)
+                   .get_id();
+    } else if (record.kind == kPackFill) {
+      FillSpec fill;
+      if (!decode_fill(mapping_->string_at(record.content_offset,
+                                           record.content_size),
+                       fill)) {
+        throw std::runtime_error("Invalid fill in pack: " + path.string());
+      }
+      ids[i] = tree->create_file(Path(path), std::move(fill)).get_id();
+    } else {
+      // Created once their target exists
+      dir_paths[i] = std::move(path);
+      links.push_back(i);
+    }
+  }
+
+  for (std::uint32_t i : links) {
+    PackNode record = mapping_->node(i);
+    Path path(dir_paths[i]);
+    dir_paths[i].clear();
+    bool symlink = record.kind == kPackSymlink;
+    if (record.content_size == kLinkToNode) {
+      NodeId target = ids[record.content_offset];
+      ids[i] = symlink ? tree->create_symlink(path, target).get_id()
+                       : tree->create_hardlink(path, target).get_id();
+    } else {
+      std::string target(
+          mapping_->string_at(record.content_offset, record.content_size));
+      ids[i] = symlink
+                   ? tree->create_symlink(path, std::move(target)).get_id()
+                   : tree->create_hardlink(path, std::move(target)).get_id();
+    }
+  }
+
+  for (std::uint32_t i = 1; i < count; ++i) {
+    tree->attach(ids[mapping_->node(i).parent], ids[i]);
+  }
+  return Dir(tree, ids[0]);
+}
+
+} // namespace fs
@@ -0,0 +1,189 @@
+#include "plan.h"
+#include <algorithm>
+#include <sstream>
+#include <system_error>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/statvfs.h>
+#define CDIRNUTS_HAS_STATVFS 1
+#endif
+
+namespace fs {
+
+namespace {
+
+std::uint64_t round_up(std::uint64_t bytes, std::uint64_t block) {
+  return block == 0 ? bytes : (bytes + block - 1) / block * block;
+}
+
+// Bytes of a filled file that are actually allocated
+std::uint64_t data_bytes(const FillSpec &fill) {
+  if (fill.pattern.empty()) {
+    return 0;
+  }
+  std::uint64_t holes = 0;
+  for (const auto &hole : fill.holes) {
+    holes += hole.length;
+  }
+  return fill.size - holes;
+}
+
+std::filesystem::path nearest_existing(std::filesystem::path path) {
+  std::error_code ec;
+  path = std::filesystem::absolute(path, ec).lexically_normal();
+  while (!std::filesystem::exists(path, ec) && path.has_relative_path()) {
+    path = path.parent_path();
+  }
+  return path;
+}
+
+} // namespace
+
+WritePlan plan_tree(const Dir &root, const WriteOptions &options) {
+  WritePlan plan;
+  const Tree &tree = *root.get_tree();
+  std::filesystem::path root_path = root.get_path().to_path();
+  std::filesystem::path volume = nearest_existing(root_path);
+
+  std::uint64_t block = 4096;
+  std::uint64_t total_inodes = 0;
+#ifdef CDIRNUTS_HAS_STATVFS
+  struct statvfs st;
+  bool have_stats = ::statvfs(volume.c_str(), &st) == 0;
+  if (have_stats) {
+    block = st.f_frsize != 0 ? st.f_frsize : st.f_bsize;
+    plan.available_bytes = std::uint64_t{st.f_bavail} * block;
+    plan.available_inodes = st.f_favail;
+    total_inodes = st.f_files;
+  }
+#else
+  bool have_stats = false;
+#endif
+
+  std::uint64_t reclaimed = 0;
+  struct Pending {
+    NodeId id;
+    std::size_t depth;
+    // The parent exists on disk: this node may too
+    bool check_disk;
+  };
+  std::vector<Pending> pending{{root.get_id(), 0, true}};
+  while (!pending.empty()) {
+    auto [id, depth, check_disk] = pending.back();
+    pending.pop_back();
+    const Tree::Node &node = tree.node(id);
+    std::filesystem::path path = tree.path_of(id);
+
+    std::filesystem::file_status status;
+    std::error_code ec;
+    if (check_disk) {
+      status = std::filesystem::symlink_status(path, ec);
+    }
+    bool exists = check_disk && std::filesystem::exists(status);
+    bool is_dir = exists && std::filesystem::is_directory(status);
+
+    if (depth > plan.max_depth || plan.deepest_path.empty()) {
+      plan.max_depth = depth;
+      plan.deepest_path = path.string();
+    }
+
+    switch (node.kind) {
+    case Tree::Kind::Dir:
+      ++plan.dirs;
+      if (exists && !is_dir) {
+        plan.conflicts.push_back(path.string());
+      }
+      if (!exists) {
+        plan.required_bytes += block;
+        ++plan.required_inodes;
+      }
+      for (NodeId child = node.first_child; child != kNoNode;
+           child = tree.node(child).next_sibling) {
+        pending.push_back({child, depth + 1, is_dir});
+      }
+      break;
+    case Tree::Kind::File: {
+      ++plan.files;
+      File file(root.get_tree(), id);
+      std::uint64_t size = file.get_size();
+      std::uint64_t allocated = size;
+      if (file.is_streamed()) {
+        ++plan.unknown_size_files;
+      } else if (file.has_source()) {
+        size = allocated = std::filesystem::file_size(file.get_source(), ec);
+        if (ec) {
+          size = allocated = 0;
+        }
+      } else if (file.is_filled()) {
+        allocated = data_bytes(tree.fill_of(id));
+      }
+      plan.bytes += size;
+      plan.required_bytes += round_up(allocated, block);
+      if (is_dir) {
+        plan.conflicts.push_back(path.string());
+      } else if (exists) {
+        ++plan.existing_files;
+        if (std::filesystem::is_regular_file(status)) {
+          reclaimed += round_up(std::filesystem::file_size(path, ec), block);
+        }
+      } else {
+        ++plan.required_inodes;
+      }
+      break;
+    }
+    case Tree::Kind::Symlink:
+    case Tree::Kind::Hardlink:
+      ++plan.links;
+      if (is_dir) {
+        plan.conflicts.push_back(path.string());
+      } else if (!exists && node.kind == Tree::Kind::Symlink) {
+        ++plan.required_inodes;
+      }
+      break;
+    }
+  }
+
+  // Replaced files free their blocks, unless the old tree is kept until
+  // the new one is complete
+  if (!options.transactional) {
+    plan.required_bytes -= std::min(reclaimed, plan.required_bytes);
+  }
+  if (have_stats) {
+    // Filesystems allocating inodes dynamically report none at all
+    plan.fits = plan.required_bytes <= plan.available_bytes &&
+                (total_inodes == 0 ||
+                 plan.required_inodes <= plan.available_inodes);
+  }
+  return plan;
+}
+
+// ============================================================================
+// WritePlan Implementation
+// ============================================================================
+
+std::string WritePlan::summary() const {
+  const WritePlan &plan = *this;
+  std::ostringstream out;
+  out << "Directories: " << plan.dirs << '\n'
+      << "Files: " << plan.files << " (" << plan.bytes << " bytes";
+  if (plan.unknown_size_files != 0) {
+    out << ", " << plan.unknown_size_files << " of unknown size";
+  }
+  out << ")\n"
+      << "Links: " << plan.links << '\n'
+      << "Deepest path: " << plan.deepest_path << " (depth "
+      << plan.max_depth << ")\n"
+      << "Existing files replaced: " << plan.existing_files << '\n';
+  for (const auto &conflict : plan.conflicts) {
+    out << "Conflict: " << conflict << '\n';
+  }
+  out << "Required: " << plan.required_bytes << " bytes, "
+      << plan.required_inodes << " inodes\n"
+      << "Available: " << plan.available_bytes << " bytes, "
+      << plan.available_inodes << " inodes\n"
+      << (plan.fits ? "The output fits on the target filesystem\n"
+                    : "The output does NOT fit on the target filesystem\n");
+  return out.str();
+}
+
+} // namespace fs
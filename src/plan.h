@@ -0,0 +1,12 @@
+#pragma once
+
+#include "../include/fs.h"
+
+namespace fs {
+
+/// @brief Compute the plan of writing `root` with `options` (Dir::plan()).
+/// @param root
+/// @param options
+WritePlan plan_tree(const Dir &root, const WriteOptions &options);
+
+} // namespace fs
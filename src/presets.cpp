@@ -7,8 +7,9 @@ namespace Presets {
 // Preset Implementation
 // ============================================================================
 
-void Preset::use() const {
+void Preset::use(const fs::WriteOptions &options) const {
   Lua::LuaEngine lua;
+  lua.set_write_options(options);
   lua.execute_file(path_);
 }
 
@@ -0,0 +1,338 @@
+#include "../include/process_graph.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char **environ;
+#define CDIRNUTS_HAS_POSIX_SPAWN 1
+#endif
+
+namespace Process {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// The working directory is entered by the shell itself, which keeps the
+// spawn portable (posix_spawn_file_actions_addchdir_np is not everywhere)
+std::string shell_script(const Command &command) {
+  if (command.cwd.empty()) {
+    return command.command;
+  }
+  std::string quoted = "'";
+  for (char c : command.cwd) {
+    quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+  }
+  quoted += "'";
+  return "cd " + quoted + " || exit 1\n" + command.command;
+}
+
+#ifdef CDIRNUTS_HAS_POSIX_SPAWN
+// Close-on-exec from the start: commands spawned meanwhile by other threads
+// must not inherit the write end, or the read end would never see EOF
+bool open_pipe(int fds[2]) {
+#ifdef __linux__
+  return pipe2(fds, O_CLOEXEC) == 0;
+#else
+  if (pipe(fds) != 0) {
+    return false;
+  }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  return true;
+#endif
+}
+
+struct Running {
+  std::size_t index;
+  pid_t pid;
+  // stdout, stderr read ends; -1 once closed
+  int fds[2];
+  Clock::time_point start;
+};
+
+// Spawn /bin/sh -c <script>. On failure returns -1 with the reason in
+// `error`.
+pid_t spawn(const Command &command, int out[2], int err[2],
+            std::string &error) {
+  if (command.capture && !open_pipe(out)) {
+    error = "Failed to create pipes: " +
+            std::generic_category().message(errno);
+    return -1;
+  }
+  if (command.capture && !open_pipe(err)) {
+    error = "Failed to create pipes: " +
+            std::generic_category().message(errno);
+    close(out[0]);
+    close(out[1]);
+    return -1;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  // Uncaptured commands keep the terminal, and may prompt on it
+  if (command.capture) {
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null",
+                                     O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO);
+  }
+
+  std::string script = shell_script(command);
+  char shell[] = "sh";
+  char flag[] = "-c";
+  char *argv[] = {shell, flag, script.data(), nullptr};
+  pid_t pid = -1;
+  int spawned =
+      posix_spawn(&pid, "/bin/sh", &actions, nullptr, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+
+  if (command.capture) {
+    close(out[1]);
+    close(err[1]);
+    out[1] = err[1] = -1;
+  }
+  if (spawned != 0) {
+    error = "Failed to start: " + std::generic_category().message(spawned);
+    if (command.capture) {
+      close(out[0]);
+      close(err[0]);
+    }
+    return -1;
+  }
+  return pid;
+}
+#endif
+
+} // namespace
+
+const char *to_string(Result::Status status) {
+  switch (status) {
+  case Result::Status::Succeeded:
+    return "ok";
+  case Result::Status::Failed:
+    return "failed";
+  case Result::Status::Skipped:
+    return "skipped";
+  }
+  return "unknown";
+}
+
+// ============================================================================
+// ProcessGraph Implementation
+// ============================================================================
+
+void ProcessGraph::add(Command command) {
+  if (command.name.empty()) {
+    command.name = command.command;
+  }
+  for (const Command &existing : commands_) {
+    if (existing.name == command.name) {
+      throw std::invalid_argument("Duplicate command name: " + command.name);
+    }
+  }
+  commands_.push_back(std::move(command));
+}
+
+std::vector<std::vector<std::size_t>> ProcessGraph::dependencies() const {
+  std::unordered_map<std::string, std::size_t> index;
+  for (std::size_t i = 0; i < commands_.size(); ++i) {
+    index.emplace(commands_[i].name, i);
+  }
+
+  std::vector<std::vector<std::size_t>> result(commands_.size());
+  for (std::size_t i = 0; i < commands_.size(); ++i) {
+    for (const std::string &name : commands_[i].after) {
+      auto it = index.find(name);
+      if (it == index.end()) {
+        throw std::invalid_argument("Command " + commands_[i].name +
+                                    " depends on unknown command " + name);
+      }
+      result[i].push_back(it->second);
+    }
+  }
+
+  // Kahn's algorithm: whatever is never freed sits on a cycle
+  std::vector<std::size_t> waiting(commands_.size());
+  std::vector<std::vector<std::size_t>> dependents(commands_.size());
+  std::vector<std::size_t> ready;
+  for (std::size_t i = 0; i < commands_.size(); ++i) {
+    waiting[i] = result[i].size();
+    for (std::size_t dependency : result[i]) {
+      dependents[dependency].push_back(i);
+    }
+    if (waiting[i] == 0) {
+      ready.push_back(i);
+    }
+  }
+  std::size_t ordered = 0;
+  while (!ready.empty()) {
+    std::size_t i = ready.back();
+    ready.pop_back();
+    ++ordered;
+    for (std::size_t dependent : dependents[i]) {
+      if (--waiting[dependent] == 0) {
+        ready.push_back(dependent);
+      }
+    }
+  }
+  if (ordered != commands_.size()) {
+    auto cyclic = std::find_if(waiting.begin(), waiting.end(),
+                               [](std::size_t count) { return count > 0; });
+    throw std::invalid_argument(
+        "Command " + commands_[static_cast<std::size_t>(
+                                   cyclic - waiting.begin())]
+                         .name +
+        " is part of a dependency cycle");
+  }
+  return result;
+}
+
+std::vector<Result> ProcessGraph::run(unsigned max_parallel) const {
+  std::vector<std::vector<std::size_t>> depends_on = dependencies();
+  if (max_parallel == 0) {
+    max_parallel = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  std::vector<Result> results(commands_.size());
+  std::vector<std::size_t> waiting(commands_.size());
+  std::vector<std::vector<std::size_t>> dependents(commands_.size());
+  std::vector<std::size_t> ready;
+  for (std::size_t i = 0; i < commands_.size(); ++i) {
+    results[i].name = commands_[i].name;
+    results[i].command = commands_[i].command;
+    waiting[i] = depends_on[i].size();
+    for (std::size_t dependency : depends_on[i]) {
+      dependents[dependency].push_back(i);
+    }
+  }
+  // Started in the order they were added when several are ready
+  for (std::size_t i = commands_.size(); i-- > 0;) {
+    if (waiting[i] == 0) {
+      ready.push_back(i);
+    }
+  }
+
+  // Skipped commands are never started: their dependents are skipped too,
+  // which is the default status
+  auto finish = [&](std::size_t i) {
+    if (results[i].status != Result::Status::Succeeded) {
+      return;
+    }
+    for (std::size_t dependent : dependents[i]) {
+      if (--waiting[dependent] == 0) {
+        ready.insert(ready.begin(), dependent);
+      }
+    }
+  };
+
+#ifdef CDIRNUTS_HAS_POSIX_SPAWN
+  std::vector<Running> running;
+  while (!ready.empty() || !running.empty()) {
+    while (!ready.empty() && running.size() < max_parallel) {
+      std::size_t i = ready.back();
+      ready.pop_back();
+      Running process{i, -1, {-1, -1}, Clock::now()};
+      int out[2] = {-1, -1}, err[2] = {-1, -1};
+      process.pid = spawn(commands_[i], out, err, results[i].errors);
+      if (process.pid < 0) {
+        results[i].status = Result::Status::Failed;
+        finish(i);
+        continue;
+      }
+      process.fds[0] = out[0];
+      process.fds[1] = err[0];
+      running.push_back(process);
+    }
+    if (running.empty()) {
+      continue;
+    }
+
+    std::vector<pollfd> fds;
+    std::vector<std::pair<std::size_t, int>> owners;
+    bool any_without_pipes = false;
+    for (std::size_t r = 0; r < running.size(); ++r) {
+      bool has_pipe = false;
+      for (int stream = 0; stream < 2; ++stream) {
+        if (running[r].fds[stream] >= 0) {
+          fds.push_back({running[r].fds[stream], POLLIN, 0});
+          owners.emplace_back(r, stream);
+          has_pipe = true;
+        }
+      }
+      any_without_pipes = any_without_pipes || !has_pipe;
+    }
+    // Exits are only noticed by polling waitpid once the pipes are closed
+    if (poll(fds.data(), fds.size(), any_without_pipes ? 10 : -1) < 0 &&
+        errno != EINTR) {
+      throw std::runtime_error("poll failed: " +
+                               std::generic_category().message(errno));
+    }
+
+    char buffer[16 * 1024];
+    for (std::size_t f = 0; f < fds.size(); ++f) {
+      if (fds[f].revents == 0) {
+        continue;
+      }
+      auto [r, stream] = owners[f];
+      ssize_t count = read(fds[f].fd, buffer, sizeof(buffer));
+      if (count > 0) {
+        Result &result = results[running[r].index];
+        (stream == 0 ? result.output : result.errors)
+            .append(buffer, static_cast<std::size_t>(count));
+      } else if (count == 0 || errno != EINTR) {
+        close(fds[f].fd);
+        running[r].fds[stream] = -1;
+      }
+    }
+
+    for (std::size_t r = 0; r < running.size();) {
+      Running &process = running[r];
+      int status = 0;
+      if (process.fds[0] >= 0 || process.fds[1] >= 0 ||
+          waitpid(process.pid, &status, WNOHANG) != process.pid) {
+        ++r;
+        continue;
+      }
+      Result &result = results[process.index];
+      result.seconds =
+          std::chrono::duration<double>(Clock::now() - process.start).count();
+      result.exit_code = WIFEXITED(status)    ? WEXITSTATUS(status)
+                         : WIFSIGNALED(status) ? -WTERMSIG(status)
+                                               : -1;
+      result.status = result.exit_code == 0 ? Result::Status::Succeeded
+                                            : Result::Status::Failed;
+      std::size_t index = process.index;
+      running.erase(running.begin() + static_cast<std::ptrdiff_t>(r));
+      finish(index);
+    }
+  }
+#else
+  // No posix_spawn: one std::system at a time, output not captured
+  while (!ready.empty()) {
+    std::size_t i = ready.back();
+    ready.pop_back();
+    auto start = Clock::now();
+    results[i].exit_code = std::system(shell_script(commands_[i]).c_str());
+    results[i].seconds =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    results[i].status = results[i].exit_code == 0 ? Result::Status::Succeeded
+                                                  : Result::Status::Failed;
+    finish(i);
+  }
+#endif
+  return results;
+}
+
+} // namespace Process
@@ -0,0 +1,305 @@
+#include "../include/profiler.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <sol/sol.hpp>
+#include <sstream>
+
+namespace Lua {
+
+namespace {
+
+// Registry field holding the profiler of a state, shared by its coroutines
+constexpr const char *kRegistryKey = "cdirnuts.profiler";
+
+double seconds_between(std::chrono::steady_clock::time_point from,
+                       std::chrono::steady_clock::time_point to) {
+  return std::chrono::duration<double>(to - from).count();
+}
+
+} // namespace
+
+// ============================================================================
+// Profiler Implementation
+// ============================================================================
+
+Profiler::Profiler(lua_State *state) : state_(state) {
+  lua_getglobal(state, "cdirnuts");
+  if (lua_istable(state, -1)) {
+    lua_pushnil(state);
+    while (lua_next(state, -2) != 0) {
+      if (lua_type(state, -2) == LUA_TSTRING && lua_isfunction(state, -1)) {
+        bindings_[lua_topointer(state, -1)] =
+            std::string("cdirnuts.") + lua_tostring(state, -2);
+      }
+      lua_pop(state, 1);
+    }
+  }
+  lua_pop(state, 1);
+
+  lua_pushlightuserdata(state, this);
+  lua_setfield(state, LUA_REGISTRYINDEX, kRegistryKey);
+#ifdef LUAJIT_VERSION
+  luaJIT_setmode(state, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_OFF);
+#endif
+  last_ = Clock::now();
+  lua_sethook(state, &Profiler::hook, LUA_MASKCALL | LUA_MASKRET, 0);
+}
+
+Profiler::~Profiler() {
+  lua_sethook(state_, nullptr, 0, 0);
+  // Coroutines keep the hook, which finds no profiler from now on
+  lua_pushnil(state_);
+  lua_setfield(state_, LUA_REGISTRYINDEX, kRegistryKey);
+#ifdef LUAJIT_VERSION
+  luaJIT_setmode(state_, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_ON);
+#endif
+}
+
+void Profiler::hook(lua_State *state, lua_Debug *event) {
+  lua_getfield(state, LUA_REGISTRYINDEX, kRegistryKey);
+  auto *self = static_cast<Profiler *>(lua_touserdata(state, -1));
+  lua_pop(state, 1);
+  if (self) {
+    self->on_event(state, event);
+  }
+}
+
+void Profiler::on_event(lua_State *state, lua_Debug *event) {
+  Clock::time_point now = Clock::now();
+  auto current = stacks_.find(current_);
+  if (current != stacks_.end() && !current->second.empty()) {
+    double seconds = seconds_between(last_, now);
+    Frame &top = current->second.back();
+    top.inclusive_seconds += seconds;
+    functions_[top.function].stats.self_seconds += seconds;
+    nodes_[top.node].self_seconds += seconds;
+  }
+
+  switch (event->event) {
+  case LUA_HOOKCALL:
+    enter(state, event, false);
+    break;
+#ifdef LUA_HOOKTAILCALL
+  case LUA_HOOKTAILCALL:
+    enter(state, event, true);
+    break;
+#endif
+  case LUA_HOOKRET:
+    leave(state, event);
+    break;
+#ifdef LUA_HOOKTAILRET
+  // Lua 5.1: one event per caller replaced by a tail call
+  case LUA_HOOKTAILRET: {
+    std::vector<Frame> &stack = stacks_[state];
+    if (!stack.empty()) {
+      pop(functions_, stack);
+    }
+    break;
+  }
+#endif
+  default:
+    break;
+  }
+
+  current_ = state;
+  last_ = Clock::now();
+}
+
+std::uint32_t Profiler::function_id(lua_State *state, lua_Debug *event,
+                                    const void *identity) {
+  // A closure address is reused once the closure is collected: only C
+  // functions, which are not, are keyed by it
+  bool native = event->what != nullptr && std::strcmp(event->what, "C") == 0;
+  std::string prototype;
+  if (native) {
+    auto found = function_ids_.find(identity);
+    if (found != function_ids_.end()) {
+      return found->second;
+    }
+  } else {
+    prototype = std::string(event->short_src) + ":" +
+                std::to_string(event->linedefined);
+    auto found = prototype_ids_.find(prototype);
+    if (found != prototype_ids_.end()) {
+      return found->second;
+    }
+  }
+
+  std::string name;
+  auto binding = native ? bindings_.find(identity) : bindings_.end();
+  if (binding != bindings_.end()) {
+    name = binding->second;
+  } else {
+    lua_getinfo(state, "n", event);
+    std::string what = event->what ? event->what : "";
+    std::string called = event->name ? event->name : "";
+    if (what == "C") {
+      name = (called.empty() ? "?" : called) + " [C]";
+    } else if (what == "main") {
+      name = std::string("main chunk (") + event->short_src + ")";
+    } else {
+      name = (called.empty() ? "anonymous" : called) + " (" +
+             event->short_src + ":" + std::to_string(event->linedefined) + ")";
+    }
+  }
+  // ';' separates the frames of a collapsed stack
+  std::replace(name.begin(), name.end(), ';', ':');
+
+  auto id = static_cast<std::uint32_t>(functions_.size());
+  functions_.push_back({{std::move(name), 0, 0, 0}, 0});
+  if (native) {
+    function_ids_.emplace(identity, id);
+  } else {
+    prototype_ids_.emplace(std::move(prototype), id);
+  }
+  return id;
+}
+
+void Profiler::enter(lua_State *state, lua_Debug *event, bool tail) {
+  lua_getinfo(state, "Sf", event);
+  const void *identity = lua_topointer(state, -1);
+  lua_pop(state, 1);
+
+  std::vector<Frame> &stack = stacks_[state];
+  // Called from C with nothing below: a new script run or coroutine. Frames
+  // left by an error that escaped the previous run are dropped.
+  lua_Debug caller;
+  if (!tail && lua_getstack(state, 1, &caller) == 0) {
+    while (!stack.empty()) {
+      pop(functions_, stack);
+    }
+  }
+
+  std::uint32_t function = function_id(state, event, identity);
+  std::uint32_t parent = stack.empty() ? kNoNode : stack.back().node;
+  auto [child, inserted] = children_.try_emplace(
+      (static_cast<std::uint64_t>(parent) << 32) | function,
+      static_cast<std::uint32_t>(nodes_.size()));
+  if (inserted) {
+    nodes_.push_back({parent, function});
+  }
+
+  Function &entry = functions_[function];
+  ++entry.stats.calls;
+  ++entry.active;
+  stack.push_back({identity, function, child->second, 0, tail});
+}
+
+void Profiler::leave(lua_State *state, lua_Debug *event) {
+  lua_getinfo(state, "f", event);
+  const void *identity = lua_topointer(state, -1);
+  lua_pop(state, 1);
+
+  // Errors caught by pcall unwind frames without return events
+  std::vector<Frame> &stack = stacks_[state];
+  auto match =
+      std::find_if(stack.rbegin(), stack.rend(), [&](const Frame &frame) {
+        return frame.identity == identity;
+      });
+  if (match == stack.rend()) {
+    // Entered before profiling started
+    return;
+  }
+  bool tail = match->tail;
+  std::size_t index = stack.size() - 1 -
+                      static_cast<std::size_t>(match - stack.rbegin());
+  while (stack.size() > index) {
+    pop(functions_, stack);
+  }
+  // The callers it replaced return along with it
+  while (tail && !stack.empty()) {
+    tail = stack.back().tail;
+    pop(functions_, stack);
+  }
+}
+
+void Profiler::pop(std::vector<Function> &functions,
+                   std::vector<Frame> &stack) {
+  Frame frame = stack.back();
+  stack.pop_back();
+  Function &function = functions[frame.function];
+  if (--function.active == 0) {
+    function.stats.total_seconds += frame.inclusive_seconds;
+  }
+  if (!stack.empty()) {
+    stack.back().inclusive_seconds += frame.inclusive_seconds;
+  }
+}
+
+std::vector<Profiler::FunctionStats> Profiler::report() const {
+  // Frames left on a stack (by an error, or a yielded coroutine) count too
+  std::vector<Function> functions = functions_;
+  for (const auto &[state, live] : stacks_) {
+    std::vector<Frame> stack = live;
+    while (!stack.empty()) {
+      pop(functions, stack);
+    }
+  }
+
+  std::vector<FunctionStats> stats;
+  stats.reserve(functions.size());
+  for (Function &function : functions) {
+    stats.push_back(std::move(function.stats));
+  }
+  std::stable_sort(stats.begin(), stats.end(),
+                   [](const FunctionStats &a, const FunctionStats &b) {
+                     return a.self_seconds > b.self_seconds;
+                   });
+  return stats;
+}
+
+void Profiler::write_report(std::ostream &out, std::size_t limit) const {
+  std::vector<FunctionStats> stats = report();
+  double profiled = 0;
+  for (const FunctionStats &function : stats) {
+    profiled += function.self_seconds;
+  }
+
+  std::ostringstream table;
+  table << std::fixed << std::setprecision(3) << "Profiled " << profiled
+        << " s in " << stats.size() << " functions\n"
+        << "    self s  self %   total s     calls  function\n";
+  std::size_t rows = limit == 0 ? stats.size() : std::min(limit, stats.size());
+  for (std::size_t i = 0; i < rows; ++i) {
+    const FunctionStats &function = stats[i];
+    double share =
+        profiled > 0 ? 100 * function.self_seconds / profiled : 0;
+    table << std::setw(10) << function.self_seconds << std::setw(7)
+          << std::setprecision(1) << share << "%" << std::setw(10)
+          << std::setprecision(3) << function.total_seconds << std::setw(10)
+          << function.calls << "  " << function.name << '\n';
+  }
+  if (rows < stats.size()) {
+    table << "... " << stats.size() - rows << " more\n";
+  }
+  out << table.str();
+}
+
+void Profiler::write_collapsed(std::ostream &out) const {
+  std::vector<std::uint32_t> path;
+  for (const Node &node : nodes_) {
+    auto microseconds = std::llround(node.self_seconds * 1e6);
+    if (microseconds == 0) {
+      continue;
+    }
+    path.clear();
+    for (const Node *frame = &node;;
+         frame = &nodes_[frame->parent]) {
+      path.push_back(frame->function);
+      if (frame->parent == kNoNode) {
+        break;
+      }
+    }
+    for (auto function = path.rbegin(); function != path.rend(); ++function) {
+      if (function != path.rbegin()) {
+        out << ';';
+      }
+      out << functions_[*function].stats.name;
+    }
+    out << ' ' << microseconds << '\n';
+  }
+}
+
+} // namespace Lua
@@ -0,0 +1,248 @@
+#include "../include/template.h"
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace Templates {
+
+namespace {
+
+bool is_blank(char c) { return c == ' ' || c == '\t'; }
+
+std::string_view trim(std::string_view name) {
+  while (!name.empty() && is_blank(name.front())) {
+    name.remove_prefix(1);
+  }
+  while (!name.empty() && is_blank(name.back())) {
+    name.remove_suffix(1);
+  }
+  return name;
+}
+
+std::size_t line_of(std::string_view source, std::size_t position) {
+  return 1 + static_cast<std::size_t>(
+                 std::count(source.begin(),
+                            source.begin() + static_cast<std::ptrdiff_t>(
+                                                 position),
+                            '\n'));
+}
+
+[[noreturn]] void fail(std::string_view source, std::size_t position,
+                       const std::string &what) {
+  throw std::invalid_argument("Template error on line " +
+                              std::to_string(line_of(source, position)) +
+                              ": " + what);
+}
+
+} // namespace
+
+// ============================================================================
+// Template Implementation
+// ============================================================================
+
+Template Template::compile(std::string_view source) {
+  if (source.size() >= std::numeric_limits<std::uint32_t>::max()) {
+    throw std::invalid_argument("Template too large");
+  }
+
+  Template result;
+  auto add = [&](Op op, std::string_view text) {
+    result.code_.push_back({op, static_cast<std::uint32_t>(result.pool_.size()),
+                            static_cast<std::uint32_t>(text.size()), 0});
+    result.pool_.append(text);
+  };
+  auto add_text = [&](std::string_view text) {
+    if (!text.empty()) {
+      add(Op::Text, text);
+      result.literal_size_ += text.size();
+    }
+  };
+
+  // Open sections: instruction index, tag position
+  std::vector<std::pair<std::size_t, std::size_t>> sections;
+  std::size_t pos = 0;
+  for (;;) {
+    std::size_t open = source.find("{{", pos);
+    if (open == std::string_view::npos) {
+      add_text(source.substr(pos));
+      break;
+    }
+
+    bool triple = source.substr(open + 2).starts_with('{');
+    std::string_view closing = triple ? "}}}" : "}}";
+    std::size_t body = open + (triple ? 3 : 2);
+    std::size_t close = source.find(closing, body);
+    if (close == std::string_view::npos) {
+      fail(source, open, "unclosed tag");
+    }
+    std::size_t after = close + closing.size();
+
+    char sigil = triple ? '&' : source[body];
+    std::string_view name = source.substr(body, close - body);
+    if (!triple && (sigil == '#' || sigil == '^' || sigil == '/' ||
+                    sigil == '!' || sigil == '&')) {
+      name.remove_prefix(1);
+    }
+    name = trim(name);
+
+    // A section tag or comment alone on its line takes the line with it
+    std::size_t text_end = open;
+    if (sigil == '#' || sigil == '^' || sigil == '/' || sigil == '!') {
+      std::size_t line_start =
+          open == 0 ? 0 : source.rfind('\n', open - 1) + 1;
+      std::size_t line_end = after;
+      while (line_end < source.size() && is_blank(source[line_end])) {
+        ++line_end;
+      }
+      if (line_end < source.size() && source[line_end] == '\r') {
+        ++line_end;
+      }
+      bool ends_line =
+          line_end == source.size() || source[line_end] == '\n';
+      if (line_start >= pos && ends_line &&
+          std::all_of(source.begin() + static_cast<std::ptrdiff_t>(line_start),
+                      source.begin() + static_cast<std::ptrdiff_t>(open),
+                      is_blank)) {
+        text_end = line_start;
+        after = line_end == source.size() ? line_end : line_end + 1;
+      }
+    }
+    add_text(source.substr(pos, text_end - pos));
+    pos = after;
+
+    if (sigil == '!') {
+      continue;
+    }
+    if (name.empty()) {
+      fail(source, open, "empty tag");
+    }
+    switch (sigil) {
+    case '#':
+    case '^':
+      sections.emplace_back(result.code_.size(), open);
+      add(sigil == '#' ? Op::Section : Op::Inverted, name);
+      break;
+    case '/': {
+      if (sections.empty()) {
+        fail(source, open, "{{/" + std::string(name) + "}} closes nothing");
+      }
+      Instruction &section = result.code_[sections.back().first];
+      if (result.text(section) != name) {
+        fail(source, open,
+             "{{/" + std::string(name) + "}} closes {{" +
+                 (section.op == Op::Section ? "#" : "^") +
+                 std::string(result.text(section)) + "}}");
+      }
+      section.end = static_cast<std::uint32_t>(result.code_.size());
+      sections.pop_back();
+      break;
+    }
+    default:
+      add(Op::Variable, name);
+      break;
+    }
+  }
+
+  if (!sections.empty()) {
+    const Instruction &section = result.code_[sections.back().first];
+    fail(source, sections.back().second,
+         "{{" + std::string(section.op == Op::Section ? "#" : "^") +
+             std::string(result.text(section)) + "}} is never closed");
+  }
+  return result;
+}
+
+void Template::render(Context &context, std::string &out) const {
+  out.reserve(out.size() + literal_size_);
+  render(context, out, 0, code_.size());
+}
+
+std::string Template::render(Context &context) const {
+  std::string out;
+  render(context, out);
+  return out;
+}
+
+void Template::render(Context &context, std::string &out, std::size_t begin,
+                      std::size_t end) const {
+  std::size_t i = begin;
+  while (i < end) {
+    const Instruction &instruction = code_[i];
+    switch (instruction.op) {
+    case Op::Text:
+      out.append(text(instruction));
+      ++i;
+      break;
+
+    case Op::Variable:
+      if (context.push(text(instruction))) {
+        context.append(out);
+        context.pop();
+      }
+      ++i;
+      break;
+
+    case Op::Section:
+      if (context.push(text(instruction))) {
+        std::size_t size = context.list_size();
+        if (size == Context::kNotAList) {
+          if (context.truthy()) {
+            context.enter();
+            render(context, out, i + 1, instruction.end);
+            context.leave();
+          }
+        } else {
+          for (std::size_t item = 0; item < size; ++item) {
+            context.push_item(item);
+            context.enter();
+            render(context, out, i + 1, instruction.end);
+            context.leave();
+            context.pop();
+          }
+        }
+        context.pop();
+      }
+      i = instruction.end;
+      break;
+
+    case Op::Inverted: {
+      bool shown = true;
+      if (context.push(text(instruction))) {
+        std::size_t size = context.list_size();
+        shown = size == Context::kNotAList ? !context.truthy() : size == 0;
+        context.pop();
+      }
+      if (shown) {
+        render(context, out, i + 1, instruction.end);
+      }
+      i = instruction.end;
+      break;
+    }
+    }
+  }
+}
+
+// ============================================================================
+// TemplateCache Implementation
+// ============================================================================
+
+std::shared_ptr<const Template> TemplateCache::get(std::string_view source) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = templates_.find(source);
+  if (it != templates_.end()) {
+    return it->second;
+  }
+  auto compiled = std::make_shared<const Template>(Template::compile(source));
+  if (templates_.size() >= kMaxTemplates) {
+    templates_.clear();
+  }
+  templates_.emplace(std::string(source), compiled);
+  return compiled;
+}
+
+std::size_t TemplateCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return templates_.size();
+}
+
+} // namespace Templates
@@ -0,0 +1,170 @@
+#include "transaction.h"
+#include "durability.h"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#define CDIRNUTS_HAS_GETPID 1
+#endif
+
+namespace fs {
+
+namespace {
+
+// Tells apart the staging directories of concurrent processes
+unsigned long process_tag() {
+#ifdef CDIRNUTS_HAS_GETPID
+  return static_cast<unsigned long>(::getpid());
+#else
+  static const unsigned long tag = std::random_device{}();
+  return tag;
+#endif
+}
+
+std::filesystem::path staging_path_for(const std::filesystem::path &target) {
+  static std::atomic<unsigned> counter{0};
+  auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+  std::string name = "." + target.filename().string() + ".staging-" +
+                     std::to_string(process_tag()) + "-" +
+                     std::to_string(now) + "-" + std::to_string(counter++);
+  return target.parent_path() / name;
+}
+
+std::system_error rename_error(std::error_code ec,
+                               const std::filesystem::path &from,
+                               const std::filesystem::path &to) {
+  return std::system_error(ec, "Failed to move " + from.string() + " to " +
+                                   to.string());
+}
+
+// Moves `staging` to `target`. Returns where the previous target now lives
+// if there was one; it is up to the caller to remove it.
+std::optional<std::filesystem::path>
+swap_into_place(const std::filesystem::path &staging,
+                const std::filesystem::path &target) {
+#if defined(__linux__) && defined(RENAME_EXCHANGE)
+  if (::renameat2(AT_FDCWD, staging.c_str(), AT_FDCWD, target.c_str(),
+                  RENAME_NOREPLACE) == 0) {
+    return std::nullopt;
+  }
+  if (errno == EEXIST && ::renameat2(AT_FDCWD, staging.c_str(), AT_FDCWD,
+                                     target.c_str(), RENAME_EXCHANGE) == 0) {
+    return staging;
+  }
+  // Filesystems without renameat2 flags fall through to plain renames
+  if (errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+    throw rename_error(std::error_code(errno, std::generic_category()),
+                       staging, target);
+  }
+#endif
+
+  std::error_code ec;
+  if (!std::filesystem::exists(target, ec)) {
+    std::filesystem::rename(staging, target, ec);
+    if (ec) {
+      throw rename_error(ec, staging, target);
+    }
+    return std::nullopt;
+  }
+
+  // Not atomic: the destination is missing between the two renames
+  std::filesystem::path previous = staging;
+  previous += ".previous";
+  std::filesystem::rename(target, previous, ec);
+  if (ec) {
+    throw rename_error(ec, target, previous);
+  }
+  std::filesystem::rename(staging, target, ec);
+  if (ec) {
+    auto error = rename_error(ec, staging, target);
+    std::filesystem::rename(previous, target, ec);
+    throw error;
+  }
+  return previous;
+}
+
+} // namespace
+
+WriteReport write_tree_transactional(const Dir &root, WriteOptions options) {
+  if (options.incremental) {
+    throw std::invalid_argument(
+        "Transactional writes cannot be incremental: the staging directory "
+        "is always written from scratch");
+  }
+  options.transactional = false;
+
+  std::filesystem::path target = root.get_path().to_path().lexically_normal();
+  if (!target.has_filename() && target.has_parent_path()) {
+    target = target.parent_path();
+  }
+  if (target.empty() || target.filename() == "." || target.filename() == ".." ||
+      target == target.root_path()) {
+    throw std::invalid_argument("Cannot write " + target.string() +
+                                " transactionally: it has no parent");
+  }
+
+  // The staged copy shares file contents with the original tree
+  std::filesystem::path staging = staging_path_for(target);
+  auto staged_tree = Tree::create();
+  Dir staged(staged_tree,
+             staged_tree->import(*root.get_tree(), root.get_id(), staging));
+
+  if (!std::filesystem::create_directory(staging)) {
+    throw std::runtime_error("Staging directory already exists: " +
+                             staging.string());
+  }
+
+  WriteReport report;
+  std::optional<std::filesystem::path> previous;
+  try {
+    report = staged.write_to_disk(options);
+    if (report.errors != 0) {
+      throw std::runtime_error("Failed to write " + target.string() + ": " +
+                               std::to_string(report.errors) +
+                               " error(s), nothing was changed");
+    }
+    previous = swap_into_place(staging, target);
+  } catch (...) {
+    std::error_code ec;
+    std::filesystem::remove_all(staging, ec);
+    throw;
+  }
+
+  std::ostream &errors =
+      options.error_output ? *options.error_output : std::cerr;
+  if (options.durability != Durability::None) {
+    // The staged files are durable already, the swap is not yet
+    auto start = std::chrono::steady_clock::now();
+    try {
+      sync_directory(target.parent_path());
+    } catch (const std::exception &e) {
+      errors << e.what() << '\n';
+      ++report.errors;
+    }
+    report.sync_seconds += std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+  }
+
+  if (previous) {
+    std::error_code ec;
+    std::filesystem::remove_all(*previous, ec);
+    if (ec) {
+      errors << "Failed to remove previous tree: " << previous->string()
+             << " - " << ec.message() << '\n';
+    }
+  }
+  return report;
+}
+
+} // namespace fs
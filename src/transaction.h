@@ -0,0 +1,26 @@
+#pragma once
+
+#include "../include/fs.h"
+
+namespace fs {
+
+/// @brief Materialize `root` all-or-nothing (WriteOptions::transactional).
+///
+/// The tree is written into a hidden staging directory next to the
+/// destination, with every other option applied as usual. Once every node
+/// is on disk, the staging directory is swapped into place with
+/// renameat2(RENAME_EXCHANGE) (RENAME_NOREPLACE if the destination does
+/// not exist yet) and the previous tree is removed. Readers never observe a
+/// partially written tree.
+///
+/// On any failure only the staging directory is removed, then the error is
+/// thrown: the destination is left exactly as it was.
+/// @param root
+/// @param options
+/// @throws std::runtime_error if any node could not be written or if the
+/// swap failed.
+/// @throws std::invalid_argument if a node lives outside of the root, or
+/// combined with options.incremental.
+WriteReport write_tree_transactional(const Dir &root, WriteOptions options);
+
+} // namespace fs
@@ -0,0 +1,538 @@
+#include "../include/fs.h"
+#include "compression.h"
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace fs {
+
+namespace {
+
+// Normalized form used to decide whether a path lives directly under
+// another one ("./a/b/" and "a/b" are the same directory).
+std::filesystem::path normalized(const std::filesystem::path &path) {
+  std::filesystem::path result = path.lexically_normal();
+  if (!result.has_filename() && result.has_parent_path() &&
+      result != result.root_path()) {
+    result = result.parent_path();
+  }
+  return result;
+}
+
+} // namespace
+
+// ============================================================================
+// Tree Implementation
+// ============================================================================
+
+std::uint32_t Tree::intern(std::string_view name) {
+  auto it = name_ids_.find(name);
+  if (it != name_ids_.end()) {
+    return it->second;
+  }
+  auto id = static_cast<std::uint32_t>(names_.size());
+  // std::deque never moves its elements, so the key can view the stored name
+  const std::string &stored = names_.emplace_back(name);
+  name_ids_.emplace(stored, id);
+  return id;
+}
+
+const std::string &Tree::name_of(const Node &node) const {
+  return node.rooted ? rooted_paths_[node.name] : names_[node.name];
+}
+
+NodeId Tree::add_node(Kind kind, const std::filesystem::path &path) {
+  if (free_nodes_.empty() && nodes_.size() >= kNoNode) {
+    throw std::length_error("Virtual tree is full");
+  }
+  Node node{};
+  node.kind = kind;
+  node.rooted = true;
+  node.streamed = false;
+  node.sourced = false;
+  node.filled = false;
+  node.compressed = false;
+  node.released = false;
+  node.name = rooted_paths_.add(path.string());
+  node.parent = kNoNode;
+  node.first_child = kNoNode;
+  node.last_child = kNoNode;
+  node.next_sibling = kNoNode;
+  node.body = 0;
+  ++allocated_since_collect_;
+  if (!free_nodes_.empty()) {
+    NodeId id = free_nodes_.back();
+    free_nodes_.pop_back();
+    nodes_[id] = node;
+    return id;
+  }
+  nodes_.push_back(node);
+  views_.emplace_back(0);
+  return static_cast<NodeId>(nodes_.size() - 1);
+}
+
+void Tree::free_node(NodeId id) {
+  Node &node = nodes_[id];
+  if (node.kind == Kind::File) {
+    if (node.compressed) {
+      compressed_.release(node.body);
+    } else if (node.filled) {
+      fills_.release(node.body);
+    } else if (node.sourced) {
+      sources_.release(node.body);
+    } else if (node.streamed) {
+      producers_.release(node.body);
+    } else {
+      bodies_.release(node.body);
+    }
+  } else if (node.kind == Kind::Symlink || node.kind == Kind::Hardlink) {
+    links_.release(node.body);
+  }
+  if (node.rooted) {
+    rooted_paths_.release(node.name);
+  }
+  node.released = true;
+  node.parent = kNoNode;
+  node.first_child = kNoNode;
+  node.last_child = kNoNode;
+  node.next_sibling = kNoNode;
+  free_nodes_.push_back(id);
+}
+
+void Tree::collect() {
+  std::vector<bool> live(nodes_.size());
+  std::vector<NodeId> pending;
+  // A node keeps its whole detached sub-tree: its path depends on its
+  // ancestors, and a directory writes all of its children
+  auto keep = [&](NodeId id) {
+    while (nodes_[id].parent != kNoNode) {
+      id = nodes_[id].parent;
+    }
+    if (!live[id]) {
+      live[id] = true;
+      pending.push_back(id);
+    }
+  };
+  for (NodeId id = 0; id < nodes_.size(); ++id) {
+    if (!nodes_[id].released &&
+        views_[id].load(std::memory_order_relaxed) != 0) {
+      keep(id);
+    }
+  }
+  while (!pending.empty()) {
+    NodeId id = pending.back();
+    pending.pop_back();
+    const Node &node = nodes_[id];
+    if ((node.kind == Kind::Symlink || node.kind == Kind::Hardlink) &&
+        links_[node.body].target != kNoNode) {
+      keep(links_[node.body].target);
+    }
+    for (NodeId child = node.first_child; child != kNoNode;
+         child = nodes_[child].next_sibling) {
+      live[child] = true;
+      pending.push_back(child);
+    }
+  }
+
+  for (NodeId id = 0; id < nodes_.size(); ++id) {
+    if (!live[id] && !nodes_[id].released) {
+      free_node(id);
+    }
+  }
+  // Entries whose raw body is gone can never be looked up again
+  std::erase_if(compressed_bodies_, [](const auto &entry) {
+    return entry.second.owner.expired();
+  });
+  allocated_since_collect_ = 0;
+  left_by_collect_ = node_count();
+}
+
+void Tree::maybe_collect() {
+  if (allocated_since_collect_ >=
+      std::max(left_by_collect_, kMinCollectNodes)) {
+    collect();
+  }
+}
+
+Dir Tree::create_dir(const Path &path) {
+  NodeId id = add_node(Kind::Dir, path.to_path());
+  return Dir(shared_from_this(), id);
+}
+
+File Tree::create_file(const Path &path, Content content) {
+  std::string_view data = content ? std::string_view(*content) : "";
+  return create_file(path, data, std::move(content));
+}
+
+File Tree::create_file(const Path &path, std::string_view data,
+                       std::shared_ptr<const void> owner) {
+  NodeId id = add_node(Kind::File, path.to_path());
+  nodes_[id].body = bodies_.add(Body{data, std::move(owner)});
+  return File(shared_from_this(), id);
+}
+
+File Tree::create_file(const Path &path, ContentProducer producer) {
+  NodeId id = add_node(Kind::File, path.to_path());
+  nodes_[id].streamed = true;
+  nodes_[id].body = producers_.add(std::move(producer));
+  return File(shared_from_this(), id);
+}
+
+File Tree::create_copy(const Path &path, std::filesystem::path source) {
+  NodeId id = add_node(Kind::File, path.to_path());
+  nodes_[id].sourced = true;
+  nodes_[id].body = sources_.add(std::move(source));
+  return File(shared_from_this(), id);
+}
+
+File Tree::create_file(const Path &path, FillSpec fill) {
+  std::sort(fill.holes.begin(), fill.holes.end(),
+            [](const FillSpec::Hole &a, const FillSpec::Hole &b) {
+              return a.offset < b.offset;
+            });
+  std::vector<FillSpec::Hole> merged;
+  for (const auto &hole : fill.holes) {
+    if (hole.offset > fill.size || hole.length > fill.size - hole.offset) {
+      throw std::invalid_argument("Hole past the end of " +
+                                  path.to_string());
+    }
+    if (hole.length == 0) {
+      continue;
+    }
+    if (!merged.empty() &&
+        merged.back().offset + merged.back().length >= hole.offset) {
+      merged.back().length =
+          std::max(merged.back().offset + merged.back().length,
+                   hole.offset + hole.length) -
+          merged.back().offset;
+    } else {
+      merged.push_back(hole);
+    }
+  }
+  fill.holes = std::move(merged);
+
+  NodeId id = add_node(Kind::File, path.to_path());
+  nodes_[id].filled = true;
+  nodes_[id].body = fills_.add(std::move(fill));
+  return File(shared_from_this(), id);
+}
+
+Link Tree::add_link(Kind kind, const Path &path, LinkBody body) {
+  NodeId id = add_node(kind, path.to_path());
+  nodes_[id].body = links_.add(std::move(body));
+  return Link(shared_from_this(), id);
+}
+
+Link Tree::create_symlink(const Path &path, std::string target) {
+  return add_link(Kind::Symlink, path, LinkBody{kNoNode, std::move(target)});
+}
+
+Link Tree::create_symlink(const Path &path, NodeId target) {
+  return add_link(Kind::Symlink, path, LinkBody{target, {}});
+}
+
+Link Tree::create_hardlink(const Path &path, std::string target) {
+  return add_link(Kind::Hardlink, path, LinkBody{kNoNode, std::move(target)});
+}
+
+Link Tree::create_hardlink(const Path &path, NodeId target) {
+  // Both names are the same inode: link to the file itself
+  while (nodes_[target].kind == Kind::Hardlink &&
+         links_[nodes_[target].body].target != kNoNode) {
+    target = links_[nodes_[target].body].target;
+  }
+  if (nodes_[target].kind == Kind::Hardlink) {
+    return add_link(Kind::Hardlink, path, links_[nodes_[target].body]);
+  }
+  if (nodes_[target].kind != Kind::File) {
+    throw std::invalid_argument("Hard link target must be a file: " +
+                                path_of(target).string());
+  }
+  return add_link(Kind::Hardlink, path, LinkBody{target, {}});
+}
+
+std::filesystem::path Tree::path_of(NodeId id) const {
+  // Collect names up to the closest rooted ancestor, then join downwards
+  std::vector<NodeId> chain;
+  NodeId current = id;
+  while (!nodes_[current].rooted) {
+    chain.push_back(current);
+    current = nodes_[current].parent;
+  }
+  std::filesystem::path path(name_of(nodes_[current]));
+  for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+    path /= name_of(nodes_[*it]);
+  }
+  return path;
+}
+
+std::string_view Tree::content_of(NodeId id) const {
+  const Node &node = nodes_[id];
+  if (node.kind != Kind::File || node.streamed || node.sourced ||
+      node.filled || node.compressed) {
+    return {};
+  }
+  return bodies_[node.body].data;
+}
+
+const ContentProducer &Tree::producer_of(NodeId id) const {
+  static const ContentProducer none;
+  const Node &node = nodes_[id];
+  if (node.kind != Kind::File || !node.streamed) {
+    return none;
+  }
+  return producers_[node.body];
+}
+
+const std::filesystem::path &Tree::source_of(NodeId id) const {
+  static const std::filesystem::path none;
+  const Node &node = nodes_[id];
+  if (node.kind != Kind::File || !node.sourced) {
+    return none;
+  }
+  return sources_[node.body];
+}
+
+const FillSpec &Tree::fill_of(NodeId id) const {
+  static const FillSpec none;
+  const Node &node = nodes_[id];
+  if (node.kind != Kind::File || !node.filled) {
+    return none;
+  }
+  return fills_[node.body];
+}
+
+const std::shared_ptr<const CompressedContent> &
+Tree::compressed_of(NodeId id) const {
+  static const std::shared_ptr<const CompressedContent> none;
+  const Node &node = nodes_[id];
+  if (node.kind != Kind::File || !node.compressed) {
+    return none;
+  }
+  return compressed_[node.body];
+}
+
+void Tree::compress_body(NodeId id) {
+  Node &node = nodes_[id];
+  Body &body = bodies_[node.body];
+
+  auto it = compressed_bodies_.find(body.data.data());
+  if (it != compressed_bodies_.end() &&
+      (it->second.size != body.data.size() ||
+       it->second.owner.owner_before(body.owner) ||
+       body.owner.owner_before(it->second.owner))) {
+    compressed_bodies_.erase(it);
+    it = compressed_bodies_.end();
+  }
+  std::shared_ptr<const CompressedContent> compressed;
+  if (it != compressed_bodies_.end()) {
+    if (!it->second.compresses) {
+      return;
+    }
+    compressed = it->second.compressed.lock();
+  }
+  if (!compressed) {
+    compressed = CompressedContent::compress(body.data);
+    compressed_bodies_.insert_or_assign(
+        body.data.data(), CompressedBody{body.owner, body.data.size(),
+                                         compressed, compressed != nullptr});
+    if (!compressed) {
+      return;
+    }
+  }
+
+  // Dropping the owner releases the raw bytes once no other file uses them
+  bodies_.release(node.body);
+  node.compressed = true;
+  node.body = compressed_.add(std::move(compressed));
+}
+
+NodeId Tree::link_target_of(NodeId id) const {
+  const Node &node = nodes_[id];
+  if (node.kind != Kind::Symlink && node.kind != Kind::Hardlink) {
+    return kNoNode;
+  }
+  return links_[node.body].target;
+}
+
+std::filesystem::path Tree::link_path_of(NodeId id) const {
+  const Node &node = nodes_[id];
+  if (node.kind != Kind::Symlink && node.kind != Kind::Hardlink) {
+    return {};
+  }
+  const LinkBody &link = links_[node.body];
+  if (link.target == kNoNode) {
+    return link.path;
+  }
+  std::filesystem::path target = normalized(path_of(link.target));
+  if (node.kind == Kind::Hardlink) {
+    return target;
+  }
+  // Relative to the directory of the symlink, absolute as a last resort
+  std::filesystem::path relative =
+      target.lexically_relative(normalized(path_of(id)).parent_path());
+  return relative.empty() ? std::filesystem::absolute(target) : relative;
+}
+
+void Tree::unlink(NodeId child) {
+  Node &node = nodes_[child];
+  Node &parent = nodes_[node.parent];
+
+  NodeId previous = kNoNode;
+  for (NodeId it = parent.first_child; it != child;
+       it = nodes_[it].next_sibling) {
+    previous = it;
+  }
+  if (previous == kNoNode) {
+    parent.first_child = node.next_sibling;
+  } else {
+    nodes_[previous].next_sibling = node.next_sibling;
+  }
+  if (parent.last_child == child) {
+    parent.last_child = previous;
+  }
+
+  // Keep the full path so that the node stays where it was on disk
+  if (!node.rooted) {
+    std::string path = path_of(child).string();
+    node.name = rooted_paths_.add(std::move(path));
+    node.rooted = true;
+  }
+  node.parent = kNoNode;
+  node.next_sibling = kNoNode;
+}
+
+void Tree::attach(NodeId parent, NodeId child) {
+  if (nodes_[parent].kind != Kind::Dir) {
+    throw std::invalid_argument("Cannot add children to a file");
+  }
+  for (NodeId it = parent; it != kNoNode; it = nodes_[it].parent) {
+    if (it == child) {
+      throw std::invalid_argument(
+          "Cannot add a directory to itself or to one of its descendants");
+    }
+  }
+  if (nodes_[child].parent != kNoNode) {
+    unlink(child);
+  }
+
+  // Nodes that live directly under their parent only keep their last
+  // component; anything else keeps its full path.
+  Node &node = nodes_[child];
+  std::filesystem::path child_path = normalized(rooted_paths_[node.name]);
+  if (child_path.has_filename() &&
+      child_path.parent_path() == normalized(path_of(parent))) {
+    std::uint32_t slot = node.name;
+    node.name = intern(child_path.filename().string());
+    node.rooted = false;
+    rooted_paths_.release(slot);
+  }
+
+  node.parent = parent;
+  node.next_sibling = kNoNode;
+  Node &parent_node = nodes_[parent];
+  if (parent_node.last_child == kNoNode) {
+    parent_node.first_child = child;
+  } else {
+    nodes_[parent_node.last_child].next_sibling = child;
+  }
+  parent_node.last_child = child;
+
+  if (compression_threshold_ != 0 && node.kind == Kind::File &&
+      !node.streamed && !node.sourced && !node.filled && !node.compressed &&
+      bodies_[node.body].data.size() >= compression_threshold_) {
+    compress_body(child);
+  }
+}
+
+NodeId Tree::import(const Tree &other, NodeId id) {
+  return import(other, id, other.path_of(id));
+}
+
+NodeId Tree::import(const Tree &other, NodeId id,
+                    const std::filesystem::path &path) {
+  std::unordered_map<NodeId, NodeId> copies;
+  std::vector<std::pair<NodeId, NodeId>> copied_links;
+  auto copy_node = [&](NodeId source, const std::filesystem::path &path) {
+    const Node &node = other.nodes_[source];
+    NodeId copy = add_node(node.kind, path);
+    if (node.kind == Kind::File) {
+      nodes_[copy].streamed = node.streamed;
+      nodes_[copy].sourced = node.sourced;
+      nodes_[copy].filled = node.filled;
+      nodes_[copy].compressed = node.compressed;
+      if (node.compressed) {
+        nodes_[copy].body = compressed_.add(other.compressed_[node.body]);
+      } else if (node.filled) {
+        nodes_[copy].body = fills_.add(other.fills_[node.body]);
+      } else if (node.sourced) {
+        nodes_[copy].body = sources_.add(other.sources_[node.body]);
+      } else if (node.streamed) {
+        nodes_[copy].body = producers_.add(other.producers_[node.body]);
+      } else {
+        nodes_[copy].body = bodies_.add(other.bodies_[node.body]);
+      }
+    } else if (node.kind == Kind::Symlink || node.kind == Kind::Hardlink) {
+      nodes_[copy].body = links_.add(other.links_[node.body]);
+      copied_links.emplace_back(source, copy);
+    }
+    copies.emplace(source, copy);
+    return copy;
+  };
+
+  // Nodes keeping a full path are moved along with the root
+  std::filesystem::path source_root = normalized(other.path_of(id));
+  bool relocated = normalized(path) != source_root;
+  auto path_in_copy = [&](NodeId source, NodeId parent_copy) {
+    const Node &node = other.nodes_[source];
+    if (!node.rooted) {
+      return path_of(parent_copy) / other.names_[node.name];
+    }
+    std::filesystem::path source_path = other.rooted_paths_[node.name];
+    if (!relocated) {
+      return source_path;
+    }
+    std::filesystem::path relative =
+        normalized(source_path).lexically_relative(source_root);
+    if (relative.empty() || *relative.begin() == "..") {
+      throw std::invalid_argument("Cannot move " + source_path.string() +
+                                  ": it is outside of " +
+                                  source_root.string());
+    }
+    return path / relative;
+  };
+
+  NodeId root = copy_node(id, path);
+
+  // Depth-first copy; children are attached in their original order
+  std::vector<std::pair<NodeId, NodeId>> stack{{id, root}};
+  while (!stack.empty()) {
+    auto [source, copy] = stack.back();
+    stack.pop_back();
+    for (NodeId child = other.nodes_[source].first_child; child != kNoNode;
+         child = other.nodes_[child].next_sibling) {
+      NodeId child_copy = copy_node(child, path_in_copy(child, copy));
+      attach(copy, child_copy);
+      stack.emplace_back(child, child_copy);
+    }
+  }
+
+  // Links into the copied sub-tree follow it, the others keep their target
+  // by path as it was resolved in `other`
+  for (auto [source, copy] : copied_links) {
+    LinkBody &link = links_[nodes_[copy].body];
+    if (link.target == kNoNode) {
+      continue;
+    }
+    auto it = copies.find(link.target);
+    if (it != copies.end()) {
+      link.target = it->second;
+    } else {
+      link.path = other.link_path_of(source).string();
+      link.target = kNoNode;
+    }
+  }
+  return root;
+}
+
+} // namespace fs
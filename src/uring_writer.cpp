@@ -0,0 +1,439 @@
+#include "uring_writer.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+
+#include "file_copy.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace fs {
+
+namespace {
+
+constexpr unsigned kRingEntries = 1024;
+// Fixed file slots, i.e. files that can be in flight in one batch.
+constexpr unsigned kFileSlots = 256;
+// A single write SQE carries at most this many bytes; bigger files go
+// through the stream writer.
+constexpr std::size_t kMaxInlineWrite = 1u << 30;
+
+enum Stage : std::uint64_t { kMkdir = 0, kOpen = 1, kWrite = 2, kClose = 3 };
+
+int sys_setup(unsigned entries, io_uring_params *params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+              unsigned flags) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                  min_complete, flags, nullptr, 0));
+}
+
+int sys_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+/// Minimal io_uring wrapper: one submission ring, one completion ring and a
+/// table of sparse fixed-file slots used as direct descriptors.
+class Ring {
+private:
+  int fd_ = -1;
+  io_uring_params params_{};
+  void *sq_ring_ = MAP_FAILED;
+  void *cq_ring_ = MAP_FAILED;
+  std::size_t sq_ring_size_ = 0;
+  std::size_t cq_ring_size_ = 0;
+  io_uring_sqe *sqes_ = static_cast<io_uring_sqe *>(MAP_FAILED);
+
+  unsigned *sq_tail_ = nullptr;
+  unsigned *sq_mask_ = nullptr;
+  unsigned *sq_array_ = nullptr;
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned *cq_mask_ = nullptr;
+  io_uring_cqe *cqes_ = nullptr;
+
+  unsigned queued_ = 0;
+
+  template <typename T> T *at(void *base, unsigned offset) {
+    return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+  }
+
+  bool supports_required_ops() {
+    std::vector<unsigned char> buffer(sizeof(io_uring_probe) +
+                                      256 * sizeof(io_uring_probe_op));
+    auto *probe = reinterpret_cast<io_uring_probe *>(buffer.data());
+    if (sys_register(fd_, IORING_REGISTER_PROBE, probe, 256) < 0) {
+      return false;
+    }
+    // MKDIRAT arrived together with direct descriptors for openat/close
+    // (Linux 5.15), so checking it also covers the file_index usage below.
+    for (unsigned op : {IORING_OP_MKDIRAT, IORING_OP_OPENAT, IORING_OP_WRITE,
+                        IORING_OP_CLOSE}) {
+      if (op > probe->last_op ||
+          !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+public:
+  Ring() = default;
+  Ring(const Ring &) = delete;
+  Ring &operator=(const Ring &) = delete;
+
+  ~Ring() {
+    if (sqes_ != MAP_FAILED) {
+      munmap(sqes_, params_.sq_entries * sizeof(io_uring_sqe));
+    }
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+      munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_ != MAP_FAILED) {
+      munmap(sq_ring_, sq_ring_size_);
+    }
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  bool open() {
+    fd_ = sys_setup(kRingEntries, &params_);
+    if (fd_ < 0) {
+      return false;
+    }
+
+    sq_ring_size_ = params_.sq_off.array + params_.sq_entries * sizeof(unsigned);
+    cq_ring_size_ =
+        params_.cq_off.cqes + params_.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params_.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+      return false;
+    }
+    cq_ring_ = single_mmap
+                   ? sq_ring_
+                   : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      return false;
+    }
+    sqes_ = static_cast<io_uring_sqe *>(
+        mmap(nullptr, params_.sq_entries * sizeof(io_uring_sqe),
+             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+             IORING_OFF_SQES));
+    if (sqes_ == MAP_FAILED) {
+      return false;
+    }
+
+    sq_tail_ = at<unsigned>(sq_ring_, params_.sq_off.tail);
+    sq_mask_ = at<unsigned>(sq_ring_, params_.sq_off.ring_mask);
+    sq_array_ = at<unsigned>(sq_ring_, params_.sq_off.array);
+    cq_head_ = at<unsigned>(cq_ring_, params_.cq_off.head);
+    cq_tail_ = at<unsigned>(cq_ring_, params_.cq_off.tail);
+    cq_mask_ = at<unsigned>(cq_ring_, params_.cq_off.ring_mask);
+    cqes_ = at<io_uring_cqe>(cq_ring_, params_.cq_off.cqes);
+
+    if (!supports_required_ops()) {
+      return false;
+    }
+
+    std::vector<int> slots(kFileSlots, -1);
+    return sys_register(fd_, IORING_REGISTER_FILES, slots.data(),
+                        kFileSlots) == 0;
+  }
+
+  unsigned capacity() const { return params_.sq_entries; }
+  unsigned queued() const { return queued_; }
+
+  io_uring_sqe *next_sqe() {
+    unsigned tail = *sq_tail_ + queued_;
+    unsigned index = tail & *sq_mask_;
+    sq_array_[index] = index;
+    ++queued_;
+    io_uring_sqe *sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+  }
+
+  /// Submit every queued SQE and hand each completion to on_complete.
+  template <typename Callback> bool submit_and_wait(Callback on_complete) {
+    unsigned count = queued_;
+    std::atomic_ref<unsigned>(*sq_tail_).store(*sq_tail_ + count,
+                                               std::memory_order_release);
+    queued_ = 0;
+
+    unsigned submitted = 0;
+    unsigned completed = 0;
+    while (completed < count) {
+      unsigned to_submit = count - submitted;
+      int ret = sys_enter(fd_, to_submit, 1, IORING_ENTER_GETEVENTS);
+      if (ret < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+          continue;
+        }
+        return false;
+      }
+      submitted += static_cast<unsigned>(ret);
+
+      unsigned head = *cq_head_;
+      unsigned tail =
+          std::atomic_ref<unsigned>(*cq_tail_).load(std::memory_order_acquire);
+      for (; head != tail; ++head, ++completed) {
+        const io_uring_cqe &cqe = cqes_[head & *cq_mask_];
+        on_complete(cqe.user_data, cqe.res);
+      }
+      std::atomic_ref<unsigned>(*cq_head_).store(head,
+                                                 std::memory_order_release);
+    }
+    return true;
+  }
+
+  void release_slot(unsigned slot) {
+    int fd = -1;
+    io_uring_files_update update{};
+    update.offset = slot;
+    update.fds = reinterpret_cast<std::uint64_t>(&fd);
+    sys_register(fd_, IORING_REGISTER_FILES_UPDATE, &update, 1);
+  }
+};
+
+struct PendingFile {
+  File file;
+  std::string path;
+  unsigned slot;
+  int open_res = 0;
+  int write_res = 0;
+  int close_res = 0;
+};
+
+struct PendingDir {
+  Dir dir;
+  std::string path;
+  int res = 0;
+};
+
+/// One submission round: files of directories that exist on disk plus the
+/// mkdirs of their sub-directories.
+class Batch {
+private:
+  Ring &ring_;
+  WriteSession &session_;
+  std::vector<PendingFile> files_;
+  std::vector<PendingDir> dirs_;
+
+  static std::uint64_t tag(std::size_t index, Stage stage) {
+    return (static_cast<std::uint64_t>(index) << 2) | stage;
+  }
+
+public:
+  Batch(Ring &ring, WriteSession &session) : ring_(ring), session_(session) {
+    files_.reserve(kFileSlots);
+    dirs_.reserve(ring.capacity());
+  }
+
+  bool has_room_for_file() const {
+    return files_.size() < kFileSlots &&
+           ring_.queued() + 3 <= ring_.capacity();
+  }
+  bool has_room_for_dir() const { return ring_.queued() < ring_.capacity(); }
+  bool empty() const { return ring_.queued() == 0; }
+
+  void add_file(const File &file) {
+    std::string_view content = file.get_content();
+    std::size_t index = files_.size();
+    unsigned slot = static_cast<unsigned>(index);
+    std::string file_path = file.get_path().to_string();
+    // O_TRUNC would rewrite every other name of a hard-linked file
+    unshare_file(AT_FDCWD, file_path.c_str());
+    files_.push_back({file, std::move(file_path), slot});
+    const char *path = files_.back().path.c_str();
+
+    io_uring_sqe *open = ring_.next_sqe();
+    open->opcode = IORING_OP_OPENAT;
+    open->fd = AT_FDCWD;
+    open->addr = reinterpret_cast<std::uint64_t>(path);
+    open->len = 0666;
+    open->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    open->file_index = slot + 1;
+    open->flags = IOSQE_IO_LINK;
+    open->user_data = tag(index, kOpen);
+
+    if (!content.empty()) {
+      io_uring_sqe *write = ring_.next_sqe();
+      write->opcode = IORING_OP_WRITE;
+      write->fd = static_cast<int>(slot);
+      write->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+      write->addr = reinterpret_cast<std::uint64_t>(content.data());
+      write->len = static_cast<unsigned>(content.size());
+      write->off = 0;
+      write->user_data = tag(index, kWrite);
+    } else {
+      files_.back().write_res = 0;
+    }
+
+    io_uring_sqe *close = ring_.next_sqe();
+    close->opcode = IORING_OP_CLOSE;
+    close->file_index = slot + 1;
+    close->user_data = tag(index, kClose);
+  }
+
+  void add_dir(const Dir &dir) {
+    std::size_t index = dirs_.size();
+    dirs_.push_back({dir, dir.get_path().to_string()});
+
+    io_uring_sqe *mkdir = ring_.next_sqe();
+    mkdir->opcode = IORING_OP_MKDIRAT;
+    mkdir->fd = AT_FDCWD;
+    mkdir->addr = reinterpret_cast<std::uint64_t>(dirs_.back().path.c_str());
+    mkdir->len = 0777;
+    mkdir->user_data = tag(index, kMkdir);
+  }
+
+  /// Run the batch. Directories that now exist are appended to `created`.
+  bool run(std::vector<Dir> &created) {
+    bool ok = ring_.submit_and_wait([this](std::uint64_t data, int res) {
+      std::size_t index = data >> 2;
+      switch (static_cast<Stage>(data & 3)) {
+      case kMkdir:
+        dirs_[index].res = res;
+        break;
+      case kOpen:
+        files_[index].open_res = res;
+        break;
+      case kWrite:
+        files_[index].write_res = res;
+        break;
+      case kClose:
+        files_[index].close_res = res;
+        break;
+      }
+    });
+    if (!ok) {
+      return false;
+    }
+
+    for (auto &pending : files_) {
+      std::size_t size = pending.file.get_content().size();
+      bool written = pending.open_res >= 0 && pending.close_res >= 0 &&
+                     static_cast<std::size_t>(pending.write_res) == size;
+      if (written) {
+        // Direct descriptors are gone with the close
+        session_.sync_by_path(pending.file);
+        session_.written(pending.file);
+        continue;
+      }
+      if (pending.open_res >= 0 && pending.close_res < 0) {
+        ring_.release_slot(pending.slot);
+      }
+      // Replay through the stream writer: it either succeeds (short write,
+      // transient error) or throws the usual error message.
+      try {
+        session_.write_claimed(pending.file);
+        session_.written(pending.file);
+      } catch (const std::exception &e) {
+        session_.report_file(pending.file, e);
+      }
+    }
+
+    for (auto &pending : dirs_) {
+      if (pending.res < 0 && pending.res != -EEXIST) {
+        try {
+          pending.dir.create_on_disk();
+        } catch (const std::exception &e) {
+          session_.report(e);
+          continue;
+        }
+      }
+      created.push_back(std::move(pending.dir));
+    }
+
+    files_.clear();
+    dirs_.clear();
+    return true;
+  }
+};
+
+} // namespace
+
+bool write_tree_uring(WriteSession &session, const Dir &root) {
+  Ring ring;
+  if (!ring.open()) {
+    return false;
+  }
+
+  root.create_on_disk();
+
+  // Breadth-first: every directory in `ready` exists on disk, so its files
+  // and the mkdirs of its children can all be submitted at once.
+  std::vector<Dir> ready{root};
+  std::vector<Dir> next;
+  Batch batch(ring, session);
+
+  auto flush = [&]() {
+    if (!batch.empty() && !batch.run(next)) {
+      throw std::runtime_error("io_uring submission failed: " +
+                               std::string(std::strerror(errno)));
+    }
+  };
+
+  while (!ready.empty()) {
+    for (const Dir &dir : ready) {
+      for (const auto &file : dir.get_files()) {
+        if (file.is_streamed() || file.has_source() || file.is_filled() ||
+            file.is_compressed() ||
+            file.get_content().size() > kMaxInlineWrite) {
+          session.write_file(file);
+          continue;
+        }
+        if (!session.claim(file)) {
+          continue;
+        }
+        if (!batch.has_room_for_file()) {
+          flush();
+        }
+        batch.add_file(file);
+      }
+      for (const auto &sub_dir : dir.get_subdirs()) {
+        if (!batch.has_room_for_dir()) {
+          flush();
+        }
+        batch.add_dir(sub_dir);
+      }
+    }
+    flush();
+    ready.swap(next);
+    next.clear();
+  }
+  return true;
+}
+
+} // namespace fs
+
+#else
+
+namespace fs {
+
+bool write_tree_uring(WriteSession &, const Dir &) { return false; }
+
+} // namespace fs
+
+#endif
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "../include/fs.h"
+#include "write_session.h"
+
+namespace fs {
+
+/// @brief Materialize a tree through io_uring: mkdirat for a whole level of
+/// directories and linked openat -> write -> close chains for the files are
+/// submitted together in large batches, so the kernel is entered once per
+/// batch instead of several times per file.
+///
+/// Failed operations are replayed through the regular stream writer so that
+/// error messages match the sequential path exactly. The root itself throws
+/// on failure, everything below it is reported through the session.
+/// @param session
+/// @param root
+/// @return false if io_uring is unavailable (non-Linux build, old kernel,
+/// blocked by seccomp...). Nothing has been written in that case and the
+/// caller should fall back to the stream writer.
+bool write_tree_uring(WriteSession &session, const Dir &root);
+
+} // namespace fs
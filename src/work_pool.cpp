@@ -0,0 +1,117 @@
+#include "work_pool.h"
+
+namespace fs {
+
+namespace {
+// Identifies the pool (and deque) owned by the current thread, if any.
+thread_local const WorkPool *current_pool = nullptr;
+thread_local std::size_t current_index = 0;
+} // namespace
+
+// ============================================================================
+// WorkPool Implementation
+// ============================================================================
+
+WorkPool::WorkPool(unsigned workers) {
+  if (workers == 0) {
+    workers = 1;
+  }
+  for (unsigned i = 0; i < workers; ++i) {
+    queues_.push_back(std::make_unique<Queue>());
+  }
+  for (std::size_t i = 0; i < workers; ++i) {
+    threads_.emplace_back([this, i]() { run(i); });
+  }
+}
+
+WorkPool::~WorkPool() {
+  {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    stopping_ = true;
+  }
+  work_available_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+}
+
+void WorkPool::submit(Task task) {
+  std::size_t index = current_pool == this
+                          ? current_index
+                          : next_queue_.fetch_add(1) % queues_.size();
+  {
+    std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+    queues_[index]->tasks.push_back(std::move(task));
+  }
+  {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    ++queued_;
+    ++pending_;
+  }
+  work_available_.notify_one();
+}
+
+void WorkPool::wait() {
+  std::unique_lock<std::mutex> lock(state_mutex_);
+  all_done_.wait(lock, [this]() { return pending_ == 0; });
+}
+
+WorkPool::Task WorkPool::take(std::size_t index) {
+  // The caller has reserved one queued task, so this loop always ends: the
+  // task is either in our own deque or can be stolen from another one.
+  for (;;) {
+    {
+      auto &own = *queues_[index];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.tasks.empty()) {
+        Task task = std::move(own.tasks.back());
+        own.tasks.pop_back();
+        return task;
+      }
+    }
+    for (std::size_t offset = 1; offset < queues_.size(); ++offset) {
+      auto &victim = *queues_[(index + offset) % queues_.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        Task task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        return task;
+      }
+    }
+    std::this_thread::yield();
+  }
+}
+
+void WorkPool::run(std::size_t index) {
+  current_pool = this;
+  current_index = index;
+
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(state_mutex_);
+      work_available_.wait(lock, [this]() { return stopping_ || queued_ > 0; });
+      if (queued_ == 0) {
+        return;
+      }
+      --queued_;
+    }
+
+    Task task = take(index);
+    try {
+      task();
+    } catch (...) {
+      // Tasks report their own errors; never let one take the worker down.
+    }
+
+    bool done;
+    {
+      std::lock_guard<std::mutex> lock(state_mutex_);
+      done = --pending_ == 0;
+    }
+    if (done) {
+      all_done_.notify_all();
+    }
+  }
+}
+
+} // namespace fs
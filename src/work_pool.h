@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fs {
+
+/// @brief Fixed-size thread pool with one task deque per worker.
+///
+/// A worker pushes the tasks it spawns onto the back of its own deque and
+/// pops from the back (depth-first, cache friendly); idle workers steal from
+/// the front of the other deques (breadth-first, large chunks of work).
+/// Tasks are expected to handle their own errors.
+class WorkPool {
+public:
+  using Task = std::function<void()>;
+
+  explicit WorkPool(unsigned workers);
+  WorkPool(const WorkPool &) = delete;
+  WorkPool &operator=(const WorkPool &) = delete;
+  ~WorkPool();
+
+  /// @brief Queue a task. Called from a worker, the task goes to that
+  /// worker's own deque; otherwise deques are filled round-robin.
+  /// @param task
+  void submit(Task task);
+
+  /// @brief Block until every submitted task, including the ones spawned by
+  /// other tasks, has finished.
+  void wait();
+
+  unsigned size() const { return static_cast<unsigned>(queues_.size()); }
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> threads_;
+
+  std::mutex state_mutex_;
+  std::condition_variable work_available_;
+  std::condition_variable all_done_;
+  std::size_t queued_ = 0;  // guarded by state_mutex_
+  std::size_t pending_ = 0; // guarded by state_mutex_
+  bool stopping_ = false;   // guarded by state_mutex_
+  std::atomic<std::size_t> next_queue_{0};
+
+  void run(std::size_t index);
+  Task take(std::size_t index);
+};
+
+} // namespace fs
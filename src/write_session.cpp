@@ -0,0 +1,362 @@
+#include "write_session.h"
+#include "compression.h"
+#include "openat_writer.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <unordered_set>
+
+namespace fs {
+
+namespace {
+
+std::int64_t mtime_of(const std::filesystem::path &path, std::error_code &ec) {
+  return static_cast<std::int64_t>(
+      std::filesystem::last_write_time(path, ec).time_since_epoch().count());
+}
+
+// Whether `path` resolves under `root`, following the symbolic links of its
+// parent directories (not the one it may be itself, which prune removes)
+bool resolves_under(const std::filesystem::path &root,
+                    const std::filesystem::path &path) {
+  std::error_code ec;
+  std::filesystem::path resolved_root =
+      std::filesystem::weakly_canonical(root, ec);
+  if (ec) {
+    return false;
+  }
+  std::filesystem::path resolved =
+      std::filesystem::weakly_canonical(path.parent_path(), ec);
+  if (ec) {
+    return false;
+  }
+  resolved /= path.filename();
+  auto [root_end, path_end] =
+      std::mismatch(resolved_root.begin(), resolved_root.end(),
+                    resolved.begin(), resolved.end());
+  return root_end == resolved_root.end() && path_end != resolved.end();
+}
+
+bool same_bytes_on_disk(const std::filesystem::path &path,
+                        std::string_view content) {
+  std::ifstream file(path, std::ios::binary);
+  std::string buffer(64 * 1024, '\0');
+  std::size_t offset = 0;
+  while (file) {
+    file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    auto count = static_cast<std::size_t>(file.gcount());
+    if (count == 0) {
+      break;
+    }
+    if (offset + count > content.size() ||
+        content.substr(offset, count) !=
+            std::string_view(buffer.data(), count)) {
+      return false;
+    }
+    offset += count;
+  }
+  return offset == content.size() && !file.bad();
+}
+
+// Same for a compressed body, one frame at a time
+bool same_bytes_on_disk(const std::filesystem::path &path,
+                        const CompressedContent &compressed) {
+  std::ifstream file(path, std::ios::binary);
+  std::string buffer;
+  bool same = compressed.for_each_frame([&](const char *data,
+                                            std::size_t size) {
+    buffer.resize(size);
+    file.read(buffer.data(), static_cast<std::streamsize>(size));
+    return static_cast<std::size_t>(file.gcount()) == size &&
+           std::memcmp(buffer.data(), data, size) == 0;
+  });
+  return same && file.peek() == std::ifstream::traits_type::eof();
+}
+
+} // namespace
+
+// ============================================================================
+// WriteSession Implementation
+// ============================================================================
+
+WriteSession::WriteSession(const WriteOptions &options, const Dir &root)
+    : options_(options), root_(root),
+      root_path_(root.get_path().to_path().lexically_normal()),
+      syncer_(options.durability) {
+  if (options.dedup != DedupMode::Off) {
+    dedup_ = std::make_unique<Deduper>(options.dedup);
+  }
+  if (options.incremental) {
+    previous_ = Manifest::load(root_path_ / Manifest::kFileName);
+  }
+}
+
+std::string WriteSession::relative_path(const Path &node_path) const {
+  std::filesystem::path path = node_path.to_path().lexically_normal();
+  std::filesystem::path relative = path.lexically_relative(root_path_);
+  if (relative.empty() || *relative.begin() == "..") {
+    return path.generic_string();
+  }
+  return relative.generic_string();
+}
+
+void WriteSession::record(const std::string &relative,
+                          const Manifest::Entry &entry) {
+  std::lock_guard<std::mutex> lock(manifest_mutex_);
+  current_.set(relative, entry);
+}
+
+bool WriteSession::is_unchanged(const File &file,
+                                const std::string &relative) {
+  const auto &compressed = file.get_tree()->compressed_of(file.get_id());
+  std::string_view content = file.get_content();
+  std::uint64_t size = compressed ? compressed->size() : content.size();
+  std::filesystem::path path = file.get_path().to_path();
+
+  std::error_code ec;
+  auto size_on_disk = std::filesystem::file_size(path, ec);
+  if (ec || size_on_disk != size) {
+    return false;
+  }
+  std::int64_t mtime = mtime_of(path, ec);
+  if (ec) {
+    return false;
+  }
+
+  Manifest::Entry entry{compressed ? compressed->hash()
+                                   : content_hash(content),
+                        size, mtime};
+  // The manifest is only trusted if the file was not touched since the
+  // previous run; otherwise compare with what is actually on disk.
+  auto previous = previous_.find(relative);
+  bool unchanged = (previous && previous->hash == entry.hash &&
+                    previous->size == entry.size &&
+                    previous->mtime == entry.mtime) ||
+                   (compressed ? same_bytes_on_disk(path, *compressed)
+                               : same_bytes_on_disk(path, content));
+  if (unchanged) {
+    record(relative, entry);
+  }
+  return unchanged;
+}
+
+bool WriteSession::claim(const File &file) {
+  if (options_.incremental && !file.is_streamed() && !file.has_source() &&
+      !file.is_filled() &&
+      is_unchanged(file, relative_path(file.get_path()))) {
+    ++files_unchanged_;
+    return false;
+  }
+  return !dedup_ || dedup_->claim(file);
+}
+
+void WriteSession::sync_by_path(const File &file) {
+  try {
+    syncer_.file_written(file.get_path().to_path());
+  } catch (const std::exception &e) {
+    report(e);
+  }
+}
+
+void WriteSession::written(const File &file) {
+  ++files_written_;
+  if (!options_.incremental) {
+    return;
+  }
+
+  std::filesystem::path path = file.get_path().to_path();
+  std::error_code ec;
+  Manifest::Entry entry;
+  entry.size = std::filesystem::file_size(path, ec);
+  if (!ec) {
+    entry.mtime = mtime_of(path, ec);
+  }
+  // Streamed, copied and filled bodies are produced again on every run,
+  // they are not hashed
+  if (file.is_compressed()) {
+    entry.hash = file.get_tree()->compressed_of(file.get_id())->hash();
+  } else {
+    entry.hash = file.is_streamed() || file.has_source() || file.is_filled()
+                     ? 0
+                     : content_hash(file.get_content());
+  }
+  if (!ec) {
+    record(relative_path(file.get_path()), entry);
+  }
+}
+
+void WriteSession::write_file(const File &file) {
+  if (file.is_streamed() && threaded_) {
+    std::lock_guard<std::mutex> lock(deferred_mutex_);
+    deferred_.push_back(file);
+    return;
+  }
+  if (!claim(file)) {
+    return;
+  }
+  try {
+    write_claimed(file);
+    written(file);
+  } catch (const std::exception &e) {
+    report_file(file, e);
+  }
+}
+
+void WriteSession::write_claimed(const File &file) {
+  // std::ofstream does not expose its descriptor
+  if (syncer_.durability() != Durability::PerFile) {
+    file.write_to_disk();
+  } else if (!write_file_openat(file, syncer_)) {
+    file.write_to_disk();
+    syncer_.file_written(file.get_path().to_path());
+  }
+}
+
+void WriteSession::report(const std::exception &e) {
+  ++errors_;
+  std::lock_guard<std::mutex> lock(report_mutex_);
+  std::ostream &out =
+      options_.error_output ? *options_.error_output : std::cerr;
+  out << e.what() << '\n';
+}
+
+void WriteSession::report_file(const File &file, const std::exception &e) {
+  if (dedup_) {
+    dedup_->mark_failed(file);
+  }
+  report(e);
+}
+
+std::vector<std::string> WriteSession::collect_stale() const {
+  // Every file of the tree, whether or not it could be written this time
+  std::unordered_set<std::string> in_tree;
+  std::vector<Dir> pending{root_};
+  while (!pending.empty()) {
+    Dir dir = std::move(pending.back());
+    pending.pop_back();
+    for (const auto &file : dir.get_files()) {
+      in_tree.insert(relative_path(file.get_path()));
+    }
+    for (const auto &link : dir.get_links()) {
+      in_tree.insert(relative_path(link.get_path()));
+    }
+    for (auto &sub_dir : dir.get_subdirs()) {
+      pending.push_back(std::move(sub_dir));
+    }
+  }
+
+  std::vector<std::string> stale;
+  for (const auto &[relative, entry] : previous_.entries()) {
+    std::filesystem::path path = root_path_ / relative;
+    if (!in_tree.contains(relative) && resolves_under(root_path_, path)) {
+      stale.push_back(path.string());
+    }
+  }
+  return stale;
+}
+
+std::size_t WriteSession::write_links() {
+  // Every directory and file is on disk by now, so are the link targets.
+  // Hard links to hard links resolve to the file itself in the tree.
+  std::size_t count = 0;
+  std::vector<Dir> pending{root_};
+  while (!pending.empty()) {
+    Dir dir = std::move(pending.back());
+    pending.pop_back();
+    for (const auto &link : dir.get_links()) {
+      try {
+        link.write_to_disk();
+        ++count;
+      } catch (const std::exception &e) {
+        report(e);
+      }
+    }
+    for (auto &sub_dir : dir.get_subdirs()) {
+      pending.push_back(std::move(sub_dir));
+    }
+  }
+  return count;
+}
+
+void WriteSession::sync_tree() {
+  std::vector<std::filesystem::path> dirs;
+  std::vector<Dir> pending{root_};
+  while (!pending.empty()) {
+    Dir dir = std::move(pending.back());
+    pending.pop_back();
+    dirs.push_back(dir.get_path().to_path());
+    for (auto &sub_dir : dir.get_subdirs()) {
+      pending.push_back(std::move(sub_dir));
+    }
+  }
+  syncer_.finish(root_path_, dirs,
+                 [this](const std::exception &e) { report(e); });
+}
+
+WriteReport WriteSession::finish() {
+  threaded_ = false;
+  for (const File &file : deferred_) {
+    write_file(file);
+  }
+  deferred_.clear();
+
+  if (dedup_) {
+    // Cloned, linked or copied by the kernel: no descriptor of ours
+    dedup_->link_all([this](const std::exception &e) { report(e); },
+                     [this](const File &file) {
+                       sync_by_path(file);
+                       written(file);
+                     });
+  }
+
+  WriteReport result;
+  if (dedup_) {
+    result.files_cloned = dedup_->cloned();
+    result.files_hardlinked = dedup_->hardlinked();
+    result.files_copied = dedup_->copied();
+  }
+  if (root_.get_tree() && root_.get_tree()->link_count() > 0) {
+    result.links_written = write_links();
+  }
+  if (options_.durability != Durability::None) {
+    sync_tree();
+  }
+  result.sync_seconds = syncer_.seconds();
+  result.files_written = files_written_;
+  result.files_unchanged = files_unchanged_;
+  if (!options_.incremental) {
+    result.errors = errors_;
+    return result;
+  }
+
+  result.stale_files = collect_stale();
+  if (options_.prune) {
+    for (const auto &stale : result.stale_files) {
+      std::error_code ec;
+      std::filesystem::remove(stale, ec);
+      if (ec) {
+        report(std::runtime_error("Failed to remove stale file: " + stale +
+                                  " - " + ec.message()));
+      }
+    }
+  } else {
+    // Stale files are left on disk, keep tracking them
+    for (const auto &[relative, entry] : previous_.entries()) {
+      if (!current_.find(relative)) {
+        current_.set(relative, entry);
+      }
+    }
+  }
+
+  try {
+    current_.save(root_path_ / Manifest::kFileName);
+  } catch (const std::exception &e) {
+    report(e);
+  }
+  result.errors = errors_;
+  return result;
+}
+
+} // namespace fs
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "../include/fs.h"
+#include "dedup.h"
+#include "durability.h"
+#include "manifest.h"
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace fs {
+
+/// @brief State shared by every writer (sequential, thread pool, io_uring)
+/// during one Dir::write_to_disk(options) call.
+class WriteSession {
+public:
+  WriteSession(const WriteOptions &options, const Dir &root);
+
+  const WriteOptions &options() const { return options_; }
+
+  /// @brief Mark that files are now written from worker threads. Streamed
+  /// files are then deferred to finish(): their producers (Lua functions in
+  /// particular) must run on the thread that started the write.
+  /// @param threaded
+  void set_threaded(bool threaded) { threaded_ = threaded; }
+  bool threaded() const { return threaded_; }
+
+  /// @brief Thread-safe. Returns true if `file` has to be written by the
+  /// caller now, false if it is already up to date on disk (incremental
+  /// writes) or if finish() will take care of it (deduplication).
+  /// @param file
+  bool claim(const File &file);
+
+  /// @brief Thread-safe. Record that a claimed file was written. The writer
+  /// has synced it already if the durability policy asks for it, through
+  /// syncer() and the descriptor it wrote with.
+  /// @param file
+  void written(const File &file);
+
+  /// @brief Thread-safe. Sync a claimed file written without a descriptor
+  /// of ours (io_uring direct descriptors, dedup clones) by reopening it,
+  /// if the durability policy asks for it. Failures are reported.
+  /// @param file
+  void sync_by_path(const File &file);
+
+  Syncer &syncer() { return syncer_; }
+
+  /// @brief Thread-safe. Write one claimed file the way the stream writer
+  /// does, syncing it before it is closed if the durability policy asks
+  /// for it.
+  /// @param file
+  /// @throws std::runtime_error on failure.
+  void write_claimed(const File &file);
+
+  /// @brief Thread-safe. Claim and write one file, reporting failures.
+  /// @param file
+  void write_file(const File &file);
+
+  /// @brief Thread-safe. Report a failure on one node. The tree write
+  /// carries on, exactly like the historical sequential writer.
+  /// @param e
+  void report(const std::exception &e);
+
+  /// @brief Thread-safe. Report that a claimed file could not be written.
+  /// @param file
+  /// @param e
+  void report_file(const File &file, const std::exception &e);
+
+  /// @brief Produce everything that was deferred (streamed files written
+  /// from worker threads, deduplicated files, links), make the tree durable
+  /// as requested, then update the manifest of incremental writes.
+  /// Must be called once all writers are done.
+  WriteReport finish();
+
+private:
+  const WriteOptions &options_;
+  Dir root_;
+  std::filesystem::path root_path_;
+  std::unique_ptr<Deduper> dedup_;
+  Syncer syncer_;
+  std::mutex report_mutex_;
+  bool threaded_ = false;
+  std::mutex deferred_mutex_;
+  std::vector<File> deferred_;
+
+  std::atomic<std::size_t> files_written_{0};
+  std::atomic<std::size_t> files_unchanged_{0};
+  std::atomic<std::size_t> errors_{0};
+
+  // Incremental writes: manifest of the previous run, and the one built
+  // for this run
+  Manifest previous_;
+  std::mutex manifest_mutex_;
+  Manifest current_;
+
+  std::string relative_path(const Path &node_path) const;
+  bool is_unchanged(const File &file, const std::string &relative);
+  void record(const std::string &relative, const Manifest::Entry &entry);
+  std::vector<std::string> collect_stale() const;
+  std::size_t write_links();
+  void sync_tree();
+};
+
+} // namespace fs
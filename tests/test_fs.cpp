@@ -1,7 +1,12 @@
 #include "../include/fs.h"
+#include "../include/pack.h"
+#include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <gtest/gtest.h>
+#include <memory>
+#include <sstream>
+#include <thread>
 
 namespace fs_test {
 
@@ -109,6 +114,39 @@ TEST_F(FsTest, FileWriteMultilineContent) {
   EXPECT_EQ(read_file(file_path), content);
 }
 
+TEST_F(FsTest, FileWriteStreamedContent) {
+  std::filesystem::create_directories(test_dir);
+
+  std::string file_path = test_dir + "/streamed.txt";
+  std::size_t remaining = 3 * fs::File::kStreamBufferSize + 17;
+  std::size_t largest_pull = 0;
+
+  fs::File file(fs::Path(file_path),
+                [&](char *buffer, std::size_t capacity) -> std::size_t {
+                  largest_pull = std::max(largest_pull, capacity);
+                  std::size_t count = std::min(capacity, remaining);
+                  std::fill(buffer, buffer + count, 'x');
+                  remaining -= count;
+                  return count;
+                });
+  EXPECT_TRUE(file.is_streamed());
+  file.write_to_disk();
+
+  EXPECT_EQ(read_file(file_path),
+            std::string(3 * fs::File::kStreamBufferSize + 17, 'x'));
+  EXPECT_EQ(largest_pull, fs::File::kStreamBufferSize);
+}
+
+TEST_F(FsTest, FileStreamedProducerErrorThrows) {
+  std::filesystem::create_directories(test_dir);
+
+  fs::File file(fs::Path(test_dir + "/broken.txt"),
+                [](char *, std::size_t) -> std::size_t {
+                  throw std::runtime_error("producer failed");
+                });
+  EXPECT_THROW(file.write_to_disk(), std::runtime_error);
+}
+
 // ============================================================================
 // Dir Tests
 // ============================================================================
@@ -229,4 +267,1120 @@ TEST_F(FsTest, ComplexDirStructure) {
   EXPECT_TRUE(file_exists(dir_path + "/tests/test.cpp"));
 }
 
+TEST_F(FsTest, ParallelWriteToDisk) {
+  std::filesystem::create_directories(test_dir);
+  std::string dir_path = test_dir + "/parallel";
+
+  fs::Dir root(dir_path);
+  for (int d = 0; d < 8; ++d) {
+    std::string sub_path = dir_path + "/module" + std::to_string(d);
+    fs::Dir sub(sub_path);
+    fs::Dir nested(sub_path + "/src");
+    for (int f = 0; f < 100; ++f) {
+      std::string name = "/file" + std::to_string(f) + ".txt";
+      nested.add_file(fs::File(sub_path + "/src" + name, "Content " + name));
+    }
+    sub.add_subdir(std::move(nested));
+    sub.add_file(fs::File(sub_path + "/README.md", "# module"));
+    root.add_subdir(std::move(sub));
+  }
+
+  fs::WriteOptions options;
+  options.jobs = 4;
+  root.write_to_disk(options);
+
+  for (int d = 0; d < 8; ++d) {
+    std::string sub_path = dir_path + "/module" + std::to_string(d);
+    EXPECT_EQ(read_file(sub_path + "/README.md"), "# module");
+    for (int f = 0; f < 100; ++f) {
+      std::string name = "/file" + std::to_string(f) + ".txt";
+      EXPECT_EQ(read_file(sub_path + "/src" + name), "Content " + name);
+    }
+  }
+}
+
+TEST_F(FsTest, ParallelWriteStreamedFiles) {
+  std::filesystem::create_directories(test_dir);
+  std::string dir_path = test_dir + "/parallel_streamed";
+
+  // Producers must run on the thread that called write_to_disk
+  std::thread::id caller = std::this_thread::get_id();
+  bool same_thread = true;
+
+  fs::Dir root(dir_path);
+  for (int d = 0; d < 4; ++d) {
+    std::string sub_path = dir_path + "/sub" + std::to_string(d);
+    fs::Dir sub(sub_path);
+    auto done = std::make_shared<bool>(false);
+    sub.add_file(fs::File(
+        fs::Path(sub_path + "/streamed.txt"),
+        [&, done](char *buffer, std::size_t) -> std::size_t {
+          same_thread = same_thread && std::this_thread::get_id() == caller;
+          if (*done) {
+            return 0;
+          }
+          *done = true;
+          buffer[0] = 's';
+          return 1;
+        }));
+    root.add_subdir(std::move(sub));
+  }
+
+  fs::WriteOptions options;
+  options.jobs = 4;
+  root.write_to_disk(options);
+
+  for (int d = 0; d < 4; ++d) {
+    EXPECT_EQ(read_file(dir_path + "/sub" + std::to_string(d) +
+                        "/streamed.txt"),
+              "s");
+  }
+  EXPECT_TRUE(same_thread);
+}
+
+TEST_F(FsTest, ParallelWriteRootFailureThrows) {
+  std::filesystem::create_directories(test_dir);
+  std::string blocker = test_dir + "/blocker";
+  std::ofstream(blocker) << "not a directory";
+
+  fs::Dir root(blocker + "/root");
+  root.add_file(fs::File(blocker + "/root/file.txt", "content"));
+
+  fs::WriteOptions options;
+  options.jobs = 0;
+  EXPECT_THROW(root.write_to_disk(options), std::runtime_error);
+}
+
+TEST_F(FsTest, IoUringBackendWriteToDisk) {
+  std::filesystem::create_directories(test_dir);
+  std::string dir_path = test_dir + "/uring";
+
+  // Falls back to the stream writer where io_uring is unavailable, so the
+  // result must be the same either way.
+  fs::Dir root(dir_path);
+  for (int d = 0; d < 4; ++d) {
+    std::string sub_path = dir_path + "/dir" + std::to_string(d);
+    fs::Dir sub(sub_path);
+    fs::Dir nested(sub_path + "/nested");
+    for (int f = 0; f < 300; ++f) {
+      std::string name = "/file" + std::to_string(f) + ".txt";
+      sub.add_file(fs::File(sub_path + name, "Content " + name));
+    }
+    nested.add_file(fs::File(sub_path + "/nested/empty.txt", ""));
+    sub.add_subdir(std::move(nested));
+    root.add_subdir(std::move(sub));
+  }
+  root.add_file(fs::File(dir_path + "/missing/file.txt", "unreachable"));
+
+  fs::WriteOptions options;
+  options.backend = fs::WriteBackend::IoUring;
+  root.write_to_disk(options);
+
+  for (int d = 0; d < 4; ++d) {
+    std::string sub_path = dir_path + "/dir" + std::to_string(d);
+    for (int f = 0; f < 300; ++f) {
+      std::string name = "/file" + std::to_string(f) + ".txt";
+      EXPECT_EQ(read_file(sub_path + name), "Content " + name);
+    }
+    EXPECT_TRUE(file_exists(sub_path + "/nested/empty.txt"));
+  }
+  EXPECT_FALSE(file_exists(dir_path + "/missing/file.txt"));
+}
+
+TEST_F(FsTest, OpenatBackendWriteToDisk) {
+  std::filesystem::create_directories(test_dir);
+  std::string dir_path = test_dir + "/openat";
+
+  fs::Dir root(dir_path);
+  for (int d = 0; d < 4; ++d) {
+    std::string sub_path = dir_path + "/dir" + std::to_string(d);
+    fs::Dir sub(sub_path);
+    fs::Dir nested(sub_path + "/nested");
+    for (int f = 0; f < 50; ++f) {
+      std::string name = "/file" + std::to_string(f) + ".txt";
+      sub.add_file(fs::File(sub_path + name, "Content " + name));
+    }
+    nested.add_file(fs::File(sub_path + "/nested/empty.txt", ""));
+    sub.add_subdir(std::move(nested));
+    root.add_subdir(std::move(sub));
+  }
+  // Not directly under the root: written by full path
+  root.add_file(fs::File(dir_path + "/deep/er/file.txt", "deep"));
+  root.add_subdir(fs::Dir(dir_path + "/x/y"));
+
+  for (unsigned jobs : {1u, 4u}) {
+    std::filesystem::remove_all(dir_path);
+    std::filesystem::create_directories(dir_path + "/deep/er");
+
+    fs::WriteOptions options;
+    options.backend = fs::WriteBackend::Openat;
+    options.jobs = jobs;
+    fs::WriteReport report = root.write_to_disk(options);
+
+    EXPECT_EQ(report.files_written, 4u * 51u + 1u);
+    EXPECT_EQ(report.errors, 0u);
+    for (int d = 0; d < 4; ++d) {
+      std::string sub_path = dir_path + "/dir" + std::to_string(d);
+      for (int f = 0; f < 50; ++f) {
+        std::string name = "/file" + std::to_string(f) + ".txt";
+        EXPECT_EQ(read_file(sub_path + name), "Content " + name);
+      }
+      EXPECT_TRUE(file_exists(sub_path + "/nested/empty.txt"));
+    }
+    EXPECT_EQ(read_file(dir_path + "/deep/er/file.txt"), "deep");
+    EXPECT_TRUE(std::filesystem::is_directory(dir_path + "/x/y"));
+  }
+}
+
+TEST_F(FsTest, OpenatBackendReportsErrors) {
+  std::filesystem::create_directories(test_dir + "/openat");
+  std::string dir_path = test_dir + "/openat";
+  {
+    // A file is in the way of a directory
+    std::ofstream blocker(dir_path + "/sub");
+  }
+
+  fs::Dir root(dir_path);
+  fs::Dir sub(dir_path + "/sub");
+  sub.add_file(fs::File(dir_path + "/sub/file.txt", "unreachable"));
+  root.add_subdir(std::move(sub));
+  root.add_file(fs::File(dir_path + "/ok.txt", "ok"));
+
+  std::ostringstream errors;
+  fs::WriteOptions options;
+  options.backend = fs::WriteBackend::Openat;
+  options.error_output = &errors;
+  fs::WriteReport report = root.write_to_disk(options);
+
+  EXPECT_EQ(report.files_written, 1u);
+  EXPECT_EQ(report.errors, 1u);
+  EXPECT_NE(errors.str().find("sub"), std::string::npos);
+  EXPECT_EQ(read_file(dir_path + "/ok.txt"), "ok");
+}
+
+TEST_F(FsTest, ContentPoolSharesIdenticalContent) {
+  fs::ContentPool pool;
+
+  fs::Content first = pool.intern("same bytes");
+  fs::Content second = pool.intern("same bytes");
+  fs::Content other = pool.intern("other bytes");
+
+  EXPECT_EQ(first.get(), second.get());
+  EXPECT_NE(first.get(), other.get());
+  EXPECT_EQ(pool.size(), 2u);
+
+  other.reset();
+  EXPECT_EQ(pool.size(), 1u);
+}
+
+TEST_F(FsTest, DedupWriteToDisk) {
+  std::filesystem::create_directories(test_dir);
+  std::string dir_path = test_dir + "/dedup";
+
+  fs::ContentPool pool;
+  std::string license(8192, 'L');
+
+  fs::Dir root(dir_path);
+  for (int d = 0; d < 3; ++d) {
+    std::string sub_path = dir_path + "/module" + std::to_string(d);
+    fs::Dir sub(sub_path);
+    sub.add_file(fs::File(fs::Path(sub_path + "/LICENSE"), pool.intern(license)));
+    sub.add_file(fs::File(sub_path + "/__init__.py", ""));
+    sub.add_file(fs::File(sub_path + "/id.txt", std::to_string(d)));
+    root.add_subdir(std::move(sub));
+  }
+
+  for (auto mode : {fs::DedupMode::Reflink, fs::DedupMode::Hardlink}) {
+    fs::WriteOptions options;
+    options.dedup = mode;
+    root.write_to_disk(options);
+
+    for (int d = 0; d < 3; ++d) {
+      std::string sub_path = dir_path + "/module" + std::to_string(d);
+      EXPECT_EQ(read_file(sub_path + "/LICENSE"), license);
+      EXPECT_TRUE(file_exists(sub_path + "/__init__.py"));
+      EXPECT_EQ(read_file(sub_path + "/id.txt"), std::to_string(d));
+    }
+  }
+
+  EXPECT_EQ(pool.size(), 1u);
+}
+
+TEST_F(FsTest, DedupMatchesEveryKnownBodyKind) {
+  std::string dir_path = test_dir + "/dedup_kinds";
+  std::filesystem::create_directories(test_dir);
+  std::string source_path = test_dir + "/dedup_source.bin";
+  std::ofstream(source_path) << std::string(8192, 'S');
+
+  auto tree = fs::Tree::create();
+  tree->set_compression_threshold(4096);
+  std::string text(16384, 'C');
+  fs::FillSpec fill;
+  fill.size = 8192;
+  fill.pattern = "fill";
+
+  fs::Dir root = tree->create_dir(fs::Path(dir_path));
+  for (int i = 0; i < 3; ++i) {
+    std::string n = std::to_string(i);
+    // Separate buffers: compressed separately, matched on their frames
+    root.add_file(tree->create_file(
+        fs::Path(dir_path + "/text" + n),
+        fs::Content(std::make_shared<const std::string>(text))));
+    root.add_file(tree->create_file(fs::Path(dir_path + "/fill" + n), fill));
+    root.add_file(
+        tree->create_copy(fs::Path(dir_path + "/copy" + n), source_path));
+  }
+  // Only known once produced: always written
+  root.add_file(tree->create_file(
+      fs::Path(dir_path + "/streamed"),
+      fs::ContentProducer([](char *, std::size_t) { return std::size_t(0); })));
+  ASSERT_TRUE(root.get_files()[0].is_compressed());
+
+  for (auto mode : {fs::DedupMode::Reflink, fs::DedupMode::Hardlink}) {
+    std::filesystem::remove_all(dir_path);
+    fs::WriteOptions options;
+    options.dedup = mode;
+    fs::WriteReport report = root.write_to_disk(options);
+
+    EXPECT_EQ(report.errors, 0u);
+    // Hardlink mode still reflinks first where the filesystem can
+    EXPECT_EQ(report.files_cloned + report.files_hardlinked +
+                  report.files_copied,
+              6u);
+    for (int i = 0; i < 3; ++i) {
+      std::string n = std::to_string(i);
+      EXPECT_EQ(read_file(dir_path + "/text" + n), text);
+      EXPECT_EQ(std::filesystem::file_size(dir_path + "/fill" + n), 8192u);
+      EXPECT_EQ(read_file(dir_path + "/copy" + n), std::string(8192, 'S'));
+    }
+  }
+}
+
+TEST_F(FsTest, DedupRewriteKeepsHardlinkedFilesApart) {
+  std::string dir_path = test_dir + "/dedup_rewrite";
+  std::filesystem::create_directories(test_dir);
+  std::string x(8192, 'X');
+  std::string y(8192, 'Y');
+
+  auto build = [&](const std::string &a) {
+    fs::Dir root(dir_path);
+    root.add_file(fs::File(dir_path + "/a.bin", a));
+    root.add_file(fs::File(dir_path + "/b.bin", x));
+    return root;
+  };
+
+  for (auto backend : {fs::WriteBackend::Stream, fs::WriteBackend::IoUring,
+                       fs::WriteBackend::Openat}) {
+    std::filesystem::remove_all(dir_path);
+    fs::WriteOptions options;
+    options.backend = backend;
+    options.dedup = fs::DedupMode::Hardlink;
+    options.incremental = true;
+    ASSERT_EQ(build(x).write_to_disk(options).errors, 0u);
+
+    // a.bin and b.bin may share an inode: a.bin must get its own
+    EXPECT_EQ(build(y).write_to_disk(options).errors, 0u);
+    EXPECT_EQ(read_file(dir_path + "/a.bin"), y);
+    EXPECT_EQ(read_file(dir_path + "/b.bin"), x);
+
+    // And both names of a still linked pair are rewritten
+    ASSERT_EQ(build(x).write_to_disk(options).errors, 0u);
+    options.incremental = false;
+    options.dedup = fs::DedupMode::Off;
+    fs::Dir root(dir_path);
+    root.add_file(fs::File(dir_path + "/a.bin", y));
+    root.add_file(fs::File(dir_path + "/b.bin", x));
+    EXPECT_EQ(root.write_to_disk(options).errors, 0u);
+    EXPECT_EQ(read_file(dir_path + "/a.bin"), y);
+    EXPECT_EQ(read_file(dir_path + "/b.bin"), x);
+  }
+}
+
+TEST_F(FsTest, IncrementalWriteSkipsUnchangedFiles) {
+  std::filesystem::create_directories(test_dir);
+  std::string dir_path = test_dir + "/incremental";
+
+  auto build = [&](const std::string &readme) {
+    fs::Dir root(dir_path);
+    fs::Dir src(dir_path + "/src");
+    src.add_file(fs::File(dir_path + "/src/main.cpp", "int main() {}"));
+    root.add_subdir(std::move(src));
+    root.add_file(fs::File(dir_path + "/README.md", readme));
+    return root;
+  };
+
+  fs::WriteOptions options;
+  options.incremental = true;
+
+  fs::WriteReport first = build("v1").write_to_disk(options);
+  EXPECT_EQ(first.files_written, 2u);
+  EXPECT_EQ(first.files_unchanged, 0u);
+  EXPECT_TRUE(file_exists(dir_path + "/.cdirnuts-manifest"));
+
+  auto main_time = std::filesystem::last_write_time(dir_path + "/src/main.cpp");
+  fs::WriteReport second = build("v2").write_to_disk(options);
+  EXPECT_EQ(second.files_written, 1u);
+  EXPECT_EQ(second.files_unchanged, 1u);
+  EXPECT_EQ(std::filesystem::last_write_time(dir_path + "/src/main.cpp"),
+            main_time);
+  EXPECT_EQ(read_file(dir_path + "/README.md"), "v2");
+
+  // A file edited by hand is written again
+  {
+    std::ofstream edited(dir_path + "/src/main.cpp");
+    edited << "int main() { return 1; }";
+  }
+  fs::WriteReport third = build("v2").write_to_disk(options);
+  EXPECT_EQ(third.files_written, 1u);
+  EXPECT_EQ(third.files_unchanged, 1u);
+  EXPECT_EQ(read_file(dir_path + "/src/main.cpp"), "int main() {}");
+}
+
+TEST_F(FsTest, IncrementalWriteReportsAndPrunesStaleFiles) {
+  std::filesystem::create_directories(test_dir);
+  std::string dir_path = test_dir + "/stale";
+
+  fs::WriteOptions options;
+  options.incremental = true;
+
+  fs::Dir before(dir_path);
+  before.add_file(fs::File(dir_path + "/keep.txt", "keep"));
+  before.add_file(fs::File(dir_path + "/old.txt", "old"));
+  before.write_to_disk(options);
+
+  fs::Dir after(dir_path);
+  after.add_file(fs::File(dir_path + "/keep.txt", "keep"));
+
+  fs::WriteReport report = after.write_to_disk(options);
+  ASSERT_EQ(report.stale_files.size(), 1u);
+  EXPECT_EQ(std::filesystem::path(report.stale_files[0]).filename(), "old.txt");
+  EXPECT_TRUE(file_exists(dir_path + "/old.txt"));
+
+  options.prune = true;
+  report = after.write_to_disk(options);
+  ASSERT_EQ(report.stale_files.size(), 1u);
+  EXPECT_FALSE(file_exists(dir_path + "/old.txt"));
+  EXPECT_TRUE(file_exists(dir_path + "/keep.txt"));
+
+  report = after.write_to_disk(options);
+  EXPECT_TRUE(report.stale_files.empty());
+}
+
+TEST_F(FsTest, PruneNeverRemovesFilesOutsideTheRoot) {
+  std::string dir_path = test_dir + "/pruned";
+  std::string outside_path = test_dir + "/outside";
+  std::filesystem::create_directories(outside_path);
+  for (const char *name : {"a.txt", "b.txt", "c.txt"}) {
+    std::ofstream(outside_path + "/" + name) << "keep me";
+  }
+
+  fs::WriteOptions options;
+  options.incremental = true;
+  options.prune = true;
+  fs::Dir root(dir_path);
+  root.add_file(fs::File(dir_path + "/keep.txt", "keep"));
+  root.write_to_disk(options);
+
+  // A hand-edited manifest, and a directory linking out of the root
+  std::filesystem::create_directory_symlink(
+      std::filesystem::absolute(outside_path), dir_path + "/link");
+  {
+    std::ofstream manifest(dir_path + "/.cdirnuts-manifest", std::ios::app);
+    manifest << "0 7 0 ../outside/a.txt\n"
+             << "0 7 0 " << std::filesystem::absolute(outside_path).string()
+             << "/b.txt\n"
+             << "0 7 0 link/c.txt\n";
+  }
+
+  fs::WriteReport report = root.write_to_disk(options);
+  EXPECT_TRUE(report.stale_files.empty());
+  EXPECT_EQ(report.errors, 0u);
+  for (const char *name : {"a.txt", "b.txt", "c.txt"}) {
+    EXPECT_TRUE(file_exists(outside_path + "/" + name)) << name;
+  }
+  EXPECT_TRUE(file_exists(dir_path + "/keep.txt"));
+}
+
+TEST_F(FsTest, DurabilityPoliciesSyncEveryBackend) {
+  for (auto durability : {fs::Durability::PerFile, fs::Durability::Batched}) {
+    for (auto backend : {fs::WriteBackend::Stream, fs::WriteBackend::IoUring,
+                         fs::WriteBackend::Openat}) {
+      std::string dir_path = test_dir + "/durable";
+      std::filesystem::remove_all(dir_path);
+      fs::Dir root(dir_path);
+      fs::Dir sub(dir_path + "/sub");
+      sub.add_file(fs::File(dir_path + "/sub/a.txt", "a"));
+      root.add_subdir(std::move(sub));
+      root.add_file(fs::File(dir_path + "/b.txt", "b"));
+      fs::FillSpec fill;
+      fill.size = 4096;
+      fill.pattern = "f";
+      root.add_file(fs::File(fs::Path(dir_path + "/c.bin"), fill));
+
+      fs::WriteOptions options;
+      options.backend = backend;
+      options.durability = durability;
+      fs::WriteReport report = root.write_to_disk(options);
+      EXPECT_EQ(report.errors, 0u);
+      EXPECT_EQ(report.files_written, 3u);
+      EXPECT_GT(report.sync_seconds, 0.0);
+      EXPECT_EQ(read_file(dir_path + "/sub/a.txt"), "a");
+    }
+  }
+
+  fs::Dir root(test_dir + "/fast");
+  root.add_file(fs::File(test_dir + "/fast/c.txt", "c"));
+  EXPECT_EQ(root.write_to_disk(fs::WriteOptions{}).sync_seconds, 0.0);
+}
+
+TEST_F(FsTest, PlanDescribesWriteWithoutWriting) {
+  std::string dir_path = test_dir + "/planned";
+  fs::Dir root(dir_path);
+  fs::Dir sub(dir_path + "/sub");
+  sub.add_file(fs::File(dir_path + "/sub/deep.txt", "12345"));
+  root.add_subdir(std::move(sub));
+  root.add_file(fs::File(dir_path + "/a.txt", "abc"));
+  root.add_file(fs::File(dir_path + "/clash", "x"));
+
+  fs::WriteOptions options;
+  options.dry_run = true;
+  fs::WriteReport report = root.write_to_disk(options);
+  EXPECT_FALSE(std::filesystem::exists(dir_path));
+  EXPECT_EQ(report.files_written, 0u);
+  EXPECT_EQ(report.plan.dirs, 2u);
+  EXPECT_EQ(report.plan.files, 3u);
+  EXPECT_EQ(report.plan.bytes, 9u);
+  EXPECT_EQ(report.plan.max_depth, 2u);
+  EXPECT_EQ(std::filesystem::path(report.plan.deepest_path).filename(),
+            "deep.txt");
+  EXPECT_TRUE(report.plan.fits);
+  EXPECT_GT(report.plan.available_bytes, 0u);
+
+  // Existing files are replaced, a directory where a file goes conflicts
+  std::filesystem::create_directories(dir_path + "/clash");
+  std::ofstream(dir_path + "/a.txt") << "old";
+  fs::WritePlan plan = root.plan();
+  EXPECT_EQ(plan.existing_files, 1u);
+  ASSERT_EQ(plan.conflicts.size(), 1u);
+  EXPECT_EQ(std::filesystem::path(plan.conflicts[0]).filename(), "clash");
+
+  // Preflight writes as usual when the tree fits
+  options.dry_run = false;
+  options.preflight = true;
+  std::filesystem::remove_all(dir_path);
+  report = root.write_to_disk(options);
+  EXPECT_EQ(report.files_written, 3u);
+  EXPECT_EQ(report.plan.files, 3u);
+
+  // ...and refuses to start when it does not
+  fs::FillSpec huge;
+  huge.size = std::uint64_t{1} << 62;
+  huge.pattern = "x";
+  root.add_file(fs::File(fs::Path(dir_path + "/huge.bin"), huge));
+  std::filesystem::remove_all(dir_path);
+  EXPECT_THROW(root.write_to_disk(options), std::runtime_error);
+  EXPECT_FALSE(std::filesystem::exists(dir_path));
+}
+
+TEST_F(FsTest, TransactionalWriteReplacesTree) {
+  std::filesystem::create_directories(test_dir);
+  std::string dir_path = test_dir + "/transactional";
+
+  std::filesystem::create_directories(dir_path);
+  {
+    std::ofstream old_file(dir_path + "/old.txt");
+    old_file << "old";
+  }
+
+  fs::Dir root(dir_path);
+  fs::Dir sub(dir_path + "/sub");
+  sub.add_file(fs::File(dir_path + "/sub/a.txt", "a"));
+  root.add_subdir(std::move(sub));
+  root.add_file(fs::File(dir_path + "/b.txt", "b"));
+
+  fs::WriteOptions options;
+  options.transactional = true;
+  fs::WriteReport report = root.write_to_disk(options);
+
+  EXPECT_EQ(report.files_written, 2u);
+  EXPECT_EQ(read_file(dir_path + "/sub/a.txt"), "a");
+  EXPECT_EQ(read_file(dir_path + "/b.txt"), "b");
+  EXPECT_FALSE(file_exists(dir_path + "/old.txt"));
+  // Nothing is left next to the destination
+  EXPECT_EQ(std::distance(std::filesystem::directory_iterator(test_dir),
+                          std::filesystem::directory_iterator{}),
+            1);
+}
+
+TEST_F(FsTest, TransactionalWriteRollsBackOnError) {
+  std::filesystem::create_directories(test_dir);
+  std::string dir_path = test_dir + "/transactional";
+
+  std::filesystem::create_directories(dir_path);
+  {
+    std::ofstream old_file(dir_path + "/old.txt");
+    old_file << "old";
+  }
+
+  fs::Dir root(dir_path);
+  root.add_file(fs::File(dir_path + "/good.txt", "good"));
+  root.add_file(fs::File(fs::Path(dir_path + "/broken.txt"),
+                         fs::ContentProducer([](char *, std::size_t) -> std::size_t {
+                           throw std::runtime_error("producer failed");
+                         })));
+
+  fs::WriteOptions options;
+  options.transactional = true;
+  EXPECT_THROW(root.write_to_disk(options), std::runtime_error);
+
+  EXPECT_EQ(read_file(dir_path + "/old.txt"), "old");
+  EXPECT_FALSE(file_exists(dir_path + "/good.txt"));
+  EXPECT_EQ(std::distance(std::filesystem::directory_iterator(test_dir),
+                          std::filesystem::directory_iterator{}),
+            1);
+}
+
+// ============================================================================
+// Tree Tests
+// ============================================================================
+
+TEST_F(FsTest, TreeInternsNameComponents) {
+  auto tree = fs::Tree::create();
+  std::string dir_path = test_dir + "/tree";
+
+  fs::Dir root = tree->create_dir(fs::Path(dir_path));
+  for (int d = 0; d < 100; ++d) {
+    std::string sub_path = dir_path + "/module" + std::to_string(d);
+    fs::Dir sub = tree->create_dir(fs::Path(sub_path));
+    sub.add_file(tree->create_file(fs::Path(sub_path + "/CMakeLists.txt"),
+                                   fs::Content()));
+    sub.add_file(tree->create_file(fs::Path(sub_path + "/README.md"),
+                                   fs::Content()));
+    root.add_subdir(std::move(sub));
+  }
+
+  EXPECT_EQ(tree->node_count(), 301u);
+  // 100 module names plus the two shared file names
+  EXPECT_EQ(tree->name_count(), 102u);
+  EXPECT_EQ(root.get_subdirs().size(), 100u);
+
+  fs::Dir module = root.get_subdirs()[42];
+  EXPECT_EQ(module.get_path().to_string(), dir_path + "/module42");
+  EXPECT_EQ(module.get_files()[1].get_path().to_string(),
+            dir_path + "/module42/README.md");
+}
+
+TEST_F(FsTest, TreeReclaimsNodesNoViewReaches) {
+  auto tree = fs::Tree::create();
+  std::string dir_path = test_dir + "/reclaim";
+  auto content = std::make_shared<const std::string>(1 << 20, 'x');
+  std::weak_ptr<const std::string> released = content;
+
+  fs::Dir kept = tree->create_dir(fs::Path(dir_path + "/kept"));
+  kept.add_file(tree->create_file(fs::Path(dir_path + "/kept/a.txt"),
+                                  fs::Content(content)));
+  {
+    fs::Dir dropped = tree->create_dir(fs::Path(dir_path + "/dropped"));
+    for (int i = 0; i < 100; ++i) {
+      dropped.add_file(tree->create_file(
+          fs::Path(dir_path + "/dropped/" + std::to_string(i)),
+          fs::Content(std::make_shared<const std::string>(1 << 10, 'y'))));
+    }
+    dropped.add_file(tree->create_file(fs::Path(dir_path + "/dropped/big"),
+                                       std::move(content)));
+  }
+  EXPECT_EQ(tree->node_count(), 104u);
+
+  tree->collect();
+  EXPECT_EQ(tree->node_count(), 2u);
+  // Still used by the kept file
+  EXPECT_FALSE(released.expired());
+
+  fs::File file = kept.get_files()[0];
+  kept = fs::Dir(tree->create_dir(fs::Path(dir_path + "/other")));
+  tree->collect();
+  // The file view keeps its detached parent alive
+  EXPECT_EQ(tree->node_count(), 3u);
+  EXPECT_EQ(file.get_path().to_string(), dir_path + "/kept/a.txt");
+
+  file = tree->create_file(fs::Path(dir_path + "/b.txt"), fs::Content());
+  tree->collect();
+  EXPECT_TRUE(released.expired());
+  EXPECT_EQ(tree->node_count(), 2u);
+
+  // Freed slots are reused
+  for (int i = 0; i < 10; ++i) {
+    kept.add_file(tree->create_file(
+        fs::Path(dir_path + "/other/" + std::to_string(i)), fs::Content()));
+  }
+  tree->collect();
+  EXPECT_EQ(tree->node_count(), 12u);
+  kept.write_to_disk();
+  EXPECT_TRUE(std::filesystem::exists(dir_path + "/other/9"));
+}
+
+TEST_F(FsTest, TreeKeepsPathsOutsideParent) {
+  fs::Dir root(std::string("project"));
+  fs::Dir elsewhere(std::string("other/place"));
+  root.add_subdir(std::move(elsewhere));
+
+  EXPECT_EQ(root.get_subdirs()[0].get_path().to_string(), "other/place");
+}
+
+TEST_F(FsTest, TreeRejectsCycles) {
+  auto tree = fs::Tree::create();
+  fs::Dir parent = tree->create_dir(fs::Path(std::string("parent")));
+  fs::Dir child = tree->create_dir(fs::Path(std::string("parent/child")));
+  parent.add_subdir(fs::Dir(child));
+
+  EXPECT_THROW(child.add_subdir(fs::Dir(parent)), std::invalid_argument);
+  EXPECT_THROW(parent.add_subdir(fs::Dir(parent)), std::invalid_argument);
+}
+
+TEST_F(FsTest, TreeImportsForeignSubtree) {
+  std::filesystem::create_directories(test_dir);
+  std::string dir_path = test_dir + "/imported";
+
+  fs::Dir root(dir_path);
+  fs::Dir sub(dir_path + "/sub");
+  fs::Dir nested(dir_path + "/sub/nested");
+  nested.add_file(fs::File(dir_path + "/sub/nested/file.txt", "nested"));
+  sub.add_subdir(std::move(nested));
+
+  root.add_subdir(std::move(sub));
+  // The moved-in directory now views the copy owned by root's tree
+  EXPECT_EQ(sub.get_tree(), root.get_tree());
+  sub.add_file(fs::File(dir_path + "/sub/late.txt", "late"));
+
+  root.write_to_disk();
+
+  EXPECT_EQ(read_file(dir_path + "/sub/nested/file.txt"), "nested");
+  EXPECT_EQ(read_file(dir_path + "/sub/late.txt"), "late");
+}
+
+TEST_F(FsTest, TreeImportRelocatesSubtree) {
+  auto tree = fs::Tree::create();
+  std::string dir_path = test_dir + "/source";
+
+  fs::Dir root = tree->create_dir(fs::Path(dir_path));
+  // Deeper than a direct child: keeps a full path in the tree
+  root.add_file(tree->create_file(fs::Path(dir_path + "/a/b.txt"),
+                                  std::make_shared<const std::string>("b")));
+  root.add_file(tree->create_file(fs::Path(dir_path + "/c.txt"),
+                                  std::make_shared<const std::string>("c")));
+
+  auto copy = fs::Tree::create();
+  fs::Dir moved(copy, copy->import(*tree, root.get_id(), test_dir + "/moved"));
+  auto files = moved.get_files();
+  ASSERT_EQ(files.size(), 2u);
+  EXPECT_EQ(files[0].get_path().to_path(),
+            std::filesystem::path(test_dir + "/moved/a/b.txt"));
+  EXPECT_EQ(files[1].get_path().to_path(),
+            std::filesystem::path(test_dir + "/moved/c.txt"));
+
+  root.add_file(tree->create_file(fs::Path(test_dir + "/elsewhere.txt"),
+                                  std::make_shared<const std::string>("x")));
+  EXPECT_THROW(copy->import(*tree, root.get_id(), test_dir + "/moved"),
+               std::invalid_argument);
+}
+
+TEST_F(FsTest, FilledFilesAreGeneratedOnWrite) {
+  std::string dir_path = test_dir + "/filled";
+  const std::uint64_t size = 3 * 1024 * 1024 + 5;
+  fs::FillSpec fill;
+  fill.size = size;
+  fill.pattern = "abc";
+  // Unsorted and overlapping holes are merged
+  fill.holes = {{2 * 1024 * 1024, 4096}, {1024 * 1024, 8192}, {1024 * 1024 + 4096, 8192}};
+
+  for (auto backend : {fs::WriteBackend::Stream, fs::WriteBackend::IoUring,
+                       fs::WriteBackend::Openat}) {
+    std::filesystem::remove_all(dir_path);
+    fs::Dir root(dir_path);
+    root.add_file(fs::File(fs::Path(dir_path + "/data.bin"), fill));
+    fs::FillSpec empty;
+    empty.size = 1 << 20;
+    root.add_file(fs::File(fs::Path(dir_path + "/sparse.img"), empty));
+
+    fs::WriteOptions options;
+    options.backend = backend;
+    ASSERT_EQ(root.write_to_disk(options).errors, 0u);
+
+    std::string data = read_file(dir_path + "/data.bin");
+    ASSERT_EQ(data.size(), size);
+    for (std::uint64_t i : {std::uint64_t{0}, std::uint64_t{1}, size - 1,
+                            std::uint64_t{1024 * 1024 - 1},
+                            std::uint64_t{1024 * 1024 + 12288}}) {
+      EXPECT_EQ(data[i], "abc"[i % 3]) << i;
+    }
+    EXPECT_EQ(data[1024 * 1024], '\0');
+    EXPECT_EQ(data[1024 * 1024 + 12287], '\0');
+    EXPECT_EQ(data[2 * 1024 * 1024 + 4095], '\0');
+    EXPECT_EQ(std::filesystem::file_size(dir_path + "/sparse.img"), 1u << 20);
+  }
+
+  fs::FillSpec bad;
+  bad.size = 10;
+  bad.holes = {{8, 4}};
+  EXPECT_THROW(fs::File(fs::Path(dir_path + "/bad"), bad),
+               std::invalid_argument);
+
+  // Packs store the description, not the bytes
+  fs::Dir root(dir_path);
+  root.add_file(fs::File(fs::Path(dir_path + "/data.bin"), fill));
+  std::string pack_path = test_dir + "/fill.cdnpack";
+  fs::Pack::save(root, pack_path);
+  EXPECT_LT(std::filesystem::file_size(pack_path), 8192u);
+  fs::Dir copy = fs::Pack::open(pack_path).instantiate(fs::Path(test_dir + "/unpacked"));
+  copy.write_to_disk();
+  EXPECT_EQ(read_file(test_dir + "/unpacked/data.bin"), read_file(dir_path + "/data.bin"));
+}
+
+TEST_F(FsTest, CompressedContentsAreWrittenVerbatim) {
+  std::string dir_path = test_dir + "/compressed";
+  std::string text;
+  for (int i = 0; text.size() < 300 * 1024; ++i) {
+    text += "line " + std::to_string(i % 97) + ": lorem ipsum dolor sit amet\n";
+  }
+  std::string noise(100 * 1024, '\0');
+  std::uint32_t state = 12345;
+  for (char &c : noise) {
+    state = state * 1664525u + 1013904223u;
+    c = static_cast<char>(state >> 24);
+  }
+
+  for (auto backend : {fs::WriteBackend::Stream, fs::WriteBackend::IoUring,
+                       fs::WriteBackend::Openat}) {
+    std::filesystem::remove_all(dir_path);
+    auto tree = fs::Tree::create();
+    tree->set_compression_threshold(4096);
+    fs::Dir root = tree->create_dir(fs::Path(dir_path));
+    auto shared = std::make_shared<const std::string>(text);
+    fs::File a = tree->create_file(fs::Path(dir_path + "/a.txt"), shared);
+    fs::File b = tree->create_file(fs::Path(dir_path + "/b.txt"), shared);
+    fs::File small = tree->create_file(
+        fs::Path(dir_path + "/small.txt"),
+        std::make_shared<const std::string>("small"));
+    fs::File random = tree->create_file(
+        fs::Path(dir_path + "/random.bin"),
+        std::make_shared<const std::string>(noise));
+    for (fs::File *file : {&a, &b, &small, &random}) {
+      root.add_file(fs::File(*file));
+    }
+    EXPECT_TRUE(a.is_compressed());
+    EXPECT_EQ(a.get_size(), text.size());
+    EXPECT_TRUE(a.get_content().empty());
+    // Below the threshold, or not worth it
+    EXPECT_FALSE(small.is_compressed());
+    EXPECT_FALSE(random.is_compressed());
+    // The shared body is compressed once
+    EXPECT_EQ(tree->compressed_of(a.get_id()), tree->compressed_of(b.get_id()));
+
+    fs::WriteOptions options;
+    options.backend = backend;
+    options.incremental = true;
+    ASSERT_EQ(root.write_to_disk(options).errors, 0u);
+    EXPECT_EQ(read_file(dir_path + "/a.txt"), text);
+    EXPECT_EQ(read_file(dir_path + "/b.txt"), text);
+    EXPECT_EQ(read_file(dir_path + "/small.txt"), "small");
+    EXPECT_EQ(read_file(dir_path + "/random.bin"), noise);
+    // Compressed bodies keep the hash of their raw content
+    EXPECT_EQ(root.write_to_disk(options).files_unchanged, 4u);
+
+    // Touched since: compared with the disk, one frame at a time
+    auto touched = std::filesystem::last_write_time(dir_path + "/a.txt");
+    std::filesystem::last_write_time(dir_path + "/a.txt",
+                                     touched - std::chrono::hours(1));
+    {
+      std::fstream edited(dir_path + "/b.txt",
+                          std::ios::in | std::ios::out | std::ios::binary);
+      edited.seekp(-1, std::ios::end);
+      edited.put('!');
+    }
+    EXPECT_EQ(root.write_to_disk(options).files_unchanged, 3u);
+    EXPECT_EQ(read_file(dir_path + "/b.txt"), text);
+
+    // Packs store the raw bytes, once per shared body
+    std::string pack_path = test_dir + "/compressed.cdnpack";
+    fs::Pack::save(root, pack_path);
+    std::filesystem::remove_all(dir_path);
+    fs::Dir unpacked = fs::Pack::open(pack_path).instantiate();
+    ASSERT_EQ(unpacked.write_to_disk(fs::WriteOptions{}).errors, 0u);
+    EXPECT_EQ(read_file(dir_path + "/a.txt"), text);
+    EXPECT_EQ(read_file(dir_path + "/b.txt"), text);
+    EXPECT_EQ(read_file(dir_path + "/random.bin"), noise);
+    EXPECT_LT(std::filesystem::file_size(pack_path),
+              text.size() * 2 + noise.size());
+  }
+}
+
+TEST_F(FsTest, LinksAreWrittenAfterTargets) {
+  std::string dir_path = test_dir + "/linked";
+  fs::Dir root(dir_path);
+  auto tree = root.get_tree();
+
+  // Links come first in the tree, their targets are still written first
+  fs::Dir sub = tree->create_dir(fs::Path(dir_path + "/sub"));
+  fs::File file = tree->create_file(fs::Path(dir_path + "/sub/data.txt"),
+                                    std::make_shared<const std::string>("data"));
+  fs::Link hard = tree->create_hardlink(fs::Path(dir_path + "/hard.txt"),
+                                        file.get_id());
+  root.add_link(fs::Link(hard));
+  root.add_link(tree->create_symlink(fs::Path(dir_path + "/sub_link"),
+                                     sub.get_id()));
+  root.add_link(tree->create_symlink(fs::Path(dir_path + "/file_link"),
+                                     file.get_id()));
+  root.add_link(tree->create_symlink(fs::Path(dir_path + "/raw_link"),
+                                     "sub/data.txt"));
+  root.add_subdir(fs::Dir(sub));
+  sub.add_file(fs::File(file));
+
+  EXPECT_EQ(root.get_links().size(), 4u);
+  EXPECT_EQ(hard.get_target(), std::filesystem::path(dir_path + "/sub/data.txt")
+                                   .lexically_normal());
+  EXPECT_THROW(tree->create_hardlink(fs::Path(dir_path + "/bad"), sub.get_id()),
+               std::invalid_argument);
+
+  fs::WriteReport report = root.write_to_disk(fs::WriteOptions{});
+  EXPECT_EQ(report.links_written, 4u);
+  EXPECT_EQ(report.errors, 0u);
+
+  EXPECT_EQ(read_file(dir_path + "/hard.txt"), "data");
+  EXPECT_TRUE(std::filesystem::equivalent(dir_path + "/hard.txt",
+                                          dir_path + "/sub/data.txt"));
+  EXPECT_TRUE(std::filesystem::is_symlink(dir_path + "/sub_link"));
+  EXPECT_EQ(std::filesystem::read_symlink(dir_path + "/sub_link"), "sub");
+  EXPECT_EQ(read_file(dir_path + "/sub_link/data.txt"), "data");
+  EXPECT_EQ(std::filesystem::read_symlink(dir_path + "/file_link"),
+            "sub/data.txt");
+  EXPECT_EQ(read_file(dir_path + "/raw_link"), "data");
+
+  // Writing again replaces the links in place
+  report = root.write_to_disk(fs::WriteOptions{});
+  EXPECT_EQ(report.links_written, 4u);
+  EXPECT_EQ(report.errors, 0u);
+}
+
+TEST_F(FsTest, HardlinkReplacedByFileKeepsTargetIntact) {
+  std::string dir_path = test_dir + "/relinked";
+
+  for (auto backend : {fs::WriteBackend::Stream, fs::WriteBackend::IoUring,
+                       fs::WriteBackend::Openat}) {
+    std::filesystem::remove_all(dir_path);
+    fs::WriteOptions options;
+    options.backend = backend;
+
+    fs::Dir before(dir_path);
+    auto tree = before.get_tree();
+    fs::File a = tree->create_file(fs::Path(dir_path + "/a.txt"),
+                                   std::make_shared<const std::string>("X"));
+    before.add_file(fs::File(a));
+    before.add_link(
+        tree->create_hardlink(fs::Path(dir_path + "/b.txt"), a.get_id()));
+    ASSERT_EQ(before.write_to_disk(options).errors, 0u);
+
+    // b.txt still shares the inode of a.txt on disk
+    fs::Dir after(dir_path);
+    after.add_file(fs::File(dir_path + "/a.txt", "X"));
+    after.add_file(fs::File(dir_path + "/b.txt", "Y"));
+    EXPECT_EQ(after.write_to_disk(options).errors, 0u);
+    EXPECT_EQ(read_file(dir_path + "/a.txt"), "X");
+    EXPECT_EQ(read_file(dir_path + "/b.txt"), "Y");
+  }
+}
+
+TEST_F(FsTest, LinksFollowImportedTargets) {
+  std::string dir_path = test_dir + "/source";
+  fs::Dir source(dir_path);
+  auto tree = source.get_tree();
+  fs::File file = tree->create_file(fs::Path(dir_path + "/data.txt"),
+                                    std::make_shared<const std::string>("x"));
+  source.add_file(fs::File(file));
+  source.add_link(tree->create_hardlink(fs::Path(dir_path + "/hard.txt"),
+                                        file.get_id()));
+
+  // Relocating the sub-tree moves the hard link target along with it
+  std::string moved_path = test_dir + "/moved";
+  auto other = fs::Tree::create();
+  fs::Dir moved(other, other->import(*tree, source.get_id(),
+                                     std::filesystem::path(moved_path)));
+  ASSERT_EQ(moved.get_links().size(), 1u);
+  EXPECT_EQ(moved.get_links()[0].get_target(),
+            std::filesystem::path(moved_path + "/data.txt").lexically_normal());
+
+  moved.write_to_disk();
+  EXPECT_TRUE(std::filesystem::equivalent(moved_path + "/hard.txt",
+                                          moved_path + "/data.txt"));
+}
+
+TEST_F(FsTest, ImportFromDiskCopiesFiles) {
+  std::string source = test_dir + "/reference";
+  std::filesystem::create_directories(source + "/src/nested");
+  std::string big(200000, 'x');
+  {
+    std::ofstream(source + "/README.md") << "readme";
+    std::ofstream(source + "/src/main.cpp") << "int main() {}";
+    std::ofstream(source + "/src/nested/big.bin") << big;
+  }
+
+  fs::Dir root = fs::Dir::import_from_disk(fs::Path(source),
+                                           fs::Path(test_dir + "/copy"));
+  ASSERT_EQ(root.get_files().size(), 1u);
+  EXPECT_TRUE(root.get_files()[0].has_source());
+  EXPECT_TRUE(root.get_files()[0].get_content().empty());
+
+  // A patched file next to the imported ones
+  fs::Dir src = root.get_subdirs()[0];
+  src.add_file(fs::File(test_dir + "/copy/src/config.h", "#define PATCHED"));
+
+  for (auto backend : {fs::WriteBackend::Stream, fs::WriteBackend::Openat,
+                       fs::WriteBackend::IoUring}) {
+    std::filesystem::remove_all(test_dir + "/copy");
+    fs::WriteOptions options;
+    options.backend = backend;
+    fs::WriteReport report = root.write_to_disk(options);
+
+    EXPECT_EQ(report.errors, 0u);
+    EXPECT_EQ(read_file(test_dir + "/copy/README.md"), "readme");
+    EXPECT_EQ(read_file(test_dir + "/copy/src/main.cpp"), "int main() {}");
+    EXPECT_EQ(read_file(test_dir + "/copy/src/nested/big.bin"), big);
+    EXPECT_EQ(read_file(test_dir + "/copy/src/config.h"), "#define PATCHED");
+  }
+  // The sources are untouched
+  EXPECT_EQ(read_file(source + "/src/main.cpp"), "int main() {}");
+}
+
+TEST_F(FsTest, ImportFromDiskOntoItselfKeepsFiles) {
+  std::string source = test_dir + "/in_place";
+  std::filesystem::create_directories(source);
+  std::ofstream(source + "/file.txt") << "keep me";
+
+  fs::Dir root = fs::Dir::import_from_disk(fs::Path(source), fs::Path(source));
+  root.write_to_disk();
+  EXPECT_EQ(read_file(source + "/file.txt"), "keep me");
+
+  EXPECT_THROW(fs::Dir::import_from_disk(fs::Path(test_dir + "/missing"),
+                                         fs::Path(test_dir + "/copy")),
+               std::runtime_error);
+}
+
+// ============================================================================
+// Pack Tests
+// ============================================================================
+
+TEST_F(FsTest, PackRoundTrip) {
+  std::filesystem::create_directories(test_dir);
+  std::string dir_path = test_dir + "/packed";
+  std::string pack_path = test_dir + "/tree.cdnpack";
+
+  fs::ContentPool pool;
+  std::string license(10000, 'L');
+  fs::Dir root(dir_path);
+  for (int d = 0; d < 3; ++d) {
+    std::string sub_path = dir_path + "/module" + std::to_string(d);
+    fs::Dir sub(sub_path);
+    sub.add_file(fs::File(fs::Path(sub_path + "/LICENSE"), pool.intern(license)));
+    sub.add_file(fs::File(sub_path + "/id.txt", std::to_string(d)));
+    root.add_subdir(std::move(sub));
+  }
+  root.add_file(fs::File(dir_path + "/empty.txt", ""));
+  root.add_file(fs::File(dir_path + "/deep/er/file.txt", "deep"));
+  root.add_file(fs::File(fs::Path(dir_path + "/streamed.txt"),
+                         fs::ContentProducer(
+                             [done = false](char *buffer, std::size_t) mutable
+                             -> std::size_t {
+                               if (done) {
+                                 return 0;
+                               }
+                               done = true;
+                               buffer[0] = 'S';
+                               return 1;
+                             })));
+  auto tree = root.get_tree();
+  root.add_link(tree->create_symlink(
+      fs::Path(dir_path + "/current"),
+      root.get_subdirs()[0].get_id()));
+  root.add_link(tree->create_hardlink(
+      fs::Path(dir_path + "/LICENSE"),
+      root.get_subdirs()[1].get_files()[0].get_id()));
+  root.add_link(tree->create_symlink(fs::Path(dir_path + "/raw"), "/nowhere"));
+  fs::Pack::save(root, pack_path);
+
+  fs::Pack pack = fs::Pack::open(pack_path);
+  EXPECT_EQ(pack.node_count(), 16u);
+  EXPECT_EQ(pack.get_root_path().to_path(),
+            std::filesystem::path(dir_path).lexically_normal());
+  // The license is stored once
+  EXPECT_LT(std::filesystem::file_size(pack_path), 2 * license.size());
+
+  std::string copy_path = test_dir + "/copy";
+  fs::Dir copy = pack.instantiate(fs::Path(copy_path));
+  std::filesystem::create_directories(copy_path + "/deep/er");
+  copy.write_to_disk();
+
+  for (int d = 0; d < 3; ++d) {
+    std::string sub_path = copy_path + "/module" + std::to_string(d);
+    EXPECT_EQ(read_file(sub_path + "/LICENSE"), license);
+    EXPECT_EQ(read_file(sub_path + "/id.txt"), std::to_string(d));
+  }
+  EXPECT_TRUE(file_exists(copy_path + "/empty.txt"));
+  EXPECT_EQ(read_file(copy_path + "/deep/er/file.txt"), "deep");
+  EXPECT_EQ(read_file(copy_path + "/streamed.txt"), "S");
+  EXPECT_EQ(std::filesystem::read_symlink(copy_path + "/current"), "module0");
+  EXPECT_TRUE(std::filesystem::equivalent(copy_path + "/LICENSE",
+                                          copy_path + "/module1/LICENSE"));
+  EXPECT_EQ(std::filesystem::read_symlink(copy_path + "/raw"), "/nowhere");
+}
+
+TEST_F(FsTest, PackRejectsInvalidFiles) {
+  std::filesystem::create_directories(test_dir);
+  std::string pack_path = test_dir + "/bad.cdnpack";
+
+  EXPECT_THROW(fs::Pack::open(pack_path), std::runtime_error);
+  {
+    std::ofstream file(pack_path);
+    file << "not a pack";
+  }
+  EXPECT_THROW(fs::Pack::open(pack_path), std::runtime_error);
+
+  // Truncated right after the header
+  fs::Dir root(test_dir + "/packed");
+  root.add_file(fs::File(test_dir + "/packed/file.txt", "content"));
+  fs::Pack::save(root, pack_path);
+  std::filesystem::resize_file(pack_path, 80);
+  EXPECT_THROW(fs::Pack::open(pack_path), std::runtime_error);
+}
+
+TEST_F(FsTest, PackRejectsNamesEscapingTheRoot) {
+  std::filesystem::create_directories(test_dir);
+  std::string pack_path = test_dir + "/escape.cdnpack";
+  fs::Dir root(test_dir + "/packed");
+  root.add_file(fs::File(test_dir + "/packed/xxxxxxxxx", "content"));
+
+  // Same length as the stored name, so that only the bytes change
+  for (std::string name : {"../escape", "/tmp/evil", "a/../../b", "a//b12345"}) {
+    fs::Pack::save(root, pack_path);
+    std::string bytes;
+    {
+      std::ifstream file(pack_path, std::ios::binary);
+      bytes.assign(std::istreambuf_iterator<char>(file), {});
+    }
+    std::size_t at = bytes.find("xxxxxxxxx");
+    ASSERT_NE(at, std::string::npos);
+    bytes.replace(at, name.size(), name);
+    std::ofstream(pack_path, std::ios::binary | std::ios::trunc) << bytes;
+
+    EXPECT_THROW(fs::Pack::open(pack_path), std::runtime_error) << name;
+  }
+  EXPECT_FALSE(std::filesystem::exists(test_dir + "/escape"));
+}
+
+TEST_F(FsTest, MovedStringContentIsNotCopied) {
+  std::string body(64 * 1024, 'x');
+  const char *data = body.data();
+  fs::File file(test_dir + "/moved.txt", std::move(body));
+  EXPECT_EQ(file.get_content().data(), data);
+  EXPECT_EQ(file.get_size(), 64u * 1024u);
+}
+
 } // namespace fs_test
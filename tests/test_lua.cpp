@@ -1,7 +1,12 @@
+#include "../include/daemon.h"
+#include "../include/engine_pool.h"
 #include "../include/lua.h"
 #include <filesystem>
 #include <fstream>
 #include <gtest/gtest.h>
+#include <map>
+#include <sstream>
+#include <thread>
 
 namespace lua_test {
 
@@ -66,6 +71,173 @@ TEST_F(LuaTest, ExecuteFile) {
   EXPECT_NO_THROW({ lua.execute_file(test_lua_file); });
 }
 
+TEST_F(LuaTest, ExecuteFileUsesBytecodeCache) {
+  std::string cache_dir = test_dir + "/cache";
+  auto run = [&](const std::string &word) {
+    // Same size every time: only the content hash tells the versions apart
+    create_lua_file("local f = io.open(\"" + test_dir +
+                    "/out.txt\", \"w\")\nf:write(\"" + word +
+                    "\")\nf:close()\n");
+    Lua::LuaEngine lua;
+    lua.set_bytecode_cache(cache_dir);
+    lua.execute_file(test_lua_file);
+    return read_file(test_dir + "/out.txt");
+  };
+
+  EXPECT_EQ(run("one"), "one");
+  ASSERT_TRUE(std::filesystem::is_directory(cache_dir));
+  EXPECT_EQ(std::distance(std::filesystem::directory_iterator(cache_dir),
+                          std::filesystem::directory_iterator()),
+            1);
+  EXPECT_EQ(run("one"), "one");
+  EXPECT_EQ(run("two"), "two");
+
+  Lua::LuaEngine lua;
+  lua.set_bytecode_cache(cache_dir);
+  create_lua_file("this is not lua");
+  EXPECT_THROW({ lua.execute_file(test_lua_file); }, std::exception);
+}
+
+TEST_F(LuaTest, ExecuteChunkAcceptsSourceAndBytecode) {
+  std::string chunk_path = test_dir + "/chunk.luac";
+  std::string out_path = test_dir + "/out.txt";
+  Lua::LuaEngine compiler;
+  compiler.execute_string(
+      "local f = io.open(\"" + chunk_path + "\", \"wb\")\n"
+      "f:write(string.dump(load([[local f = io.open(\"" +
+      out_path + "\", \"w\") f:write(\"bytecode\") f:close()]])))\n"
+      "f:close()\n");
+  std::string bytecode = read_file(chunk_path);
+  ASSERT_FALSE(bytecode.empty());
+
+  Lua::LuaEngine lua;
+  EXPECT_NO_THROW({ lua.execute_chunk(bytecode, "chunk.luac"); });
+  EXPECT_EQ(read_file(out_path), "bytecode");
+  EXPECT_NO_THROW({ lua.execute_chunk("x = 1", "source.lua"); });
+  EXPECT_THROW({ lua.execute_chunk("x = ", "broken.lua"); }, std::exception);
+}
+
+TEST_F(LuaTest, GeneratorIdiomsRunOnEveryBackend) {
+  Lua::LuaEngine lua;
+  std::string out_path = test_dir + "/generated.c";
+
+  // String building and loops as found in heavy presets, restricted to what
+  // Lua 5.4 and LuaJIT (5.1 semantics) both accept
+  std::string script = R"(
+    local parts = {}
+    for i = 1, 2000 do
+      parts[#parts + 1] = string.format("int f%d(void) { return %d; }", i, i * 2)
+    end
+    local dir = cdirnuts.create_virtual_dir(")" +
+                       test_dir + R"(")
+    local file = cdirnuts.create_virtual_file(")" + out_path +
+                       R"(", table.concat(parts, "
+") .. "
+")
+    cdirnuts.append_file(dir, file)
+    local result = cdirnuts.write_virtual_dir(dir, { jobs = 2 })
+    assert(result.written == 1)
+  )";
+#ifdef LUAJIT_VERSION
+  script += "assert(jit and jit.status(), 'the JIT compiler should be on')\n";
+#endif
+
+  EXPECT_NO_THROW({ lua.execute_string(script); });
+  std::string generated = read_file(out_path);
+  EXPECT_TRUE(generated.starts_with("int f1(void) { return 2; }\n"));
+  EXPECT_TRUE(generated.ends_with("int f2000(void) { return 4000; }\n"));
+}
+
+TEST_F(LuaTest, EnginePoolRunsJobsInIsolation) {
+  auto write_script = [&](const std::string &name, const std::string &body) {
+    std::string path = test_dir + "/" + name + ".lua";
+    std::ofstream(path) << body;
+    return Lua::Job{name, path};
+  };
+  // Each job must see a fresh state: the global is never already set
+  std::string isolated = "assert(seen == nil)\nseen = true\nprint('hello', 42)\n";
+  std::vector<Lua::Job> jobs;
+  for (int i = 0; i < 4; ++i) {
+    std::string root = test_dir + "/service" + std::to_string(i);
+    jobs.push_back(write_script(
+        "service" + std::to_string(i),
+        isolated + "local dir = cdirnuts.build_tree(\"" + root +
+            "\", { ['main.c'] = 'int main(void) { return " +
+            std::to_string(i) + "; }' })\ncdirnuts.write_virtual_dir(dir)\n"));
+  }
+  jobs.push_back(write_script("broken", "error('boom')"));
+
+  std::size_t done = 0;
+  Lua::EnginePool pool(2, [](Lua::LuaEngine &lua) {
+    fs::WriteOptions options;
+    options.jobs = 2;
+    lua.set_write_options(options);
+  });
+  auto results = pool.run(jobs, [&](const Lua::JobResult &) { ++done; });
+
+  ASSERT_EQ(results.size(), 5u);
+  EXPECT_EQ(done, 5u);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(results[static_cast<std::size_t>(i)].name,
+              "service" + std::to_string(i));
+    EXPECT_TRUE(results[static_cast<std::size_t>(i)].ok)
+        << results[static_cast<std::size_t>(i)].error;
+    EXPECT_EQ(results[static_cast<std::size_t>(i)].output, "hello\t42\n");
+    EXPECT_EQ(results[static_cast<std::size_t>(i)].files_written, 1u);
+    EXPECT_EQ(read_file(test_dir + "/service" + std::to_string(i) + "/main.c"),
+              "int main(void) { return " + std::to_string(i) + "; }");
+  }
+  EXPECT_FALSE(results[4].ok);
+  EXPECT_NE(results[4].error.find("boom"), std::string::npos);
+}
+
+TEST_F(LuaTest, DaemonServesRequestsFromTheClientDirectory) {
+  std::string work_dir = test_dir + "/client";
+  std::filesystem::create_directories(work_dir);
+  std::ofstream(work_dir + "/config.lua")
+      << "print('from ' .. cdirnuts.getCWD())\n"
+         "cdirnuts.write_virtual_dir(cdirnuts.build_tree('out', { a = 'a' }))\n";
+  std::ofstream(work_dir + "/broken.lua") << "error('boom')";
+
+  // Relative, to stay under the socket path length limit
+  std::string socket_path = test_dir + "/daemon.sock";
+  Lua::Daemon daemon(socket_path, 1, {},
+                     [&](const std::string &name) -> std::optional<std::string> {
+                       if (name == "config") {
+                         return "config.lua";
+                       }
+                       return std::nullopt;
+                     });
+  std::thread server([&]() { daemon.serve(); });
+  for (int i = 0; i < 200 && !std::filesystem::exists(socket_path); ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  std::string cwd = std::filesystem::absolute(work_dir).string();
+  for (int i = 0; i < 3; ++i) {
+    std::ostringstream out, err;
+    EXPECT_EQ(Lua::send_request(socket_path, {cwd, cwd + "/config.lua", ""},
+                                out, err),
+              0)
+        << err.str();
+    EXPECT_EQ(out.str(), "from " + cwd + "\n");
+  }
+  std::ostringstream out, err;
+  EXPECT_EQ(Lua::send_request(socket_path, {cwd, "", "config"}, out, err), 0);
+  EXPECT_EQ(Lua::send_request(socket_path, {cwd, "", "missing"}, out, err), 1);
+  EXPECT_EQ(Lua::send_request(socket_path, {cwd, cwd + "/broken.lua", ""},
+                              out, err),
+            1);
+  EXPECT_NE(err.str().find("boom"), std::string::npos);
+  EXPECT_EQ(read_file(work_dir + "/out/a"), "a");
+
+  daemon.stop();
+  server.join();
+  EXPECT_FALSE(std::filesystem::exists(socket_path));
+  EXPECT_THROW(Lua::send_request(socket_path, {cwd, "x", ""}, out, err),
+               std::runtime_error);
+}
+
 TEST_F(LuaTest, ExecuteNonExistentFile) {
   Lua::LuaEngine lua;
 
@@ -237,6 +409,417 @@ TEST_F(LuaTest, ApiMultipleFiles) {
   }
 }
 
+TEST_F(LuaTest, ApiWriteVirtualDirWithJobs) {
+  Lua::LuaEngine lua;
+
+  std::string script = R"(
+    local dir = cdirnuts.create_virtual_dir(")" +
+                       test_dir + R"(/jobs")
+
+    for i = 1, 20 do
+      local sub = cdirnuts.create_virtual_dir(")" +
+                       test_dir + R"(/jobs/sub" .. i)
+      local file = cdirnuts.create_virtual_file(")" +
+                       test_dir +
+                       R"(/jobs/sub" .. i .. "/file.txt", "Content " .. i)
+      cdirnuts.append_file(sub, file)
+      cdirnuts.append_subdir(dir, sub)
+    end
+
+    cdirnuts.write_virtual_dir(dir, { jobs = 4 })
+  )";
+
+  EXPECT_NO_THROW({ lua.execute_string(script); });
+
+  for (int i = 1; i <= 20; ++i) {
+    std::string filename =
+        test_dir + "/jobs/sub" + std::to_string(i) + "/file.txt";
+    EXPECT_EQ(read_file(filename), "Content " + std::to_string(i));
+  }
+}
+
+TEST_F(LuaTest, ApiWriteVirtualDirRejectsBadJobs) {
+  Lua::LuaEngine lua;
+
+  std::string script = R"(
+    local dir = cdirnuts.create_virtual_dir(")" +
+                       test_dir + R"(/bad_jobs")
+    cdirnuts.write_virtual_dir(dir, -1)
+  )";
+
+  EXPECT_THROW({ lua.execute_string(script); }, std::exception);
+}
+
+TEST_F(LuaTest, ApiWriteVirtualDirWithDedup) {
+  Lua::LuaEngine lua;
+
+  std::string script = R"(
+    local dir = cdirnuts.create_virtual_dir(")" +
+                       test_dir + R"(/dedup")
+    local license = string.rep("license text\n", 1000)
+
+    for i = 1, 5 do
+      local file = cdirnuts.create_virtual_file(")" +
+                       test_dir + R"(/dedup/LICENSE" .. i, license)
+      cdirnuts.append_file(dir, file)
+    end
+
+    cdirnuts.write_virtual_dir(dir, { dedup = "reflink" })
+  )";
+
+  EXPECT_NO_THROW({ lua.execute_string(script); });
+
+  std::string license;
+  for (int i = 0; i < 1000; ++i) {
+    license += "license text\n";
+  }
+  for (int i = 1; i <= 5; ++i) {
+    EXPECT_EQ(read_file(test_dir + "/dedup/LICENSE" + std::to_string(i)),
+              license);
+  }
+}
+
+TEST_F(LuaTest, ApiImportDir) {
+  Lua::LuaEngine lua;
+  std::filesystem::create_directories(test_dir + "/reference/sub");
+  std::ofstream(test_dir + "/reference/sub/file.txt") << "reference";
+
+  std::string script = R"(
+    local dir = cdirnuts.import_dir(")" +
+                       test_dir + R"(/reference", ")" + test_dir + R"(/copy")
+    cdirnuts.write_virtual_dir(dir)
+  )";
+
+  EXPECT_NO_THROW({ lua.execute_string(script); });
+  EXPECT_EQ(read_file(test_dir + "/copy/sub/file.txt"), "reference");
+}
+
+TEST_F(LuaTest, ApiPlanVirtualDir) {
+  Lua::LuaEngine lua;
+
+  std::string script = R"(
+    local dir = cdirnuts.create_virtual_dir(")" +
+                       test_dir + R"(/planned")
+    cdirnuts.append_file(dir, cdirnuts.create_virtual_file(")" +
+                       test_dir + R"(/planned/a.txt", "abc"))
+    local plan = cdirnuts.plan_virtual_dir(dir)
+    assert(plan.files == 1 and plan.bytes == 3 and plan.fits)
+    local report = cdirnuts.write_virtual_dir(dir, { dry_run = true })
+    assert(report.written == 0 and report.plan.dirs == 1)
+  )";
+
+  EXPECT_NO_THROW({ lua.execute_string(script); });
+  EXPECT_FALSE(std::filesystem::exists(test_dir + "/planned"));
+}
+
+TEST_F(LuaTest, ApiSetCompression) {
+  Lua::LuaEngine lua;
+
+  std::string script = R"(
+    cdirnuts.set_compression(1024)
+    local dir = cdirnuts.create_virtual_dir(")" +
+                       test_dir + R"(/compressed")
+    cdirnuts.append_file(dir, cdirnuts.create_virtual_file(")" +
+                       test_dir + R"(/compressed/big.txt", string.rep("abcd", 4096)))
+    cdirnuts.write_virtual_dir(dir)
+  )";
+
+  EXPECT_NO_THROW({ lua.execute_string(script); });
+  EXPECT_EQ(read_file(test_dir + "/compressed/big.txt"),
+            [] {
+              std::string expected;
+              for (int i = 0; i < 4096; ++i) {
+                expected += "abcd";
+              }
+              return expected;
+            }());
+}
+
+TEST_F(LuaTest, ApiCreateFilledFile) {
+  Lua::LuaEngine lua;
+
+  std::string script = R"(
+    local file = cdirnuts.create_virtual_file(")" +
+                       test_dir + R"(/filled.bin", {
+      size = 10, pattern = "ab", holes = { { 2, 2 } } })
+    cdirnuts.write_virtual_file(file)
+  )";
+
+  EXPECT_NO_THROW({ lua.execute_string(script); });
+  EXPECT_EQ(read_file(test_dir + "/filled.bin"),
+            std::string("ab\0\0ababab", 10));
+}
+
+TEST_F(LuaTest, ApiBuildTree) {
+  Lua::LuaEngine lua;
+  std::string root = test_dir + "/built";
+
+  std::string script = R"(
+    local root = ")" + root + R"("
+    local dir = cdirnuts.build_tree(root, {
+      ["README.md"] = "readme",
+      src = {
+        ["main.c"] = "int main(void) { return 0; }",
+        include = {},
+        data = { size = "1" },
+      },
+      ["big.bin"] = { size = 1e6, pattern = "x" },
+      cdirnuts.create_virtual_symlink(root .. "/link", "src/main.c"),
+    })
+    local result = cdirnuts.write_virtual_dir(dir)
+    assert(result.written == 4 and result.links == 1)
+
+    local ok = pcall(cdirnuts.build_tree, root, { ["a/b"] = "x" })
+    assert(not ok)
+    local cyclic = {}
+    cyclic.self = cyclic
+    ok = pcall(cdirnuts.build_tree, root, cyclic)
+    assert(not ok)
+  )";
+
+  EXPECT_NO_THROW({ lua.execute_string(script); });
+  EXPECT_EQ(read_file(root + "/README.md"), "readme");
+  EXPECT_EQ(read_file(root + "/src/main.c"), "int main(void) { return 0; }");
+  EXPECT_TRUE(std::filesystem::is_directory(root + "/src/include"));
+  EXPECT_EQ(read_file(root + "/src/data/size"), "1");
+  EXPECT_EQ(std::filesystem::file_size(root + "/big.bin"), 1000000u);
+  EXPECT_EQ(read_file(root + "/link"), "int main(void) { return 0; }");
+}
+
+TEST_F(LuaTest, ApiRender) {
+  Lua::LuaEngine lua;
+
+  std::string script = R"(
+    local template = [[
+project({{name}} VERSION {{version.major}}.{{version.minor}})
+{{#sources}}
+add_executable({{target}} {{file}})
+{{/sources}}
+{{^tests}}
+# no tests
+{{/tests}}
+]]
+    local vars = {
+      name = "demo",
+      version = { major = 1, minor = 2 },
+      sources = { { target = "a", file = "a.c" }, { target = "b", file = "b.c" } },
+      tests = {},
+    }
+    local expected = "project(demo VERSION 1.2)\n" ..
+                     "add_executable(a a.c)\nadd_executable(b b.c)\n# no tests\n"
+    assert(cdirnuts.render(template, vars) == expected)
+    assert(cdirnuts.render(template, vars) == expected)
+    assert(cdirnuts.render("{{#items}}{{.}},{{/items}}", { items = { 1, "x" } }) == "1,x,")
+    assert(not pcall(cdirnuts.render, "{{#open}}", {}))
+  )";
+
+  EXPECT_NO_THROW({ lua.execute_string(script); });
+}
+
+TEST_F(LuaTest, ProfilerReportsFunctionsAndBindings) {
+  Lua::LuaEngine lua;
+  lua.enable_profiler();
+
+  std::string script = R"(
+    function build_line(i)
+      return cdirnuts.render("line {{i}}\n", { i = i })
+    end
+    function fails() error("caught") end
+    local lines = {}
+    for i = 1, 100 do
+      lines[#lines + 1] = build_line(i)
+      pcall(fails)
+      -- A new closure each time, one row for all of them
+      local closure = function() return i end
+      closure()
+    end
+    assert(#table.concat(lines) > 0)
+  )";
+  ASSERT_NO_THROW({ lua.execute_string(script); });
+
+  ASSERT_NE(lua.profiler(), nullptr);
+  std::map<std::string, Lua::Profiler::FunctionStats> stats;
+  std::size_t closure_rows = 0;
+  for (const auto &function : lua.profiler()->report()) {
+    std::string name = function.name.substr(0, function.name.find(' '));
+    closure_rows += name == "closure" ? 1 : 0;
+    stats[name] = function;
+  }
+  EXPECT_EQ(closure_rows, 1u);
+  EXPECT_EQ(stats["closure"].calls, 100u);
+  EXPECT_EQ(stats["build_line"].calls, 100u);
+  EXPECT_EQ(stats["fails"].calls, 100u);
+  EXPECT_EQ(stats["cdirnuts.render"].calls, 100u);
+  EXPECT_GE(stats["build_line"].total_seconds,
+            stats["cdirnuts.render"].total_seconds);
+  EXPECT_GE(stats["main"].total_seconds, stats["build_line"].total_seconds);
+
+  std::ostringstream collapsed;
+  lua.profiler()->write_collapsed(collapsed);
+  EXPECT_NE(collapsed.str().find("main chunk"), std::string::npos);
+  EXPECT_NE(collapsed.str().find(";build_line ("), std::string::npos);
+}
+
+TEST_F(LuaTest, ApiRunCommands) {
+  Lua::LuaEngine lua;
+  lua.set_assume_yes(true);
+
+  std::string script = R"(
+    local results, ok = cdirnuts.run_commands({
+      { name = "greet", command = "echo hello" },
+      { name = "fail", command = "exit 2", after = { "greet" } },
+      { name = "never", command = "echo never", after = { "fail" } },
+      "echo independent",
+    }, { parallel = 2 })
+    assert(not ok)
+    assert(results[1].status == "ok" and results[1].stdout == "hello\n")
+    assert(results[2].status == "failed" and results[2].exit_code == 2)
+    assert(results[3].status == "skipped")
+    assert(results[4].name == "echo independent" and results[4].status == "ok")
+    assert(not pcall(cdirnuts.run_commands, {
+      { name = "a", command = "true", after = { "b" } },
+      { name = "b", command = "true", after = { "a" } },
+    }))
+  )";
+
+  EXPECT_NO_THROW({ lua.execute_string(script); });
+}
+
+TEST_F(LuaTest, ScriptsCannotSkipTheCommandPrompt) {
+  Lua::LuaEngine lua;
+  // Fails instead of reading stdin
+  lua.set_interactive(false);
+
+  std::string script = R"(
+    local ok, message = pcall(cdirnuts.run_commands,
+                              { "echo hello" }, { confirm = false })
+    assert(not ok and message:find("--yes", 1, true))
+    assert(not pcall(cdirnuts.execute_shell_command, "echo hello"))
+  )";
+
+  EXPECT_NO_THROW({ lua.execute_string(script); });
+}
+
+TEST_F(LuaTest, ApiCreateLinks) {
+  Lua::LuaEngine lua;
+
+  std::string script = R"(
+    local root = cdirnuts.create_virtual_dir(")" +
+                       test_dir + R"(/linked")
+    local file = cdirnuts.create_virtual_file(")" +
+                       test_dir + R"(/linked/data.txt", "data")
+    cdirnuts.append_link(root, cdirnuts.create_virtual_hardlink(")" +
+                       test_dir + R"(/linked/hard.txt", file))
+    cdirnuts.append_link(root, cdirnuts.create_virtual_symlink(")" +
+                       test_dir + R"(/linked/soft.txt", file))
+    cdirnuts.append_link(root, cdirnuts.create_virtual_symlink(")" +
+                       test_dir + R"(/linked/raw", "data.txt"))
+    cdirnuts.append_file(root, file)
+    local result = cdirnuts.write_virtual_dir(root)
+    assert(result.links == 3)
+  )";
+
+  EXPECT_NO_THROW({ lua.execute_string(script); });
+  EXPECT_TRUE(std::filesystem::equivalent(test_dir + "/linked/hard.txt",
+                                          test_dir + "/linked/data.txt"));
+  EXPECT_EQ(std::filesystem::read_symlink(test_dir + "/linked/soft.txt"),
+            "data.txt");
+  EXPECT_EQ(read_file(test_dir + "/linked/raw"), "data");
+}
+
+TEST_F(LuaTest, ApiSaveAndLoadPack) {
+  Lua::LuaEngine lua;
+
+  std::string script = R"(
+    local dir = cdirnuts.create_virtual_dir(")" +
+                       test_dir + R"(/original")
+    cdirnuts.append_file(dir, cdirnuts.create_virtual_file(")" +
+                       test_dir + R"(/original/a.txt", "a"))
+    cdirnuts.save_pack(dir, ")" + test_dir + R"(/tree.cdnpack")
+
+    local copy = cdirnuts.load_pack(")" + test_dir + R"(/tree.cdnpack", ")" +
+                       test_dir + R"(/copy")
+    cdirnuts.write_virtual_dir(copy)
+  )";
+
+  EXPECT_NO_THROW({ lua.execute_string(script); });
+  EXPECT_EQ(read_file(test_dir + "/copy/a.txt"), "a");
+  EXPECT_FALSE(file_exists(test_dir + "/original"));
+}
+
+TEST_F(LuaTest, ApiWriteVirtualDirIncremental) {
+  Lua::LuaEngine lua;
+
+  std::string script = R"(
+    local function build()
+      local dir = cdirnuts.create_virtual_dir(")" +
+                       test_dir + R"(/incremental")
+      local file = cdirnuts.create_virtual_file(")" +
+                       test_dir + R"(/incremental/a.txt", "a")
+      cdirnuts.append_file(dir, file)
+      return dir
+    end
+
+    local first = cdirnuts.write_virtual_dir(build(), { incremental = true })
+    assert(first.written == 1 and first.unchanged == 0)
+
+    local second = cdirnuts.write_virtual_dir(build(), { incremental = true })
+    assert(second.written == 0 and second.unchanged == 1)
+    assert(#second.stale == 0)
+  )";
+
+  EXPECT_NO_THROW({ lua.execute_string(script); });
+  EXPECT_EQ(read_file(test_dir + "/incremental/a.txt"), "a");
+}
+
+TEST_F(LuaTest, ApiWriteVirtualDirTransactionalRollsBack) {
+  Lua::LuaEngine lua;
+
+  std::string script = R"(
+    local dir = cdirnuts.create_virtual_dir(")" +
+                       test_dir + R"(/transactional")
+    cdirnuts.append_file(dir, cdirnuts.create_virtual_file(")" +
+                       test_dir + R"(/transactional/good.txt", "good"))
+    cdirnuts.append_file(dir, cdirnuts.create_virtual_file(")" +
+                       test_dir + R"(/transactional/bad.txt", function()
+      error("generator failed")
+    end))
+    cdirnuts.write_virtual_dir(dir, { transactional = true })
+  )";
+
+  EXPECT_THROW({ lua.execute_string(script); }, std::exception);
+  EXPECT_FALSE(file_exists(test_dir + "/transactional"));
+}
+
+TEST_F(LuaTest, ApiCreateVirtualFileFromProducer) {
+  Lua::LuaEngine lua;
+
+  std::string script = R"(
+    local producer = coroutine.wrap(function()
+      for i = 1, 3 do
+        coroutine.yield("line " .. i .. "\n")
+      end
+      return nil
+    end)
+
+    local file = cdirnuts.create_virtual_file(")" +
+                       test_dir + R"(/streamed.txt", producer)
+    cdirnuts.write_virtual_file(file)
+  )";
+
+  EXPECT_NO_THROW({ lua.execute_string(script); });
+
+  EXPECT_EQ(read_file(test_dir + "/streamed.txt"), "line 1\nline 2\nline 3\n");
+}
+
+TEST_F(LuaTest, ApiCreateVirtualFileRejectsBadContent) {
+  Lua::LuaEngine lua;
+
+  EXPECT_THROW(
+      { lua.execute_string(R"(cdirnuts.create_virtual_file("x.txt", {}))"); },
+      std::exception);
+}
+
 TEST_F(LuaTest, LuaStandardLibraries) {
   Lua::LuaEngine lua;
 
@@ -283,4 +866,41 @@ TEST_F(LuaTest, MultipleExecutions) {
   });
 }
 
+TEST_F(LuaTest, ApiLargeStringContentSurvivesCollection) {
+  Lua::LuaEngine lua;
+
+  std::string script = R"(
+    local dir = cdirnuts.create_virtual_dir(")" +
+                       test_dir + R"(/borrowed")
+    for i = 1, 4 do
+      cdirnuts.append_file(dir, cdirnuts.create_virtual_file(")" +
+                       test_dir + R"(/borrowed/" .. i .. ".txt", string.rep(tostring(i), 8192)))
+    end
+    collectgarbage()
+    cdirnuts.write_virtual_dir(dir)
+  )";
+
+  EXPECT_NO_THROW({ lua.execute_string(script); });
+  EXPECT_EQ(read_file(test_dir + "/borrowed/3.txt"), std::string(8192, '3'));
+}
+
+TEST_F(LuaTest, ApiLargeStringContentUnpinnedWhenDropped) {
+  Lua::LuaEngine lua;
+
+  lua.execute_string(R"(
+    dir = cdirnuts.create_virtual_dir(")" +
+                     test_dir + R"(/unpinned")
+    for i = 1, 4 do
+      cdirnuts.append_file(dir, cdirnuts.create_virtual_file(")" +
+                     test_dir + R"(/unpinned/" .. i .. ".txt", string.rep(tostring(i), 8192)))
+    end
+    cdirnuts.write_virtual_dir(dir)
+  )");
+  EXPECT_EQ(lua.pinned_strings(), 4u);
+
+  lua.execute_string("dir = nil collectgarbage()");
+  EXPECT_EQ(lua.pinned_strings(), 0u);
+  EXPECT_EQ(read_file(test_dir + "/unpinned/4.txt"), std::string(8192, '4'));
+}
+
 } // namespace lua_test
@@ -0,0 +1,123 @@
+#include "../include/process_graph.h"
+#include <chrono>
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+namespace process_test {
+
+using Process::Command;
+using Process::ProcessGraph;
+using Status = Process::Result::Status;
+
+Command command(std::string name, std::string line,
+                std::vector<std::string> after = {}) {
+  Command result;
+  result.name = std::move(name);
+  result.command = std::move(line);
+  result.after = std::move(after);
+  return result;
+}
+
+TEST(ProcessGraphTest, RunsAfterDependenciesAndCapturesOutput) {
+  // Added before its dependency: order comes from `after` only
+  Command read = command("second", "cat first.txt; echo oops >&2", {"first"});
+  read.cwd = ::testing::TempDir();
+  Command write = command("first", "echo hello > first.txt");
+  write.cwd = ::testing::TempDir();
+
+  ProcessGraph graph;
+  graph.add(read);
+  graph.add(write);
+
+  auto results = graph.run(4);
+  ASSERT_EQ(results.size(), 2u);
+  EXPECT_EQ(results[0].name, "second");
+  EXPECT_EQ(results[0].status, Status::Succeeded);
+  EXPECT_EQ(results[0].exit_code, 0);
+  EXPECT_EQ(results[0].output, "hello\n");
+  EXPECT_EQ(results[0].errors, "oops\n");
+  EXPECT_EQ(results[1].status, Status::Succeeded);
+}
+
+TEST(ProcessGraphTest, FailureSkipsDependents) {
+  ProcessGraph graph;
+  graph.add(command("fails", "exit 3"));
+  graph.add(command("child", "echo child", {"fails"}));
+  graph.add(command("grandchild", "echo grandchild", {"child"}));
+  graph.add(command("", "echo independent"));
+
+  auto results = graph.run(0);
+  EXPECT_EQ(results[0].status, Status::Failed);
+  EXPECT_EQ(results[0].exit_code, 3);
+  EXPECT_EQ(results[1].status, Status::Skipped);
+  EXPECT_EQ(results[2].status, Status::Skipped);
+  EXPECT_EQ(results[2].output, "");
+  EXPECT_EQ(results[3].name, "echo independent");
+  EXPECT_EQ(results[3].status, Status::Succeeded);
+  EXPECT_STREQ(Process::to_string(results[1].status), "skipped");
+}
+
+TEST(ProcessGraphTest, RunsIndependentCommandsConcurrently) {
+  ProcessGraph graph;
+  for (int i = 0; i < 4; ++i) {
+    graph.add(command("sleep" + std::to_string(i), "sleep 0.3"));
+  }
+  auto start = std::chrono::steady_clock::now();
+  auto results = graph.run(4);
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  for (const auto &result : results) {
+    EXPECT_EQ(result.status, Status::Succeeded);
+    EXPECT_GE(result.seconds, 0.25);
+  }
+  EXPECT_LT(seconds, 1.0);
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+TEST(ProcessGraphTest, StdinInheritedUnlessCapturing) {
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  ASSERT_EQ(write(fds[1], "yes\n", 4), 4);
+  close(fds[1]);
+  int saved = dup(STDIN_FILENO);
+  dup2(fds[0], STDIN_FILENO);
+  close(fds[0]);
+
+  ProcessGraph graph;
+  Command captured = command("captured", "! read answer");
+  graph.add(captured);
+  Command prompt = command("prompt", "read answer && test \"$answer\" = yes",
+                           {"captured"});
+  prompt.capture = false;
+  graph.add(prompt);
+  auto results = graph.run(1);
+
+  dup2(saved, STDIN_FILENO);
+  close(saved);
+  EXPECT_EQ(results[0].status, Status::Succeeded);
+  EXPECT_EQ(results[1].status, Status::Succeeded);
+}
+#endif
+
+TEST(ProcessGraphTest, RejectsBadGraphs) {
+  ProcessGraph graph;
+  graph.add(command("a", "true"));
+  EXPECT_THROW(graph.add(command("a", "false")), std::invalid_argument);
+
+  ProcessGraph unknown;
+  unknown.add(command("a", "true", {"missing"}));
+  EXPECT_THROW(unknown.run(1), std::invalid_argument);
+
+  ProcessGraph cycle;
+  cycle.add(command("a", "touch ran", {"b"}));
+  cycle.add(command("b", "true", {"a"}));
+  EXPECT_THROW(cycle.run(1), std::invalid_argument);
+}
+
+} // namespace process_test
@@ -0,0 +1,154 @@
+#include "../include/template.h"
+#include <gtest/gtest.h>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace template_test {
+
+// Minimal JSON-like value for rendering templates without Lua
+struct Value {
+  std::string text;
+  bool flag = true;
+  std::vector<Value> items;
+  std::map<std::string, Value, std::less<>> fields;
+  bool is_list = false;
+
+  static Value list(std::vector<Value> items) {
+    Value value;
+    value.items = std::move(items);
+    value.is_list = true;
+    return value;
+  }
+  static Value map(std::map<std::string, Value, std::less<>> fields) {
+    Value value;
+    value.fields = std::move(fields);
+    return value;
+  }
+  static Value boolean(bool flag) {
+    Value value;
+    value.flag = flag;
+    return value;
+  }
+};
+
+Value str(std::string text) {
+  Value value;
+  value.text = std::move(text);
+  return value;
+}
+
+class ValueContext : public Templates::Context {
+public:
+  explicit ValueContext(const Value &root) : sections_{&root} {}
+
+  bool push(std::string_view name) override {
+    if (name == ".") {
+      stack_.push_back(sections_.back());
+      return true;
+    }
+    std::string_view first = name.substr(0, name.find('.'));
+    for (auto it = sections_.rbegin(); it != sections_.rend(); ++it) {
+      auto field = (*it)->fields.find(first);
+      if (field == (*it)->fields.end()) {
+        continue;
+      }
+      const Value *value = &field->second;
+      while (first.size() < name.size()) {
+        name.remove_prefix(first.size() + 1);
+        first = name.substr(0, name.find('.'));
+        auto next = value->fields.find(first);
+        if (next == value->fields.end()) {
+          return false;
+        }
+        value = &next->second;
+      }
+      stack_.push_back(value);
+      return true;
+    }
+    return false;
+  }
+  void push_item(std::size_t index) override {
+    stack_.push_back(&stack_.back()->items[index]);
+  }
+  void pop() override { stack_.pop_back(); }
+  std::size_t list_size() override {
+    return stack_.back()->is_list ? stack_.back()->items.size() : kNotAList;
+  }
+  bool truthy() override { return stack_.back()->flag; }
+  void append(std::string &out) override { out += stack_.back()->text; }
+  void enter() override { sections_.push_back(stack_.back()); }
+  void leave() override { sections_.pop_back(); }
+
+private:
+  std::vector<const Value *> sections_;
+  std::vector<const Value *> stack_;
+};
+
+std::string render(std::string_view source, const Value &root) {
+  ValueContext context(root);
+  return Templates::Template::compile(source).render(context);
+}
+
+TEST(TemplateTest, RendersVariablesSectionsAndComments) {
+  Value root = Value::map({
+      {"name", str("demo")},
+      {"project", Value::map({{"version", str("1.2")}})},
+      {"debug", Value::boolean(false)},
+      {"sources", Value::list({Value::map({{"file", str("a.c")}}),
+                               Value::map({{"file", str("b.c")}})})},
+      {"empty", Value::list({})},
+  });
+
+  EXPECT_EQ(render("project({{name}} VERSION {{ project.version }})", root),
+            "project(demo VERSION 1.2)");
+  EXPECT_EQ(render("{{{name}}}{{&name}}{{missing}}{{! note }}", root),
+            "demodemo");
+  EXPECT_EQ(render("{{#sources}}{{file}} in {{name}};{{/sources}}", root),
+            "a.c in demo;b.c in demo;");
+  EXPECT_EQ(render("{{#debug}}-g{{/debug}}{{^debug}}-O2{{/debug}}", root),
+            "-O2");
+  EXPECT_EQ(render("{{^empty}}none{{/empty}}{{#empty}}x{{/empty}}", root),
+            "none");
+}
+
+TEST(TemplateTest, StandaloneTagsTakeTheirLine) {
+  Value root = Value::map({
+      {"items", Value::list({str("x"), str("y")})},
+  });
+
+  EXPECT_EQ(render("begin\n"
+                   "  {{#items}}\n"
+                   "  item {{.}}\n"
+                   "  {{/items}}\n"
+                   "  {{! comment }}\r\n"
+                   "end\n",
+                   root),
+            "begin\n  item x\n  item y\nend\n");
+  // Not alone on its line: kept
+  EXPECT_EQ(render("a {{#items}}{{.}}{{/items}} b\n", root), "a xy b\n");
+}
+
+TEST(TemplateTest, RejectsMalformedTemplates) {
+  EXPECT_THROW(Templates::Template::compile("{{name"), std::invalid_argument);
+  EXPECT_THROW(Templates::Template::compile("{{#a}}"), std::invalid_argument);
+  EXPECT_THROW(Templates::Template::compile("{{#a}}{{/b}}"),
+               std::invalid_argument);
+  EXPECT_THROW(Templates::Template::compile("{{/a}}"), std::invalid_argument);
+  EXPECT_THROW(Templates::Template::compile("{{}}"), std::invalid_argument);
+}
+
+TEST(TemplateTest, CacheCompilesEachSourceOnce) {
+  Templates::TemplateCache cache;
+  std::string source = "{{a}}";
+  auto first = cache.get(source);
+  auto second = cache.get(std::string("{{a}}"));
+  EXPECT_EQ(first, second);
+  EXPECT_NE(cache.get("{{b}}"), first);
+  EXPECT_EQ(cache.size(), 2u);
+  EXPECT_THROW(cache.get("{{#a}}"), std::invalid_argument);
+  EXPECT_EQ(cache.size(), 2u);
+}
+
+} // namespace template_test
@@ -0,0 +1,73 @@
+// Build-time helper: compiles a Lua script into a bytecode file that
+// cmake/embed_lua.cmake then embeds in the library.
+// Usage: compile_lua <input.lua> <output.luac>
+//
+// Built against the same Lua library as cdirnuts, so the bytecode always
+// matches the interpreter that loads it. Debug information is kept: errors
+// raised by the embedded script still report its line numbers.
+
+extern "C" {
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+}
+
+// Lua 5.1 and LuaJIT 2.0 predate LUA_OK
+#ifndef LUA_OK
+#define LUA_OK 0
+#endif
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+namespace {
+
+int append_chunk(lua_State *, const void *data, size_t size, void *output) {
+  static_cast<std::string *>(output)->append(static_cast<const char *>(data),
+                                             size);
+  return 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " <input.lua> <output.luac>\n";
+    return 2;
+  }
+
+  lua_State *state = luaL_newstate();
+  if (state == nullptr) {
+    std::cerr << "compile_lua: cannot create a Lua state\n";
+    return 1;
+  }
+
+  // luaL_loadfile skips a '#!' first line like the interpreter does
+  if (luaL_loadfile(state, argv[1]) != LUA_OK) {
+    std::cerr << "compile_lua: " << lua_tostring(state, -1) << '\n';
+    lua_close(state);
+    return 1;
+  }
+
+  std::string bytecode;
+#if LUA_VERSION_NUM >= 503
+  int dumped = lua_dump(state, append_chunk, &bytecode, 0);
+#else
+  int dumped = lua_dump(state, append_chunk, &bytecode);
+#endif
+  lua_close(state);
+  if (dumped != 0 || bytecode.empty()) {
+    std::cerr << "compile_lua: cannot dump " << argv[1] << '\n';
+    return 1;
+  }
+
+  std::ofstream output(argv[2], std::ios::binary | std::ios::trunc);
+  output.write(bytecode.data(), static_cast<std::streamsize>(bytecode.size()));
+  if (!output) {
+    std::cerr << "compile_lua: cannot write " << argv[2] << '\n';
+    return 1;
+  }
+  return 0;
+}